@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <strings.h>
@@ -10,18 +11,63 @@
 #include <ctype.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <setjmp.h>
+#include <stdnoreturn.h>
 #include <errno.h>
+#include <stdatomic.h>
 
 #define MAX(x, y) ((x) < (y) ? (y) : (x))
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 
-#define STREAM stdout
 #define ERROR stderr
 
 typedef struct Type Type;
 typedef struct Node Node;
 typedef struct Member Member;
 
+/* arena.c */
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct{
+    ArenaBlock *head;
+}Arena;
+
+typedef struct{
+    ArenaBlock *block;
+    size_t used;
+}ArenaMark;
+
+void *arena_alloc(Arena *arena, size_t size);
+ArenaMark arena_mark(Arena *arena);
+void arena_reset(Arena *arena, ArenaMark mark);
+void arena_release(Arena *arena);
+void arena_adopt(Arena *dst, Arena *src);
+
+/* hashmap.c */
+typedef struct{
+    char *key;
+    int keylen;
+    void *val;
+}HashEntry;
+
+typedef struct{
+    HashEntry *buckets;
+    int capacity;
+    int used;
+}HashMap;
+
+void *hashmap_get(HashMap *map, char *key);
+void *hashmap_get2(HashMap *map, char *key, int keylen);
+void hashmap_put(HashMap *map, char *key, void *val);
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
+void *hashmap_get_ptr(HashMap *map, void *key);
+void hashmap_put_ptr(HashMap *map, void *key, void *val);
+void hashmap_free(HashMap *map);
+uint64_t fnv_hash(char *s, int len);
+
+/* pool.c */
+void parallel_for(int n, int nthreads, void (*fn)(int i, void *arg), void *arg);
+
 /* tokenize.c */
 typedef struct Token Token;
 
@@ -31,29 +77,198 @@ typedef enum{
     TK_KEYWORD, // keyword
     TK_NUM,
     TK_STR,
-    TK_EOF
+    TK_EOF,
+    TK_INVALID, // 閉じられていない文字列リテラルか文字リテラルの引用符。パーサに渡す時にエラーにする
+    TK_PP_END // プリプロセッサの内部でだけ使う。マクロの展開結果の終わりの印
 }TokenKind;
 
+/* 区切り文字とキーワードのID。1文字の区切り文字は文字コードをそのままIDとして使う。 */
+typedef enum{
+    PUNCT_EQ = 256, // ==
+    PUNCT_NE, // !=
+    PUNCT_LE, // <=
+    PUNCT_GE, // >=
+    PUNCT_ARROW, // ->
+    PUNCT_SHL_ASSIGN, // <<=
+    PUNCT_SHR_ASSIGN, // >>=
+    PUNCT_ADD_ASSIGN, // +=
+    PUNCT_SUB_ASSIGN, // -=
+    PUNCT_MUL_ASSIGN, // *=
+    PUNCT_DIV_ASSIGN, // /=
+    PUNCT_MOD_ASSIGN, // %=
+    PUNCT_OR_ASSIGN, // |=
+    PUNCT_XOR_ASSIGN, // ^=
+    PUNCT_AND_ASSIGN, // &=
+    PUNCT_INC, // ++
+    PUNCT_DEC, // --
+    PUNCT_LOGOR, // ||
+    PUNCT_LOGAND, // &&
+    PUNCT_SHL, // <<
+    PUNCT_SHR, // >>
+    PUNCT_ELLIPSIS, // ...
+    PUNCT_HASHHASH, // ##
+    KW_RETURN,
+    KW_IF,
+    KW_ELSE,
+    KW_WHILE,
+    KW_FOR,
+    KW_INT,
+    KW_SIZEOF,
+    KW_CHAR,
+    KW_STRUCT,
+    KW_UNION,
+    KW_LONG,
+    KW_SHORT,
+    KW_VOID,
+    KW_TYPEDEF,
+    KW_BOOL, // _Bool
+    KW_ENUM,
+    KW_STATIC,
+    KW_GOTO,
+    KW_BREAK,
+    KW_CONTINUE,
+    KW_SWITCH,
+    KW_CASE,
+    KW_DEFAULT,
+    KW_EXTERN,
+    KW_ALIGNAS, // _Alignas
+    KW_ALIGNOF, // _Alignof
+    KW_DO,
+    KW_SIGNED,
+    KW_UNSIGNED,
+    KW_CONST,
+    KW_VOLATILE,
+    KW_AUTO,
+    KW_REGISTER,
+    KW_RESTRICT,
+    KW_RESTRICT2, // __restrict
+    KW_RESTRICT3, // __restrict__
+    KW_NORETURN // _Noreturn
+}TokenId;
+
 struct Token{
     Token* next;
     TokenKind kind;
+    int id; // TK_PUNCT or TK_KEYWORD。それ以外は0
     int64_t val;
     Type *ty; // TK_NUM or TK_STR
-    char* str;
+    char* str; // ソース上の位置
     int len; // トークンの長さ
+    int round; // 並列に字句解析した場合、何回目にまとめて読んだトークンか
+    union{
+        char *name; // TK_IDENT。internされた名前。TK_PP_ENDでは展開を終えたマクロの名前
+        char *data; // TK_STR。エスケープを解釈した中身
+    };
+    bool at_bol; // 行の最初のトークン
+    bool has_space; // 前に空白かコメントがある
 };
 
-void error(char *fmt, ...);
-void error_at(char *loc, char* fmt, ...);
+#define ATOM_SHARDS 64
+
+/* internした名前の表の一部。並列に字句解析するタスクが同時に使うので、名前のハッシュ値で表を分けてそれぞれにロックを付ける。 */
+typedef struct{
+    atomic_int lock;
+    HashMap map;
+}AtomShard;
+
+typedef struct LexRound LexRound;
+
+extern int lex_threads; // 字句解析に使うスレッドの数
+
+noreturn void error(char *fmt, ...);
+noreturn void error_at(char *loc, char* fmt, ...);
 bool is_ident(void);
 bool is_str(void);
 bool at_eof(void);
 void next_token(void);
-bool is_equal(Token *tok, char *op);
-bool consume(char* op);
-void expect(char* op);
+Token *next_of(Token *tok);
+void discard_tokens(void);
+Token *keep_token(Token *tok);
+char *intern(char *s, int len);
+bool is_equal(Token *tok, int id);
+bool consume(int id);
+void expect(int id);
 uint64_t expect_number(void);
+Token *lex_next(void);
+Token *lex_buffer(char *p, Arena *arena);
+Token *lex_from(char **pos, bool *bol, Arena *arena);
+char *skip_string(char *p);
+char *skip_char(char *p);
+Token *copy_token(Token *tok);
+Token *copy_list(Token *tok);
 void tokenize(char *path, char* p);
+void free_lexer(void);
+
+/* preprocess.c */
+typedef struct File File;
+typedef struct Include Include;
+typedef struct CondIncl CondIncl;
+
+/* 読み込んだソースファイル。エラーの位置を表示するのに使う。 */
+struct File{
+    File *next;
+    char *name;
+    char *contents;
+    size_t len;
+    size_t map_len; // contentsをmmapした大きさ。0ならmalloc
+    char *line_pos; // __LINE__で最後に行番号を求めた位置。NULLなら先頭
+    int line_no;
+};
+
+typedef Token *macro_handler_fn(Token *tok);
+typedef struct Macro Macro;
+
+struct Macro{
+    char *name;
+    bool is_objlike;
+    char **params; // internした引数の名前
+    int nparams;
+    bool is_variadic; // 最後の引数が__VA_ARGS__
+    Token *body;
+    macro_handler_fn *handler; // __FILE__, __LINE__
+    bool busy; // 展開中
+};
+
+typedef struct{
+    char *path; // 最初にincludeしたときのパス
+    char *guard; // include guardのマクロの名前
+    bool once; // #pragma once
+}FileInfo;
+
+File *find_file(char *loc);
+void register_macro(Macro *m);
+void register_file_info(char *path, FileInfo *info);
+Token *preprocess_next(void);
+void init_preprocessor(void);
+void discard_pp_tokens(void);
+void free_preprocessor(void);
+
+/* scan.c */
+#define SCAN_PADDING 32 // 入力の終端の'\0'の後ろに必要な読める領域の大きさ
+
+#define CC_SPACE 1
+#define CC_DIGIT 2
+#define CC_IDENT 4 // 英数字と_
+
+extern const unsigned char char_class[256];
+#define is_space_char(c) (char_class[(unsigned char)(c)] & CC_SPACE)
+#define is_digit_char(c) (char_class[(unsigned char)(c)] & CC_DIGIT)
+#define is_ident_char(c) (char_class[(unsigned char)(c)] & CC_IDENT)
+
+typedef enum{
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2
+}ScanImpl;
+
+ScanImpl scan_select(ScanImpl impl);
+char *skip_space(char *p);
+char *skip_ident(char *p);
+char *find_newline(char *p);
+char *find_comment_end(char *p);
+char *find_line_comment_end(char *p);
+char *find_string_special(char *p);
+char *find_literal_start(char *p);
 
 /* type.c */
 typedef enum{
@@ -83,19 +298,25 @@ struct Type{
     Token *name;
     Token *name_pos;
 
-    /* array */
-    int array_len;
-
-    /* struct members */
-    Member *members;
-    bool is_flexible; // flexible array member or not
-
-    /* function type */
-    Type *ret_ty;
-    Type *next;
-    Type *params;
-    bool is_variadic;
-
+    Type *next; // 引数リスト
+
+    /* kindごとに使うフィールド */
+    union{
+        int array_len; // TY_ARRAY
+
+        /* TY_STRUCT, TY_UNION */
+        struct{
+            Member *members;
+            bool is_flexible; // flexible array member or not
+        };
+
+        /* TY_FUNC */
+        struct{
+            Type *ret_ty;
+            Type *params;
+            bool is_variadic;
+        };
+    };
 };
 
 extern Type *ty_long;
@@ -111,12 +332,14 @@ extern Type *ty_ulong;
 
 Type *enum_type(void);
 
+bool is_builtin(Type *ty);
 Type *new_type(TypeKind kind, int size, int align);
 Type* pointer_to(Type *base);
 Type* array_of(Type *base, int len);
 Type* func_type(Type *ret_ty);
 Type* copy_type(Type *ty);
 Type *struct_type(void);
+void share_type(Type *ty);
 bool is_integer(Type *ty);
 bool is_ptr(Type* ty);
 bool is_void(Type *ty);
@@ -131,7 +354,7 @@ void add_type(Node* np);
 struct Member{
     Member *next;
     Type *ty;
-    Token *name;
+    char *name; // internされた名前
     int offset;
     int idx; // 何番目のメンバか    
     int align; // alignment
@@ -214,6 +437,8 @@ typedef enum{
     ND_MEMZERO // zero clear stack variable
 }NodeKind;
 
+/*  kindごとに使うフィールドだけを共用体にまとめている。new_nodeはkindが使う部分までしか確保しないので、
+    kindに対応しないフィールドには触れないこと。 */
 struct Node{
     Node* next;
     NodeKind kind;
@@ -221,42 +446,340 @@ struct Node{
 
     Node *lhs; // left hand side
     Node *rhs; // right hand side
-   
-   /* if while for statement */
-    Node* cond; 
-    Node* then; 
-    Node* els; 
-    Node* init; 
-    Node* inc; 
-    char *brk_label;
-    char *cont_label;
 
-    Member *member; // 構造体のメンバ
+    union{
+        int64_t val; // ND_NUM
+        Obj* var; // ND_VAR, ND_MEMZERO
+        Member *member; // ND_MEMBER
+        Node* body; // ND_BLOCK, ND_STMT_EXPR
+
+        /* ND_FUNCCALL */
+        struct{
+            char* funcname;
+            Node* args;
+        };
+
+        /* ND_GOTO, ND_LABEL, ND_CASE */
+        struct{
+            char *unique_label;
+            union{
+                struct{
+                    char *label;
+                    Node *goto_next;
+                }; // ND_GOTO, ND_LABEL
+                struct{
+                    int64_t case_val;
+                    Node *case_next;
+                }; // ND_CASE
+            };
+        };
+
+        /* ND_IF, ND_COND, ND_FOR, ND_DO, ND_SWITCH */
+        struct{
+            Node* cond;
+            Node* then;
+            Node* els;
+            char *brk_label;
+            char *cont_label;
+            union{
+                struct{
+                    Node* init;
+                    Node* inc;
+                }; // ND_FOR
+                struct{
+                    Node *cases; // caseのリスト
+                    Node *default_case;
+                }; // ND_SWITCH
+            };
+        };
+    };
+};
 
-    char* funcname; // function name
-    Node* args; // argments;
+typedef struct VarScope VarScope;
 
-    // goto and labeled statement
-    char *label;
-    char *unique_label;
-    Node *goto_next;
+struct VarScope{
+    char *name;
+    Obj *var;
+    Type *type_def;
+    Type *enum_ty;
+    int enum_val;
+};
 
-    // switch-case
-    Node *case_next;
-    Node *default_case; 
+typedef struct Scope Scope;
 
-    Node* body; // ND_BLOCK or ND_STMT_EXPR
-    int64_t val; // ND_NUM用
-    Obj* var; // ND_VAR用
+/* Cには変数のスコープと構造体タグのスコープがある。どちらも名前をキーにしたハッシュテーブル。 */
+struct Scope{
+    Scope *next;
+    HashMap vars; // VarScope
+    HashMap tags; // Type
+    ArenaMark mark; // このスコープを作る前のscope_arenaの位置
 };
 
-extern Token *token;
-
 Obj* parse(void);
+int64_t eval_pp_expr(Token *tok);
+void free_scopes(void);
 Node *new_cast(Node *lhs, Type *ty);
 
 /* codegen.c */
+extern int codegen_threads; // 関数のコード生成に使うスレッドの数
 void codegen(Obj *program);
 int align_to(int offset, int align);
 
+/* elf.c */
+typedef struct Assembler Assembler;
+
+void assemble(void);
+void free_assembler(void);
+
+/* emit.c */
+typedef struct{
+    char *data;
+    size_t len;
+    size_t cap;
+}Buffer;
+
+/* 命令。codegenはemit_instなどで命令を一つずつ渡し、emit.cが-Sならアセンブリの行に、-cならInstRecordにする */
+typedef enum{
+    I_MOV, I_PUSH, I_POP, I_LEA, I_ADD, I_SUB, I_OR, I_AND, I_XOR, I_CMP, I_IMUL,
+    I_MOVSX, I_MOVZX, I_MOVSXD, I_MOVSD, I_NEG, I_NOT, I_DIV, I_IDIV, I_SHL, I_SHR, I_SAR,
+    I_CALL, I_JMP, I_JCC, I_SETCC, I_RET, I_CQO, I_CDQ, I_REP_STOSB,
+    /* ディレクティブとラベル */
+    I_SECTION, I_GLOBAL, I_LOCAL, I_ALIGN, I_ZERO, I_BYTE, I_QUAD, I_QUAD_SYM, I_ASCII, I_STRING, I_LABEL,
+}InstOp;
+
+/* jcc, setccの条件。値はx86の条件コード */
+typedef enum{
+    CC_B = 2, CC_AE = 3, CC_E = 4, CC_NE = 5, CC_BE = 6, CC_A = 7, CC_L = 12, CC_GE = 13, CC_LE = 14, CC_G = 15,
+}CondCode;
+
+typedef enum{ SEC_TEXT, SEC_DATA, SEC_BSS, SEC_RODATA, NSECTIONS }SectionId;
+
+/* レジスタの番号。xmmは大きさ16で区別する */
+enum{ RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+typedef enum{ OP_NONE, OP_REG, OP_IMM, OP_MEM, OP_SYM }OperandKind;
+
+#define RIP -1
+
+typedef struct{
+    OperandKind kind;
+    int reg; // OP_REG
+    int size; // レジスタの大きさ。xmmは16。メモリはBYTE PTRなどで指定する大きさ、なければ0
+    int base; // OP_MEM。RIPならsymからの相対
+    int64_t imm; // OP_IMM
+    int64_t disp; // OP_MEM
+    char *sym; // OP_MEMでRIP相対の場合とOP_SYM
+}Operand;
+
+/*  -cの場合にctx -> outに並べる命令。名前(symか、ラベルなどの名前)や.asciiの中身はnbytesバイトで後ろに続き、
+    全体を8バイトに揃える。ポインタを持たないので、関数ごとに作った列をつなげてもそのまま読める。 */
+typedef struct{
+    uint32_t len; // 後ろのバイト列を含めた大きさ
+    uint8_t op; // InstOp
+    uint8_t cc; // I_JCC, I_SETCC
+    uint8_t nops;
+    Operand ops[2]; // symは書かない。読む側が後ろのバイト列を指すようにする
+    int64_t val; // I_SECTION, I_ALIGN, I_ZERO, I_BYTE, I_QUAD, I_QUAD_SYMの加数
+    uint32_t nbytes;
+}InstRecord;
+
+extern char *inst_names[];
+void buf_append(Buffer *buf, char *s, size_t len);
+void emit(char *s);
+void emitf(char *fmt, ...);
+Operand reg_op(int reg, int size);
+Operand imm_op(int64_t val);
+Operand mem_op(int base, int64_t disp, int size);
+Operand rip_op(char *sym);
+void emit_inst(InstOp op, int nops, Operand *a, Operand *b);
+void emit_setcc(CondCode cc, Operand *a);
+void emit_branch(InstOp op, CondCode cc, char *fmt, ...);
+void emit_label(char *fmt, ...);
+void emit_directive(InstOp op, int64_t val, char *fmt, ...);
+void emit_string(char *s, int len, bool nul_terminated);
+char *cond_name(CondCode cc);
+
+/* compile.c */
+typedef struct PchImage PchImage;
+typedef struct SharedImage SharedImage;
+
+/* 出力に関わるオプション。compile_withなら呼び出しごとに変えられる */
+typedef struct{
+    bool emit_object; // -c。アセンブリの代わりにELFの再配置可能オブジェクトを出力する
+    char **include_paths; // -Iで追加したディレクトリ
+    int ninclude_paths;
+    int dir_fd; // 相対パスの基準のディレクトリ。AT_FDCWDならカレントディレクトリ
+    bool emit_pch; // --emit-pch。コードの代わりにヘッダをパースした状態のイメージを出力する
+    char *include_pch; // --include-pch。このイメージを読んだ状態からパースを始める
+}CompileOptions;
+
+/*  一回のコンパイルの状態。compile()が作ってctxにセットし、各段階はctxを通して参照する。
+    ctxはスレッドごとにあるので、別のスレッドでは同時に別のコンパイルができる。 */
+typedef struct{
+    /* 入力 */
+    CompileOptions *opts;
+    char *path;
+    char *input;
+    size_t map_len; // inputをmmapした大きさ。0ならmalloc
+
+    Buffer out; // アセンブリ
+    Buffer diag; // エラーメッセージ
+    jmp_buf jmp; // errorはここに戻る
+
+    Arena token_arena; // 宣言の名前のToken, 識別子の名前, 文字列リテラル
+    Arena node_arena; // Node, Obj, Relocation, グローバル変数の初期値
+    Arena type_arena; // Type, Member, TypeKey
+    Arena scope_arena; // Scope, VarScope。ブロックを抜けると解放する。
+    Arena init_arena; // Initializer。初期化式を処理し終わると解放する。
+
+    /* tokenize.c */
+    Token *token; // 現在のトークン
+    char *lex_pos; // 次にトークナイズする位置
+    Arena token_window[2]; // トークンは2つのアリーナを交互に使って確保し、discard_tokensで古い方を解放する。
+    int cur_window;
+    AtomShard *atoms; // internした名前。ATOM_SHARDS個に分けてある。並列の字句解析のタスクと共有する
+
+    /* 並列の字句解析。lex_bounds[i]からlex_bounds[i+1]までがi番目のチャンク。 */
+    char **lex_bounds;
+    int lex_nchunks; // 0なら逐次に字句解析する
+    int lex_next_chunk; // 次に字句解析するチャンク
+    char *lex_end; // タスクが字句解析するチャンクの終わり。NULLなら入力の最後まで
+    int lex_round; // まとめて字句解析した回数
+    LexRound *lex_rounds; // 古い順。discard_tokensで現在のトークンより前の回を解放する
+    Arena *lex_arena; // NULLでなければlexはトークンをここに確保する
+    bool lex_bol; // 次に読むトークンが行頭
+
+    /* preprocess.c */
+    File *files; // includeしたファイル
+    HashMap macros; // internした名前 -> Macro
+    uint64_t macro_bits[64]; // 定義したことのあるマクロの名前のアドレスから作ったビット。ほとんどの識別子はこれで表を引かずに済む
+    bool keyword_macros; // キーワードと同じ名前のマクロがある(#define __restrict restrictなど)
+    HashMap file_info; // includeしたファイル(デバイスとinode番号) -> FileInfo
+    HashMap missed_includes; // #includeで探して見つからなかったパス。--cacheのときだけ覚える
+    Include *include; // 読んでいるincludeファイル。NULLなら主ファイル
+    Include *retired; // 読み終えたincludeファイル。トークンはdiscard_tokensで解放する
+    CondIncl *cond; // #ifのネスト
+    Token *raw_cursor; // まとめて字句解析した主ファイルのトークンの、次に読むもの
+    Token *pending; // ソースより先に読むトークン。マクロの展開結果や読み戻したトークン
+    int expand_depth; // 展開し終えていないマクロの数
+    char *expand_loc; // 一番外側で展開しているマクロの名前の位置。__LINE__と__FILE__はここを使う
+    char *line_pos; // 主ファイルでFileのline_posとline_noにあたるもの
+    int line_no;
+
+    /* type.c */
+    HashMap type_table; // pointer, arrayの一意化用
+
+    /* parse.c */
+    Obj *locals;
+    Obj *globals;
+    Obj *current_fn; // 現在parseしている関数。コード生成中は生成している関数
+    Node *labels; // current_fn内のlabeled statementとgotoのリスト
+    Node *gotos;
+    char *brk_label;
+    char *cont_label;
+    Node *current_switch;
+    Scope *scope; // 現在のスコープ
+    int unique_idx; // new_unique_nameの通し番号
+
+    /* pch.c */
+    PchImage *pch; // --include-pchでmmapしたイメージ
+    size_t pch_len;
+    SharedImage *pch_shared; // NULLでなければpchは他のコンパイルと共有しているので、書き換えない
+    bool pch_private; // 共有しているイメージを書き換える必要があったので、自分用に読んでやり直す
+
+    /* codegen.c。関数ごとのタスクが自分用のCompilerを作って使う。 */
+    int depth;
+    int label_idx; // get_indexの通し番号。関数ごとに0から
+
+    /* elf.c */
+    Assembler *assembler; // assembleの途中の状態
+}Compiler;
+
+extern _Thread_local Compiler *ctx;
+
+/* コンパイルの結果。outとdiagのdataはfree_resultで解放する。 */
+typedef struct{
+    Buffer out; // アセンブリ
+    Buffer diag; // エラーメッセージ。成功した場合は空
+}CompileResult;
+
+extern CompileOptions compile_options; // compileとcompile_fileが使う。コマンドラインで設定する
+
+void add_include_path(CompileOptions *opts, char *dir);
+bool compile(char *path, char *src, size_t len, CompileResult *res);
+bool compile_with(CompileOptions *opts, char *path, char *src, size_t len, CompileResult *res);
+char *read_file(char *path, size_t *map_len);
+bool compile_file(char *path, CompileResult *res);
+void free_result(CompileResult *res);
+
+/* sha256.c */
+typedef struct{
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char buf[64];
+}Sha256;
+
+void sha256_init(Sha256 *s);
+void sha256_update(Sha256 *s, void *data, size_t len);
+void sha256_final(Sha256 *s, unsigned char digest[32]);
+
+/* cache.c */
+extern char *cache_dir;
+extern size_t cache_max_size;
+void cache_init(char *dir);
+bool cache_lookup(char *path, char *input, unsigned char key[32], Buffer *out);
+void cache_store(unsigned char key[32], File *files, HashMap *missed, Buffer *out);
+void cache_finish(bool print);
+
+/* path.c */
+char *output_path(char *input, char *dir, char *ext);
+
+/* server.c */
+#define REQUEST_MAGIC 0x39636302 // "9cc"と版
+/* サーバが受け付ける大きさの上限。これを超える要求は壊れているとみなして接続を切る */
+#define REQUEST_MAX_STRINGS (1 << 20)
+#define REQUEST_MAX_SRC ((uint64_t)1 << 30)
+
+/*  9cc-clientからの要求。この後にcwd、--include-pchのイメージ、-Iのディレクトリ、pathをNUL終端で並べたもの(strings_lenバイト)と
+    ソース(src_lenバイト)が続く。イメージはinclude_pchの場合だけある */
+typedef struct{
+    uint32_t magic;
+    uint32_t emit_object; // -c
+    uint32_t include_pch; // --include-pch
+    uint32_t ninclude_paths;
+    uint32_t strings_len;
+    uint32_t reserved;
+    uint64_t src_len;
+}Request;
+
+/* 要求への応答。この後に出力(out_lenバイト)とエラーメッセージ(diag_lenバイト)が続く */
+typedef struct{
+    uint32_t ok;
+    uint32_t reserved;
+    uint64_t out_len;
+    uint64_t diag_len;
+}Response;
+
+noreturn void serve(char *socket_path, int nthreads, char *cache, bool stats_print);
+
+/* pch.c */
+extern bool pch_share_images; // --server。読んだイメージを残しておき、コンパイルの間で共有する
+
+void pch_save(void);
+void pch_load(char *path);
+bool pch_is_shared(void *p);
+noreturn void pch_unshare(void);
+void free_pch(void);
+void pch_restore_scope(void);
+char *pch_find_atom(char *s, int len, uint64_t hash);
+
+/* jit.c */
+typedef struct{
+    char *name; // エラーメッセージ用
+    char *data; // ELFの再配置可能オブジェクト
+    size_t len;
+}ObjectFile;
+
+bool jit_run(ObjectFile *objs, int nobjs, int argc, char **argv, int *status);
+
 #endif
\ No newline at end of file
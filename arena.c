@@ -0,0 +1,75 @@
+#include "9cc.h"
+
+/* bump pointer方式のアロケータ。個々のオブジェクトは解放せず、アリーナごとまとめて解放する。*/
+
+#define BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct ArenaBlock{
+    ArenaBlock *next; // 一つ前に確保したブロック
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+static ArenaBlock *new_block(ArenaBlock *next, size_t size){
+    ArenaBlock *blk = malloc(sizeof(ArenaBlock) + size);
+    if(!blk)
+        error("out of memory");
+    blk -> next = next;
+    blk -> size = size;
+    blk -> used = 0;
+    return blk;
+}
+
+/* 0で初期化された領域を返す。callocの代わり。 */
+void *arena_alloc(Arena *arena, size_t size){
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock *blk = arena -> head;
+    if(!blk || blk -> size - blk -> used < size)
+        blk = arena -> head = new_block(blk, MAX(size, BLOCK_SIZE));
+
+    void *ptr = blk -> data + blk -> used;
+    blk -> used += size;
+    return memset(ptr, 0, size);
+}
+
+/* 現在の位置を記録する。arena_resetでこの位置まで巻き戻せる。 */
+ArenaMark arena_mark(Arena *arena){
+    ArenaMark mark = {arena -> head, arena -> head ? arena -> head -> used : 0};
+    return mark;
+}
+
+/* markより後に確保した領域をすべて解放する。 */
+void arena_reset(Arena *arena, ArenaMark mark){
+    while(arena -> head != mark.block){
+        ArenaBlock *blk = arena -> head;
+        arena -> head = blk -> next;
+        free(blk);
+    }
+    if(arena -> head)
+        arena -> head -> used = mark.used;
+}
+
+/* アリーナ全体を解放する。 */
+void arena_release(Arena *arena){
+    arena_reset(arena, (ArenaMark){});
+}
+
+/* srcのブロックをすべてdstに移す。srcは空になる。dstの今のブロックの後ろにつなぐので、dstはそのまま確保を続けられる。 */
+void arena_adopt(Arena *dst, Arena *src){
+    ArenaBlock *head = src -> head;
+    if(!head)
+        return;
+    ArenaBlock *tail = head;
+    while(tail -> next)
+        tail = tail -> next;
+
+    if(dst -> head){
+        tail -> next = dst -> head -> next;
+        dst -> head -> next = head;
+    }else{
+        dst -> head = head;
+    }
+    src -> head = NULL;
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+# 大きな関数をN個含む一つのファイルを、コード生成のスレッド数を変えてコンパイルする。
+# 字句解析と構文解析は1スレッドなので、その分は並列にならない。
+# usage: sh bench/backend.sh [N]
+
+N=${1:-2000}
+SRC=${TMPDIR:-/tmp}/9cc-bench-backend.$$.c
+trap 'rm -f $SRC' EXIT
+
+awk -v n=$N 'BEGIN{
+    for(i = 0; i < n; i++){
+        printf "int f%d(int x, int y){\n    int s = 0;\n", i;
+        for(j = 0; j < 50; j++)
+            printf "    for(int i = 0; i < x; i++){ if(i %% 3 == %d && y || s > i) s = s + i * %d; else s = s - y; }\n", j % 3, j;
+        printf "    return s;\n}\n";
+    }
+    printf "int main(){ return 0; }\n";
+}' > $SRC
+
+printf "%8s %10s\n" threads "time(ms)"
+j=1
+while [ $j -le $(nproc) ]; do
+    start=$(date +%s%N)
+    ./9cc -j $j $SRC > /dev/null || exit 1
+    end=$(date +%s%N)
+    printf "%8d %10d\n" $j $(((end - start) / 1000000))
+    j=$((j * 2))
+done
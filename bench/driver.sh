@@ -0,0 +1,27 @@
+#!/bin/sh
+# テストのソースをプリプロセスしたものをN個のファイルにコピーし、
+# 1スレッドとCPUの数のスレッドでまとめてコンパイルする時間を比べる。
+# usage: sh bench/driver.sh [N]
+
+N=${1:-2000}
+TMP=${TMPDIR:-/tmp}/9cc-bench-driver.$$
+trap 'rm -rf $TMP' EXIT
+mkdir -p $TMP/src $TMP/out
+
+i=0
+while [ $i -lt $N ]; do
+    for f in test/*.c; do
+        [ $i -lt $N ] || break
+        [ -f $TMP/$(basename $f) ] || ${CC:-cc} -E -P $f > $TMP/$(basename $f)
+        cp $TMP/$(basename $f) $TMP/src/$i.c
+        i=$((i + 1))
+    done
+done
+
+printf "%8s %10s\n" threads "time(ms)"
+for j in 1 $(nproc); do
+    start=$(date +%s%N)
+    ./9cc -j $j -d $TMP/out $TMP/src/*.c || exit 1
+    end=$(date +%s%N)
+    printf "%8d %10d\n" $j $(((end - start) / 1000000))
+done
@@ -0,0 +1,97 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettimeのため
+#include "../9cc.h"
+#include <time.h>
+
+/*  字句解析だけの速さを測る。入力を字句解析の各実装(scalar, SSE2, AVX2)で最後まで読み、MB/sを表示する。
+    続いて最も速い実装で、チャンクに区切って並列に字句解析した場合の速さをスレッドの数ごとに表示する。
+    9ccのmain.o以外のオブジェクトとリンクする。
+    usage: bench/lex file [回数] */
+
+static char *read_input(char *path, size_t *len){
+    FILE *fp = fopen(path, "r");
+    if(!fp)
+        error("cannot open %s: %s", path, strerror(errno));
+    fseek(fp, 0, SEEK_END);
+    size_t size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    // main.cのread_fileと同じく\n\0で終わらせ、その後ろに余白を付ける
+    char *buf = calloc(1, size + 2 + SCAN_PADDING);
+    if(fread(buf, 1, size, fp) != size)
+        error("%s: read error", path);
+    fclose(fp);
+    buf[size] = '\n';
+    *len = size + 1;
+    return buf;
+}
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// トークンの数を返す。トークンは溜め込まずに捨てていく。
+static long lex_all(char *buf){
+    tokenize("bench", buf);
+    long n = 1;
+    while(!at_eof()){
+        next_token();
+        if(++n % 4096 == 0)
+            discard_tokens();
+    }
+    free_preprocessor(); // 定義済みマクロは回ごとに作り直す
+    return n;
+}
+
+int main(int argc, char **argv){
+    if(argc < 2){
+        fprintf(ERROR, "usage: %s file [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int iter = argc > 2 ? atoi(argv[2]) : 5;
+
+    // compile()を通さずに字句解析だけを使うので、コンテキストを自分で用意する
+    Compiler c = {.opts = &compile_options};
+    ctx = &c;
+    if(setjmp(c.jmp)){
+        fwrite(c.diag.data, 1, c.diag.len, ERROR);
+        return EXIT_FAILURE;
+    }
+
+    size_t len;
+    char *buf = read_input(argv[1], &len);
+
+    static char *names[] = {"scalar", "sse2", "avx2"};
+    printf("%-8s %10s %10s %12s\n", "impl", "MB/s", "ms", "tokens");
+    for(ScanImpl impl = SCAN_SCALAR; impl <= SCAN_AVX2; impl++){
+        if(scan_select(impl) != impl)
+            continue; // このCPUでは使えない
+
+        double best = 1e9;
+        long ntok = 0;
+        for(int i = 0; i < iter; i++){
+            double start = now();
+            ntok = lex_all(buf);
+            best = MIN(best, now() - start);
+        }
+        printf("%-8s %10.1f %10.2f %12ld\n", names[impl], len / best / 1e6, best * 1e3, ntok);
+    }
+
+    // 1は逐次の字句解析
+    static int threads[] = {1, 4, 16, 32};
+    scan_select(SCAN_AVX2);
+    printf("\n%-8s %10s %10s %12s\n", "threads", "MB/s", "ms", "tokens");
+    for(int t = 0; t < sizeof(threads) / sizeof(*threads); t++){
+        lex_threads = threads[t];
+        double best = 1e9;
+        long ntok = 0;
+        for(int i = 0; i < iter; i++){
+            double start = now();
+            ntok = lex_all(buf);
+            best = MIN(best, now() - start);
+        }
+        printf("%-8d %10.1f %10.2f %12ld\n", threads[t], len / best / 1e6, best * 1e3, ntok);
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+#!/bin/sh
+# テストのソースをプリプロセスしたものを繋げて16MB程度の入力を作り、bench/lexで字句解析の速さを測る。
+# usage: sh bench/lex.sh [input]
+
+TMP=${TMPDIR:-/tmp}/9cc-bench-lex.$$
+trap 'rm -f $TMP $TMP.one' EXIT
+
+if [ -n "$1" ]; then
+    cp "$1" $TMP
+else
+    for f in test/*.c; do
+        ${CC:-cc} -E -P $f
+    done > $TMP.one
+    : > $TMP
+    while [ $(wc -c < $TMP) -lt 16000000 ]; do
+        cat $TMP.one >> $TMP
+    done
+fi
+echo "input: $(wc -c < $TMP) bytes"
+./bench/lex $TMP
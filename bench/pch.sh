@@ -0,0 +1,37 @@
+#!/bin/sh
+# 大きなヘッダをincludeするだけのファイルを、そのままと--include-pchでN回ずつコンパイルして時間を比べる。
+# usage: sh bench/pch.sh [N]
+
+N=${1:-10}
+TMP=${TMPDIR:-/tmp}/9cc-bench-pch.$$
+mkdir -p $TMP
+trap 'rm -rf $TMP' EXIT
+
+awk -v n=2000 'BEGIN{
+    print "#ifndef BIG_H\n#define BIG_H";
+    print "#define SQ(x) ((x) * (x))";
+    for(i = 0; i < n; i++){
+        printf "typedef struct s%d { int a; long b; char name[%d]; struct s%d *next; } s%d_t;\n", i, i % 13 + 1, i, i;
+        printf "enum e%d { E%d_A = %d, E%d_B };\n", i, i, i, i;
+        printf "int f%d(s%d_t *p, enum e%d e, char *fmt, ...);\n", i, i, i;
+        printf "extern s%d_t g%d[%d];\n", i, i, i % 5 + 1;
+        printf "#define M%d(x) (SQ(x) + %d)\n", i, i;
+    }
+    print "#endif";
+}' > $TMP/big.h
+printf '#include "big.h"\nint main(){ return M7(E3_B) + sizeof(s5_t); }\n' > $TMP/main.c
+./9cc --emit-pch -o $TMP/big.pch $TMP/big.h || exit 1
+
+printf "%-8s %10s %10s\n" mode "time(ms)" "per TU(ms)"
+for mode in header pch; do
+    opt=
+    [ $mode = pch ] && opt="--include-pch $TMP/big.pch"
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt $N ]; do
+        ./9cc $opt -o $TMP/main.s $TMP/main.c || exit 1
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    printf "%-8s %10d %10d\n" $mode $(((end - start) / 1000000)) $(((end - start) / 1000000 / N))
+done
@@ -0,0 +1,25 @@
+#!/bin/sh
+# グローバルな宣言の数を増やしながら9ccの実行時間を測る。
+# 名前の検索がO(1)ならば1宣言あたりの時間はほぼ一定になる。
+# usage: sh bench/scope.sh [9cc]
+
+CC9=${1:-./9cc}
+TMP=${TMPDIR:-/tmp}/9cc-bench-scope.$$
+trap 'rm -f $TMP' EXIT
+
+printf "%8s %10s %12s\n" globals "time(ms)" "ns/global"
+for n in 1000 2000 4000 8000 16000 32000; do
+    awk -v n=$n 'BEGIN{
+        for(i = 0; i < n; i++){
+            printf "typedef int t%d;\n", i;
+            printf "enum { e%d = %d };\n", i, i;
+            printf "t%d g%d = e%d;\n", i, i, i;
+        }
+        printf "int main(){ return g0 + e0; }\n";
+    }' > $TMP
+    start=$(date +%s%N)
+    $CC9 $TMP > /dev/null || exit 1
+    end=$(date +%s%N)
+    ns=$((end - start))
+    printf "%8d %10d %12d\n" $n $((ns / 1000000)) $((ns / n))
+done
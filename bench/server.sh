@@ -0,0 +1,28 @@
+#!/bin/sh
+# テストのソースを一つずつ別のプロセスでN回コンパイルし、9ccと、9cc --serverに頼む9cc-clientの時間を比べる。
+# makeが翻訳単位ごとにコンパイラを起動する場合と同じ。
+# usage: sh bench/server.sh [N]
+
+N=${1:-20}
+TMP=${TMPDIR:-/tmp}/9cc-bench-server.$$
+SOCK=$TMP/9cc.sock
+mkdir -p $TMP
+./9cc --server $SOCK &
+SERVER=$!
+trap 'kill $SERVER; rm -rf $TMP' EXIT
+while [ ! -S $SOCK ]; do sleep 0.1; done
+
+printf "%-10s %10s %10s\n" compiler "time(ms)" "per TU(us)"
+for cc in ./9cc ./9cc-client; do
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt $N ]; do
+        for f in test/*.c; do
+            NINECC_SERVER=$SOCK $cc -c -o $TMP/out.o $f || exit 1
+        done
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    n=$((N * $(ls test/*.c | wc -l)))
+    printf "%-10s %10d %10d\n" $(basename $cc) $(((end - start) / 1000000)) $(((end - start) / 1000 / n))
+done
@@ -0,0 +1,334 @@
+#define _GNU_SOURCE // mkostemp, asprintfのため
+#include "9cc.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*  --cacheで有効になる、コンパイル結果のキャッシュ。
+    キーは入力のバイト列(read_fileが返したもの)、ファイル名(__FILE__のため)、出力に関わるオプション(--include-pchならイメージの大きさと更新時刻)、
+    コンパイラの実行ファイルの大きさと更新時刻のSHA-256で、dir/キーの先頭2文字/残りのファイルに出力を置く。
+    #includeしたファイルはキーに入れられないので、パスと内容のハッシュをエントリに書いておき、読むときに確かめる。
+    #includeで探して見つからなかったパスも書いておき、読むときにまだないことを確かめる。-Iの前の方のディレクトリに
+    同じ名前のヘッダが後から置かれると、同じ入力でも別のファイルを読むことになるため。
+    エントリは同じディレクトリの一時ファイルに書いてからrenameするので、同時に走っている他のプロセスが書きかけを読むことはない。
+    読んだエントリは更新時刻を新しくし、大きさが上限を超えたら古いものから消す。
+    上限はサブディレクトリごとに1/256ずつ割り当てて、書いたサブディレクトリだけを調べる。 */
+
+#define ENTRY_MAGIC "9cc-cache-2\n"
+#define NSUBDIRS 256
+
+char *cache_dir; // NULLならキャッシュしない
+size_t cache_max_size = (size_t)1 << 30;
+static Sha256 cache_base; // コンパイラとオプションまでを入れた状態。キーはこれをコピーして作る
+
+static atomic_long nhits;
+static atomic_long nmisses;
+static atomic_long nstored;
+static atomic_long nevicted;
+
+void cache_init(char *dir){
+    cache_dir = dir;
+    mkdir(dir, 0755);
+
+    struct stat st = {};
+    stat("/proc/self/exe", &st);
+    sha256_init(&cache_base);
+    sha256_update(&cache_base, ENTRY_MAGIC, strlen(ENTRY_MAGIC));
+    sha256_update(&cache_base, &st.st_size, sizeof(st.st_size));
+    sha256_update(&cache_base, &st.st_mtim, sizeof(st.st_mtim));
+}
+
+/* ファイルの内容のハッシュ。read_fileと同じく、\nで終わっていなければ\nを足したものとして扱う */
+static bool hash_file(char *path, unsigned char digest[32]){
+    int fd = openat(ctx -> opts -> dir_fd, path, O_RDONLY);
+    if(fd == -1)
+        return false;
+    struct stat st;
+    if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)){
+        close(fd);
+        return false;
+    }
+
+    Sha256 s;
+    sha256_init(&s);
+    char *p = NULL;
+    if(st.st_size){
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p == MAP_FAILED){
+            close(fd);
+            return false;
+        }
+        sha256_update(&s, p, st.st_size);
+    }
+    if(!st.st_size || p[st.st_size - 1] != '\n')
+        sha256_update(&s, "\n", 1);
+    if(p)
+        munmap(p, st.st_size);
+    close(fd);
+    sha256_final(&s, digest);
+    return true;
+}
+
+/* キーのエントリのパス(dir/ab/cdef...)。subdirならそのディレクトリ(dir/ab) */
+static char *key_path(unsigned char key[32], bool subdir){
+    static char hex[] = "0123456789abcdef";
+    char name[65];
+    for(int i = 0; i < 32; i++){
+        name[i * 2] = hex[key[i] >> 4];
+        name[i * 2 + 1] = hex[key[i] & 15];
+    }
+    name[64] = '\0';
+
+    char *path;
+    if(subdir)
+        asprintf(&path, "%s/%.2s", cache_dir, name);
+    else
+        asprintf(&path, "%s/%.2s/%s", cache_dir, name, name + 2);
+    return path;
+}
+
+/* 入力からキーを作り、エントリがあればその出力をoutに入れてtrueを返す */
+bool cache_lookup(char *path, char *input, unsigned char key[32], Buffer *out){
+    CompileOptions *opts = ctx -> opts;
+    Sha256 s = cache_base;
+    sha256_update(&s, &opts -> emit_object, sizeof(opts -> emit_object));
+    sha256_update(&s, &opts -> emit_pch, sizeof(opts -> emit_pch));
+    if(opts -> include_pch){
+        /* イメージは読んだときに確かめてあるので、書き直されたかどうかだけ見る */
+        struct stat st = {};
+        fstatat(opts -> dir_fd, opts -> include_pch, &st, 0);
+        sha256_update(&s, opts -> include_pch, strlen(opts -> include_pch) + 1);
+        sha256_update(&s, &st.st_size, sizeof(st.st_size));
+        sha256_update(&s, &st.st_mtim, sizeof(st.st_mtim));
+    }
+    for(int i = 0; i < opts -> ninclude_paths; i++)
+        sha256_update(&s, opts -> include_paths[i], strlen(opts -> include_paths[i]) + 1);
+    sha256_update(&s, path, strlen(path) + 1);
+    sha256_update(&s, input, strlen(input));
+    sha256_final(&s, key);
+
+    char *entry = key_path(key, false);
+    int fd = open(entry, O_RDONLY);
+    free(entry);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1 || st.st_size < sizeof(ENTRY_MAGIC) - 1 + 4){
+        if(fd != -1)
+            close(fd);
+        nmisses++;
+        return false;
+    }
+
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    bool ok = data != MAP_FAILED && !memcmp(data, ENTRY_MAGIC, sizeof(ENTRY_MAGIC) - 1);
+    char *p = data + sizeof(ENTRY_MAGIC) - 1;
+    char *end = data + st.st_size;
+
+    /* includeしたファイル: 名前の長さ(4バイト)、名前、内容のハッシュ(32バイト)の並び。名前の長さ0で終わり */
+    while(ok){
+        uint32_t len;
+        if(end - p < 4){
+            ok = false;
+            break;
+        }
+        memcpy(&len, p, 4);
+        p += 4;
+        if(len == 0)
+            break;
+        if(end - p < len + 32){
+            ok = false;
+            break;
+        }
+        char *name = strndup(p, len);
+        unsigned char digest[32];
+        ok = hash_file(name, digest) && !memcmp(digest, p + len, 32);
+        free(name);
+        p += len + 32;
+    }
+
+    /* 見つからなかったパス: 名前の長さ(4バイト)、名前の並び。名前の長さ0で終わり */
+    while(ok){
+        uint32_t len;
+        if(end - p < 4){
+            ok = false;
+            break;
+        }
+        memcpy(&len, p, 4);
+        p += 4;
+        if(len == 0)
+            break;
+        if(end - p < len){
+            ok = false;
+            break;
+        }
+        char *name = strndup(p, len);
+        ok = faccessat(ctx -> opts -> dir_fd, name, R_OK, 0) == -1;
+        free(name);
+        p += len;
+    }
+
+    if(ok){
+        buf_append(out, p, end - p);
+        futimens(fd, NULL); // 最近使ったものとして残す
+        nhits++;
+    }else{
+        nmisses++;
+    }
+    if(data != MAP_FAILED)
+        munmap(data, st.st_size);
+    close(fd);
+    return ok;
+}
+
+/* サブディレクトリの大きさが上限を超えていたら、更新時刻の古いものから上限の9割まで消す。今書いたkeepは残す */
+typedef struct{
+    char *path;
+    size_t size;
+    struct timespec mtime;
+}Entry;
+
+static int compare_mtime(const void *a, const void *b){
+    const Entry *x = a, *y = b;
+    if(x -> mtime.tv_sec != y -> mtime.tv_sec)
+        return x -> mtime.tv_sec < y -> mtime.tv_sec ? -1 : 1;
+    return x -> mtime.tv_nsec < y -> mtime.tv_nsec ? -1 : x -> mtime.tv_nsec > y -> mtime.tv_nsec;
+}
+
+static void evict(char *subdir, char *keep){
+    DIR *d = opendir(subdir);
+    if(!d)
+        return;
+
+    Entry *entries = NULL;
+    int n = 0, cap = 0;
+    size_t total = 0;
+    for(struct dirent *de; (de = readdir(d));){
+        if(de -> d_name[0] == '.')
+            continue; // .、..と書きかけの一時ファイル
+        char *path;
+        asprintf(&path, "%s/%s", subdir, de -> d_name);
+        struct stat st;
+        if(stat(path, &st) == -1){
+            free(path);
+            continue;
+        }
+        if(n == cap){
+            cap = cap ? cap * 2 : 64;
+            entries = realloc(entries, cap * sizeof(Entry));
+        }
+        entries[n++] = (Entry){path, st.st_size, st.st_mtim};
+        total += st.st_size;
+    }
+    closedir(d);
+
+    size_t limit = cache_max_size / NSUBDIRS;
+    if(total > limit){
+        qsort(entries, n, sizeof(Entry), compare_mtime);
+        for(int i = 0; i < n && total > limit / 10 * 9; i++){
+            if(strcmp(entries[i].path, keep) && unlink(entries[i].path) == 0){
+                total -= entries[i].size;
+                nevicted++;
+            }
+        }
+    }
+    for(int i = 0; i < n; i++)
+        free(entries[i].path);
+    free(entries);
+}
+
+static bool write_all_fd(int fd, void *p, size_t len){
+    for(char *q = p; len;){
+        ssize_t n = write(fd, q, len);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        q += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* outをkeyのエントリとして書く。filesはincludeしたファイル、missedは探して見つからなかったパス。失敗してもコンパイルには影響しない */
+void cache_store(unsigned char key[32], File *files, HashMap *missed, Buffer *out){
+    Buffer buf = {};
+    buf_append(&buf, ENTRY_MAGIC, sizeof(ENTRY_MAGIC) - 1);
+    for(File *file = files; file; file = file -> next){
+        if(file -> name[0] == '<')
+            continue; // <built-in>
+        uint32_t len = strlen(file -> name);
+        unsigned char digest[32];
+        Sha256 s;
+        sha256_init(&s);
+        sha256_update(&s, file -> contents, file -> len);
+        sha256_final(&s, digest);
+        buf_append(&buf, (char *)&len, 4);
+        buf_append(&buf, file -> name, len);
+        buf_append(&buf, (char *)digest, 32);
+    }
+    buf_append(&buf, "\0\0\0\0", 4);
+    for(int i = 0; i < missed -> capacity; i++){
+        HashEntry *ent = &missed -> buckets[i];
+        if(!ent -> key)
+            continue;
+        uint32_t len = ent -> keylen;
+        buf_append(&buf, (char *)&len, 4);
+        buf_append(&buf, ent -> key, len);
+    }
+    buf_append(&buf, "\0\0\0\0", 4);
+
+    char *subdir = key_path(key, true);
+    char *tmp;
+    asprintf(&tmp, "%s/.tmp.XXXXXX", subdir);
+    mkdir(subdir, 0755);
+    char *entry = key_path(key, false);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if(fd != -1){
+        bool ok = write_all_fd(fd, buf.data, buf.len) && write_all_fd(fd, out -> data, out -> len);
+        fchmod(fd, 0644);
+        ok = close(fd) == 0 && ok && rename(tmp, entry) == 0;
+        if(ok){
+            nstored++;
+            evict(subdir, entry);
+        }else{
+            unlink(tmp);
+        }
+    }
+    free(entry);
+    free(tmp);
+    free(subdir);
+    free(buf.data);
+}
+
+/* 今回の回数を累計(dir/stats)に足し、printなら両方を表示する */
+void cache_finish(bool print){
+    long run[4] = {nhits, nmisses, nstored, nevicted};
+    long total[4] = {};
+
+    char *path;
+    asprintf(&path, "%s/stats", cache_dir);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    free(path);
+    if(fd != -1 && flock(fd, LOCK_EX) == 0){
+        char buf[128] = {};
+        if(pread(fd, buf, sizeof(buf) - 1, 0) > 0)
+            sscanf(buf, "%ld %ld %ld %ld", &total[0], &total[1], &total[2], &total[3]);
+        for(int i = 0; i < 4; i++)
+            total[i] += run[i];
+        int len = snprintf(buf, sizeof(buf), "%ld %ld %ld %ld\n", total[0], total[1], total[2], total[3]);
+        if(ftruncate(fd, 0) == 0)
+            pwrite(fd, buf, len, 0);
+    }
+    if(fd != -1)
+        close(fd);
+
+    if(print){
+        fprintf(ERROR, "cache: %ld hits, %ld misses, %ld stored, %ld evicted\n", run[0], run[1], run[2], run[3]);
+        long n = total[0] + total[1];
+        fprintf(ERROR, "cache total: %ld hits, %ld misses (%.1f%% hit), %ld stored, %ld evicted\n",
+                total[0], total[1], n ? 100.0 * total[0] / n : 0.0, total[2], total[3]);
+    }
+}
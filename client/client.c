@@ -0,0 +1,282 @@
+#define _GNU_SOURCE // asprintfのため
+#include "../9cc.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*  9cc-client。9ccと同じコマンドラインで、コンパイルを9cc --serverに頼む薄いクライアント。
+    ソケットは環境変数NINECC_SERVERで指定する。指定がないかつながらない場合や、
+    --runなどサーバでは扱えないオプションがある場合は、同じディレクトリの9ccをそのまま実行する。
+    --include-pchはイメージのパスをサーバに渡し、サーバが読んだイメージを使う。
+    コンパイラ本体をリンクしないので、起動は9ccより速い。 */
+
+typedef struct{
+    char *input;
+    char *output; // NULLなら標準出力
+}Job;
+
+static Job *jobs;
+static int njobs;
+static atomic_int next_job;
+static atomic_int nfailed;
+static pthread_mutex_t stderr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *socket_path;
+static char *cwd;
+static bool emit_object;
+static char *include_pch; // --include-pch
+static char **include_paths;
+static int ninclude_paths;
+
+/* 同じディレクトリの9ccに同じ引数で置き換わる */
+noreturn static void fallback(char **argv){
+    char self[4096];
+    ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    char *path = "9cc";
+    if(n > 0){
+        self[n] = '\0';
+        char *slash = strrchr(self, '/');
+        asprintf(&path, "%.*s/9cc", (int)(slash - self), self);
+    }
+    argv[0] = path;
+    execv(path, argv);
+    execvp("9cc", argv);
+    fprintf(ERROR, "9cc-client: cannot run 9cc: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static bool read_full(int fd, void *buf, size_t len){
+    for(char *p = buf; len;){
+        ssize_t n = read(fd, p, len);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, void *buf, size_t len){
+    for(char *p = buf; len;){
+        ssize_t n = write(fd, p, len);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static int connect_server(void){
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if(!socket_path || strlen(socket_path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void report(char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&stderr_lock);
+    vfprintf(ERROR, fmt, ap);
+    pthread_mutex_unlock(&stderr_lock);
+    va_end(ap);
+}
+
+static void append(Buffer *buf, char *s, size_t len){
+    if(buf -> len + len > buf -> cap){
+        buf -> cap = MAX(buf -> cap * 2, buf -> len + len);
+        buf -> data = realloc(buf -> data, buf -> cap);
+    }
+    memcpy(buf -> data + buf -> len, s, len);
+    buf -> len += len;
+}
+
+/* fdを最後まで読む */
+static bool read_input(int fd, Buffer *buf){
+    char tmp[64 * 1024];
+    for(;;){
+        ssize_t n = read(fd, tmp, sizeof(tmp));
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return n == 0;
+        append(buf, tmp, n);
+    }
+}
+
+static bool write_output(Job *job, char *data, size_t len){
+    if(!job -> output)
+        return write_full(STDOUT_FILENO, data, len);
+
+    int fd = open(job -> output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1)
+        return false;
+    bool ok = write_full(fd, data, len);
+    return close(fd) == 0 && ok;
+}
+
+/* 一つのファイルをサーバでコンパイルする。サーバとの通信に失敗したらfalse */
+static bool run_job(int sock, Job *job){
+    Buffer src = {};
+    int in = strcmp(job -> input, "-") ? open(job -> input, O_RDONLY) : STDIN_FILENO;
+    if(in == -1 || !read_input(in, &src)){
+        report("cannot open %s: %s\n", job -> input, strerror(errno));
+        nfailed++;
+        free(src.data);
+        return true;
+    }
+    if(in != STDIN_FILENO)
+        close(in);
+
+    Buffer strings = {};
+    append(&strings, cwd, strlen(cwd) + 1);
+    if(include_pch)
+        append(&strings, include_pch, strlen(include_pch) + 1);
+    for(int i = 0; i < ninclude_paths; i++)
+        append(&strings, include_paths[i], strlen(include_paths[i]) + 1);
+    append(&strings, job -> input, strlen(job -> input) + 1);
+
+    if(strings.len > REQUEST_MAX_STRINGS || src.len > REQUEST_MAX_SRC){
+        report("%s: too large to send to the server\n", job -> input);
+        nfailed++;
+        free(strings.data);
+        free(src.data);
+        return true;
+    }
+
+    Request req = {REQUEST_MAGIC, emit_object, include_pch != NULL, ninclude_paths, strings.len, 0, src.len};
+    Response resp;
+    bool ok = write_full(sock, &req, sizeof(req)) && write_full(sock, strings.data, strings.len) &&
+              write_full(sock, src.data, src.len) && read_full(sock, &resp, sizeof(resp));
+    free(strings.data);
+    free(src.data);
+    if(!ok)
+        return false;
+
+    char *out = malloc(resp.out_len + resp.diag_len + 1);
+    if(!read_full(sock, out, resp.out_len + resp.diag_len)){
+        free(out);
+        return false;
+    }
+    if(resp.diag_len)
+        report("%.*s", (int)resp.diag_len, out + resp.out_len);
+    if(resp.ok && !write_output(job, out, resp.out_len)){
+        report("%s: %s\n", job -> output ? job -> output : "write", strerror(errno));
+        resp.ok = false;
+    }
+    if(!resp.ok)
+        nfailed++;
+    free(out);
+    return true;
+}
+
+/* スレッドごとに一つ接続し、jobを順に取って処理する */
+static void *worker(void *arg){
+    int sock = connect_server();
+    for(;;){
+        int i = next_job++;
+        if(i >= njobs)
+            break;
+        if(sock == -1 || !run_job(sock, &jobs[i])){
+            report("9cc-client: lost connection to %s\n", socket_path);
+            nfailed++;
+        }
+    }
+    if(sock != -1)
+        close(sock);
+    return NULL;
+}
+
+int main(int argc, char **argv){
+    socket_path = getenv("NINECC_SERVER");
+    char **orig_argv = calloc(argc + 1, sizeof(char *));
+    memcpy(orig_argv, argv, argc * sizeof(char *));
+
+    /* --include-pchは取り除いてサーバに送る。他の長いオプション(--run、--cacheなど)はサーバに送れないので9ccに任せる */
+    int n = 1;
+    for(int i = 1; i < argc; i++){
+        if(!strcmp(argv[i], "--include-pch") && i + 1 < argc)
+            include_pch = argv[++i];
+        else if(!strncmp(argv[i], "--include-pch=", 14))
+            include_pch = argv[i] + 14;
+        else if(!strncmp(argv[i], "--", 2))
+            fallback(orig_argv);
+        else
+            argv[n++] = argv[i];
+    }
+    argc = n;
+    argv[argc] = NULL;
+
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *output = NULL;
+    char *dir = NULL;
+    int opt;
+    opterr = 0; // 間違ったオプションのメッセージは9ccが出す
+    while((opt = getopt(argc, argv, "cj:o:d:I:")) != -1){
+        switch(opt){
+            case 'c':
+                emit_object = true;
+                break;
+            case 'j':
+                nthreads = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'I':
+                include_paths = realloc(include_paths, (ninclude_paths + 1) * sizeof(char *));
+                include_paths[ninclude_paths++] = optarg;
+                break;
+            default:
+                fallback(orig_argv); // 使い方の表示も9ccに任せる
+        }
+    }
+
+    njobs = argc - optind;
+    if(njobs == 0 || nthreads < 1 || (output && (dir || njobs > 1)))
+        fallback(orig_argv);
+
+    /* 最初の接続で確かめ、サーバがいなければ9ccで実行する */
+    int probe = connect_server();
+    if(probe == -1)
+        fallback(orig_argv);
+    close(probe);
+    cwd = getcwd(NULL, 0);
+
+    jobs = calloc(njobs, sizeof(Job));
+    for(int i = 0; i < njobs; i++){
+        jobs[i].input = argv[optind + i];
+        if(output)
+            jobs[i].output = output;
+        else if(dir || emit_object || (njobs > 1 && strcmp(jobs[i].input, "-")))
+            jobs[i].output = output_path(jobs[i].input, dir, emit_object ? "o" : "s");
+    }
+
+    nthreads = MIN(nthreads, njobs);
+    if(nthreads == 1){
+        worker(NULL);
+    }else{
+        pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+        for(int i = 0; i < nthreads; i++)
+            pthread_create(&threads[i], NULL, worker, NULL);
+        for(int i = 0; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+    }
+    return nfailed ? EXIT_FAILURE : 0;
+}
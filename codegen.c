@@ -1,29 +1,46 @@
 #include "9cc.h"
 
-static Obj *current_fn; // 現在コードを生成している関数
-static int depth; 
 
-static char* argreg64[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
-static char* argreg32[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
-static char* argreg16[] = {"di", "si", "dx", "cx", "r8w", "r9w"};
-static char* argreg8[] = {"dil", "sil", "dl", "cl", "r8b", "r9b" };
+int codegen_threads = 1;
+
+static int argreg[] = {RDI, RSI, RDX, RCX, R8, R9};
 
 static void gen_expr(Node* node);
 static void gen_stmt(Node* node);
 
+static void inst0(InstOp op){
+    emit_inst(op, 0, NULL, NULL);
+}
+
+static void inst1(InstOp op, Operand a){
+    emit_inst(op, 1, &a, NULL);
+}
+
+static void inst2(InstOp op, Operand a, Operand b){
+    emit_inst(op, 2, &a, &b);
+}
+
+static void setcc(CondCode cc){
+    emit_setcc(cc, &(Operand){.kind = OP_REG, .reg = RAX, .size = 1});
+}
+
+/* 大きさsizeの値を入れるレジスタの大きさ */
+static int reg_size(int size){
+    return size == 1 || size == 2 || size == 4 ? size : 8;
+}
+
 static void push(void){
-    fprintf(STREAM, "\tpush rax\n");
-    depth++;
+    inst1(I_PUSH, reg_op(RAX, 8));
+    ctx -> depth++;
 }
 
-static void pop(char* arg){
-    fprintf(STREAM, "\tpop %s\n", arg);
-    depth--;
+static void pop(int reg){
+    inst1(I_POP, reg_op(reg, 8));
+    ctx -> depth--;
 }
 
 static int get_index(void){
-    static int index;
-    return index++;
+    return ctx -> label_idx++;
 }
 
 /* raxに入ってるアドレスにから値を読む。*/
@@ -32,56 +49,40 @@ static void load(Type* ty){
         return;
     }
 
-    char *inst = ty -> is_unsigned ? "movzx" : "movsx";
+    InstOp inst = ty -> is_unsigned ? I_MOVZX : I_MOVSX;
     
     /* sxはsign extendedの略 */
     switch(ty -> size){
         case 1:
-            fprintf(STREAM, "\t%s eax, BYTE PTR [rax]\n", inst); 
+            inst2(inst, reg_op(RAX, 4), mem_op(RAX, 0, 1)); 
             return;
         
         case 2:
-            fprintf(STREAM, "\t%s eax, WORD PTR [rax]\n", inst); 
+            inst2(inst, reg_op(RAX, 4), mem_op(RAX, 0, 2)); 
             return;
 
         case 4:
-            fprintf(STREAM, "\t%s rax, [rax]\n", "movsxd");
+            inst2(I_MOVSXD, reg_op(RAX, 8), mem_op(RAX, 0, 4));
             return;
         
         default:
-            fprintf(STREAM, "\tmov rax, [rax]\n");
+            inst2(I_MOV, reg_op(RAX, 8), mem_op(RAX, 0, 0));
             return;
     }
 }
 
 /* スタックに積まれているアドレスに値を格納。*/
 static void store(Type *ty){
-    pop("rdi");
+    pop(RDI);
     if(ty -> kind == TY_STRUCT || ty -> kind == TY_UNION){
         // 1byteずつコピーする
         for(int i = 0; i < ty -> size; i++){
-            fprintf(STREAM, "\tmov r8b, [rax + %d]\n", i);
-            fprintf(STREAM, "\tmov [rdi + %d], r8b\n", i);
+            inst2(I_MOV, reg_op(R8, 1), mem_op(RAX, i, 0));
+            inst2(I_MOV, mem_op(RDI, i, 0), reg_op(R8, 1));
         }
         return;
     }
-    switch (ty -> size){
-        case 1:
-            fprintf(STREAM, "\tmov [rdi], al\n");
-            return;
-        
-        case 2:
-            fprintf(STREAM, "\tmov [rdi], ax\n");
-            return;
-        
-        case 4:
-            fprintf(STREAM, "\tmov [rdi], eax\n");
-            return;
-        
-        default:
-            fprintf(STREAM, "\tmov [rdi], rax\n"); 
-            return;
-    }
+    inst2(I_MOV, mem_op(RDI, 0, 0), reg_op(RAX, reg_size(ty -> size)));
 }
 
 static void gen_expr(Node* node);
@@ -91,11 +92,11 @@ static void gen_addr(Node *node) {
     switch(node -> kind){
         case ND_VAR:
             if(node -> var -> is_global){
-                fprintf(STREAM, "\tlea rax, %s[rip]\n", node -> var -> name);
+                inst2(I_LEA, reg_op(RAX, 8), rip_op(node -> var -> name));
                 return;
             }
             else{
-                fprintf(STREAM, "\tlea rax, [rbp + %d]\n", node -> var -> offset);
+                inst2(I_LEA, reg_op(RAX, 8), mem_op(RBP, node -> var -> offset, 0));
                 return;
             }
         case ND_DEREF:
@@ -105,7 +106,7 @@ static void gen_addr(Node *node) {
         /* x.aはxのアドレス + aのoffset */
         case ND_MEMBER:
             gen_addr(node -> lhs);
-            fprintf(STREAM, "\tadd rax, %d\n", node -> member -> offset);
+            inst2(I_ADD, reg_op(RAX, 8), imm_op(node -> member -> offset));
             return;
 
         case ND_COMMA:
@@ -119,9 +120,9 @@ static void gen_addr(Node *node) {
 
 static void cmp_zero(Type *ty){
     if(is_integer(ty) && ty -> size <= 4)
-        fprintf(STREAM, "\tcmp eax, 0\n");
+        inst2(I_CMP, reg_op(RAX, 4), imm_op(0));
     else 
-        fprintf(STREAM, "\tcmp rax, 0\n");
+        inst2(I_CMP, reg_op(RAX, 8), imm_op(0));
 }
 
 enum { I8, I16, I32, I64, U8, U16, U32, U64};
@@ -144,15 +145,22 @@ static int getTypeId(Type *ty){
     return U64;
 }
 
+/* キャストの命令。raxの下位from_sizeバイトをto_sizeバイトに広げる */
+typedef struct{
+    InstOp op;
+    int to_size;
+    int from_size;
+}CastInst;
+
 // ex) i32i8: from I32 to I8
-static char i32i8[] = "movsx eax, al";
-static char i32u8[] = "movzx eax, al";
-static char i32i16[] = "movsx eax, ax";
-static char i32u16[] = "movzx eax, ax";
-static char i32i64[] = "movsxd rax, eax";
-static char u32i64[] = "mov eax, eax";
-
-static char *cast_table[][10] = {
+static CastInst i32i8[] = {{I_MOVSX, 4, 1}};
+static CastInst i32u8[] = {{I_MOVZX, 4, 1}};
+static CastInst i32i16[] = {{I_MOVSX, 4, 2}};
+static CastInst i32u16[] = {{I_MOVZX, 4, 2}};
+static CastInst i32i64[] = {{I_MOVSXD, 8, 4}};
+static CastInst u32i64[] = {{I_MOV, 4, 4}};
+
+static CastInst *cast_table[][10] = {
     // i8   i16     i32    i64      u8      u16      u32    u64
     {NULL,  NULL,   NULL,  i32i64,  i32u8,  i32u16,  NULL,  i32i64}, // i8
     {i32i8, NULL,   NULL,  i32i64,  i32u8,  i32u16,  NULL,  i32i64}, // i16
@@ -171,15 +179,16 @@ static void cast(Type *from, Type *to){
     }
     if(to -> kind == TY_BOOL){
         cmp_zero(from);
-        fprintf(STREAM, "\tsetne al\n");
-        fprintf(STREAM, "\tmovzx eax, al\n");
+        setcc(CC_NE);
+        inst2(I_MOVZX, reg_op(RAX, 4), reg_op(RAX, 1));
         return;
     }
     int t1 = getTypeId(from);
     int t2 = getTypeId(to);
     
-    if(cast_table[t1][t2])
-        fprintf(STREAM, "\t%s\n", cast_table[t1][t2]);
+    CastInst *c = cast_table[t1][t2];
+    if(c)
+        inst2(c -> op, reg_op(RAX, c -> to_size), reg_op(RAX, c -> from_size));
 }
 
 /* 式の評価結果はraxレジスタに格納される。 */
@@ -189,7 +198,7 @@ static void gen_expr(Node* node){
             return;
         
         case ND_NUM:
-            fprintf(STREAM, "\tmov rax, %ld\n", node -> val); /* ND_NUMなら入力が一つの数値だったということ。*/
+            inst2(I_MOV, reg_op(RAX, 8), imm_op(node -> val)); /* ND_NUMなら入力が一つの数値だったということ。*/
             return;
         
         case ND_VAR:
@@ -200,7 +209,7 @@ static void gen_expr(Node* node){
         
         case ND_NEG:
             gen_expr(node -> lhs);
-            fprintf(STREAM, "\tneg rax\n");
+            inst1(I_NEG, reg_op(RAX, 8));
             return;
 
         case ND_ASSIGN:
@@ -220,36 +229,36 @@ static void gen_expr(Node* node){
             }
             /* x86-64では先頭から6つの引数までをレジスタで渡す。 */
             for(int i = nargs - 1;  0 <= i; i--){
-                pop(argreg64[i]);
+                pop(argreg[i]);
             }
-            fprintf(STREAM, "\tmov rax, 0\n"); // 浮動小数点の引数の個数
+            inst2(I_MOV, reg_op(RAX, 8), imm_op(0)); // 浮動小数点の引数の個数
 
             // alignment
-            if(depth % 2 == 0)
-                fprintf(STREAM, "\tcall %s\n", node -> funcname);
+            if(ctx -> depth % 2 == 0)
+                emit_branch(I_CALL, 0, "%s", node -> funcname);
             else{
-                fprintf(STREAM, "\tsub rsp, 8\n");
-                fprintf(STREAM, "\tcall %s\n", node -> funcname);
-                fprintf(STREAM, "\tadd rsp, 8\n");
+                inst2(I_SUB, reg_op(RSP, 8), imm_op(8));
+                emit_branch(I_CALL, 0, "%s", node -> funcname);
+                inst2(I_ADD, reg_op(RSP, 8), imm_op(8));
             }
 
             switch(node -> ty -> kind){
                 case TY_BOOL:
-                    fprintf(STREAM, "\tmovzx eax, al\n");
+                    inst2(I_MOVZX, reg_op(RAX, 4), reg_op(RAX, 1));
                     return;
                 
                 case TY_CHAR:
                     if(node -> ty -> is_unsigned)
-                        fprintf(STREAM, "\tmovzx eax, al\n");
+                        inst2(I_MOVZX, reg_op(RAX, 4), reg_op(RAX, 1));
                     else
-                        fprintf(STREAM, "\tmovsx eax, al\n");
+                        inst2(I_MOVSX, reg_op(RAX, 4), reg_op(RAX, 1));
                     return;
 
                 case TY_SHORT:
                     if(node -> ty -> is_unsigned)
-                        fprintf(STREAM, "\tmovzx eax, ax\n");
+                        inst2(I_MOVZX, reg_op(RAX, 4), reg_op(RAX, 2));
                     else 
-                        fprintf(STREAM, "\tmovsx eax, ax\n");
+                        inst2(I_MOVSX, reg_op(RAX, 4), reg_op(RAX, 2));
                     return;
             }
             
@@ -267,14 +276,14 @@ static void gen_expr(Node* node){
 
         case ND_NOT:
             gen_expr(node -> lhs);
-            fprintf(STREAM, "\tcmp rax, 0\n");
-            fprintf(STREAM, "\tsete al\n");
-            fprintf(STREAM, "\tmovzx rax, al\n");
+            inst2(I_CMP, reg_op(RAX, 8), imm_op(0));
+            setcc(CC_E);
+            inst2(I_MOVZX, reg_op(RAX, 8), reg_op(RAX, 1));
             return;
         
         case ND_BITNOT:
             gen_expr(node ->lhs);
-            fprintf(STREAM, "\tnot rax\n");
+            inst1(I_NOT, reg_op(RAX, 8));
             return;
 
         case ND_STMT_EXPR:
@@ -290,22 +299,22 @@ static void gen_expr(Node* node){
 
         case ND_MEMZERO:
             // rep stosb 命令はmemset(rdi, al, rcx)と同じ
-            fprintf(STREAM, "\tmov rcx, %d\n", node -> var -> ty -> size);
-            fprintf(STREAM, "\tlea rdi, [rbp + %d]\n", node -> var -> offset);
-            fprintf(STREAM, "\tmov eax, 0\n");
-            fprintf(STREAM, "\trep stosb\n");
+            inst2(I_MOV, reg_op(RCX, 8), imm_op(node -> var -> ty -> size));
+            inst2(I_LEA, reg_op(RDI, 8), mem_op(RBP, node -> var -> offset, 0));
+            inst2(I_MOV, reg_op(RAX, 4), imm_op(0));
+            inst0(I_REP_STOSB);
             return;
 
         case ND_COND:{
             int idx = get_index();
             gen_expr(node -> cond);
-            fprintf(STREAM, "\tcmp rax, 0\n");
-            fprintf(STREAM, "\tje .L.else.%d\n", idx);
+            inst2(I_CMP, reg_op(RAX, 8), imm_op(0));
+            emit_branch(I_JCC, CC_E, ".L.else.%s.%d", ctx -> current_fn -> name, idx);
             gen_expr(node -> then);
-            fprintf(STREAM, "\tjmp .L.end.%d\n", idx);
-            fprintf(STREAM, ".L.else.%d:\n", idx);
+            emit_branch(I_JMP, 0, ".L.end.%s.%d", ctx -> current_fn -> name, idx);
+            emit_label(".L.else.%s.%d", ctx -> current_fn -> name, idx);
             gen_expr(node -> els);
-            fprintf(STREAM, ".L.end.%d:\n", idx);
+            emit_label(".L.end.%s.%d", ctx -> current_fn -> name, idx);
             return;
         }
         
@@ -317,32 +326,32 @@ static void gen_expr(Node* node){
         case ND_LOGOR:{
             int idx = get_index();
             gen_expr(node -> lhs);
-            fprintf(STREAM, "\tcmp rax, 0\n");
-            fprintf(STREAM, "\tjne .L.true.%d\n", idx);
+            inst2(I_CMP, reg_op(RAX, 8), imm_op(0));
+            emit_branch(I_JCC, CC_NE, ".L.true.%s.%d", ctx -> current_fn -> name, idx);
             gen_expr(node -> rhs);
-            fprintf(STREAM, "\tcmp rax, 0\n");
-            fprintf(STREAM, "\tjne .L.true.%d\n", idx);
-            fprintf(STREAM, "\tmov rax, 0\n");
-            fprintf(STREAM, "\tjmp .L.end.%d\n", idx);
-            fprintf(STREAM, ".L.true.%d:\n", idx);
-            fprintf(STREAM, "\tmov rax, 1\n");
-            fprintf(STREAM, ".L.end.%d:\n", idx);
+            inst2(I_CMP, reg_op(RAX, 8), imm_op(0));
+            emit_branch(I_JCC, CC_NE, ".L.true.%s.%d", ctx -> current_fn -> name, idx);
+            inst2(I_MOV, reg_op(RAX, 8), imm_op(0));
+            emit_branch(I_JMP, 0, ".L.end.%s.%d", ctx -> current_fn -> name, idx);
+            emit_label(".L.true.%s.%d", ctx -> current_fn -> name, idx);
+            inst2(I_MOV, reg_op(RAX, 8), imm_op(1));
+            emit_label(".L.end.%s.%d", ctx -> current_fn -> name, idx);
             return;
         }
         
         case ND_LOGAND:{
             int idx = get_index();
             gen_expr(node -> lhs);
-            fprintf(STREAM, "\tcmp rax, 0\n");
-            fprintf(STREAM, "\tje .L.false.%d\n", idx);
+            inst2(I_CMP, reg_op(RAX, 8), imm_op(0));
+            emit_branch(I_JCC, CC_E, ".L.false.%s.%d", ctx -> current_fn -> name, idx);
             gen_expr(node -> rhs);
-            fprintf(STREAM, "\tcmp rax, 0\n");
-            fprintf(STREAM, "\tje .L.false.%d\n", idx);
-            fprintf(STREAM, "\tmov rax, 1\n");
-            fprintf(STREAM, "\tjmp .L.end.%d\n", idx);
-            fprintf(STREAM, ".L.false.%d:\n", idx);
-            fprintf(STREAM, "\tmov rax, 0\n");
-            fprintf(STREAM, ".L.end.%d:\n", idx);
+            inst2(I_CMP, reg_op(RAX, 8), imm_op(0));
+            emit_branch(I_JCC, CC_E, ".L.false.%s.%d", ctx -> current_fn -> name, idx);
+            inst2(I_MOV, reg_op(RAX, 8), imm_op(1));
+            emit_branch(I_JMP, 0, ".L.end.%s.%d", ctx -> current_fn -> name, idx);
+            emit_label(".L.false.%s.%d", ctx -> current_fn -> name, idx);
+            inst2(I_MOV, reg_op(RAX, 8), imm_op(0));
+            emit_label(".L.end.%s.%d", ctx -> current_fn -> name, idx);
             return;
         }
     }
@@ -351,98 +360,91 @@ static void gen_expr(Node* node){
     gen_expr(node -> rhs);
     push();
     gen_expr(node -> lhs);
-    pop("rdi");
-
-    char *ax, *di, *dx;
+    pop(RDI);
 
-    if(node -> lhs -> ty -> kind == TY_LONG || node -> lhs -> ty -> base){
-        ax = "rax";
-        di = "rdi";
-        dx = "rdx";
-    }else{
-        ax = "eax";
-        di = "edi";
-        dx = "edx";
-    }
+    int size = node -> lhs -> ty -> kind == TY_LONG || node -> lhs -> ty -> base ? 8 : 4;
+    Operand ax = reg_op(RAX, size);
+    Operand di = reg_op(RDI, size);
+    Operand dx = reg_op(RDX, size);
 
     switch(node -> kind){
         case ND_ADD:
-            fprintf(STREAM, "\tadd %s, %s\n", ax, di);
+            inst2(I_ADD, ax, di);
             return;
     
         case ND_SUB:
-            fprintf(STREAM, "\tsub %s, %s\n", ax, di);
+            inst2(I_SUB, ax, di);
             return;
 
         case ND_MUL:
-            fprintf(STREAM, "\timul %s, %s\n", ax, di);
+            inst2(I_IMUL, ax, di);
             return;
 
         case ND_DIV:
         case ND_MOD:
             if(node -> lhs -> ty -> is_unsigned){
-                fprintf(STREAM, "\tmov %s, 0\n", dx); //　上位bit0埋め
-                fprintf(STREAM, "\tdiv %s\n", di);
+                inst2(I_MOV, dx, imm_op(0)); //　上位bit0埋め
+                inst1(I_DIV, di);
             }else{
                 if(node -> lhs -> ty -> size == 8)
-                    fprintf(STREAM, "\tcqo\n");
+                    inst0(I_CQO);
                 else 
-                    fprintf(STREAM, "\tcdq\n");
-                fprintf(STREAM, "\tidiv %s\n", di);
+                    inst0(I_CDQ);
+                inst1(I_IDIV, di);
             }
             if(node -> kind == ND_MOD)
-                fprintf(STREAM, "\tmov rax, rdx\n");
+                inst2(I_MOV, reg_op(RAX, 8), reg_op(RDX, 8));
             return;
 
         case ND_BITOR:
-            fprintf(STREAM, "\tor rax, rdi\n");
+            inst2(I_OR, reg_op(RAX, 8), reg_op(RDI, 8));
             return;
         
         case ND_BITXOR:
-            fprintf(STREAM, "\txor rax, rdi\n");
+            inst2(I_XOR, reg_op(RAX, 8), reg_op(RDI, 8));
             return;
         
         case ND_BITAND:
-            fprintf(STREAM, "\tand rax, rdi\n");
+            inst2(I_AND, reg_op(RAX, 8), reg_op(RDI, 8));
             return;
 
         case ND_SHL:
-            fprintf(STREAM, "\tmov rcx, rdi\n");
-            fprintf(STREAM, "\tshl rax, cl\n");
+            inst2(I_MOV, reg_op(RCX, 8), reg_op(RDI, 8));
+            inst2(I_SHL, reg_op(RAX, 8), reg_op(RCX, 1));
             return;
         
         case ND_SHR:
-            fprintf(STREAM, "\tmov rcx, rdi\n");
+            inst2(I_MOV, reg_op(RCX, 8), reg_op(RDI, 8));
             if(node -> lhs -> ty -> is_unsigned)
-                fprintf(STREAM, "\tshr %s, cl\n", ax);
+                inst2(I_SHR, ax, reg_op(RCX, 1));
             else
-                fprintf(STREAM, "\tsar %s, cl\n", ax);
+                inst2(I_SAR, ax, reg_op(RCX, 1));
             return;
         
         case ND_EQ:
         case ND_NE:
         case ND_LT:
         case ND_LE:
-            fprintf(STREAM, "\tcmp %s, %s\n", ax, di);
+            inst2(I_CMP, ax, di);
         if(node -> kind == ND_EQ){
-            fprintf(STREAM, "\tsete al\n");
+            setcc(CC_E);
         }
         else if(node -> kind == ND_NE){
-            fprintf(STREAM, "\tsetne al\n");
+            setcc(CC_NE);
         }
         else if(node -> kind == ND_LT){
             if(node -> lhs -> ty -> is_unsigned)
-                fprintf(STREAM, "\tsetb al\n");
+                setcc(CC_B);
             else
-                fprintf(STREAM, "\tsetl al\n");
+                setcc(CC_L);
         }
         else if(node -> kind == ND_LE){
             if(node -> lhs -> ty -> is_unsigned)
-                fprintf(STREAM, "\tsetbe al\n");
+                setcc(CC_BE);
             else 
-                fprintf(STREAM, "\tsetle al\n");
+                setcc(CC_LE);
         }
-        fprintf(STREAM, "\tmovzx rax, al\n");
+        inst2(I_MOVZX, reg_op(RAX, 8), reg_op(RAX, 1));
         return;
 
         error("invalid expression");
@@ -455,21 +457,21 @@ static void gen_stmt(Node* node){
         case ND_RET:
             if(node -> lhs)
                 gen_expr(node -> lhs);
-            fprintf(STREAM, "\tjmp .L.end.%s\n", current_fn -> name);
+            emit_branch(I_JMP, 0, ".L.end.%s", ctx -> current_fn -> name);
             return;
 
         case ND_IF:{
             int idx = get_index();
             gen_expr(node -> cond);
-            fprintf(STREAM, "\tcmp rax, 0\n");
-            fprintf(STREAM, "\tje .L.else.%d\n", idx); // 条件式が偽の時はelseに指定されているコードに飛ぶ
+            inst2(I_CMP, reg_op(RAX, 8), imm_op(0));
+            emit_branch(I_JCC, CC_E, ".L.else.%s.%d", ctx -> current_fn -> name, idx); // 条件式が偽の時はelseに指定されているコードに飛ぶ
             gen_stmt(node -> then); // 条件式が真の時に実行される。
-            fprintf(STREAM, "\tjmp .L.end.%d\n", idx);
-            fprintf(STREAM, ".L.else.%d:\n", idx);
+            emit_branch(I_JMP, 0, ".L.end.%s.%d", ctx -> current_fn -> name, idx);
+            emit_label(".L.else.%s.%d", ctx -> current_fn -> name, idx);
             if(node -> els){
                 gen_stmt(node -> els); // 条件式が偽の時に実行される。
             }
-            fprintf(STREAM, ".L.end.%d:\n", idx);
+            emit_label(".L.end.%s.%d", ctx -> current_fn -> name, idx);
             return;
         }
 
@@ -478,62 +480,61 @@ static void gen_stmt(Node* node){
             if(node -> init){
                 gen_stmt(node -> init);
             }
-            fprintf(STREAM, ".L.begin.%d:\n", idx);
+            emit_label(".L.begin.%s.%d", ctx -> current_fn -> name, idx);
             if(node -> cond){
                 gen_expr(node -> cond);
-                fprintf(STREAM, "\tcmp rax, 0\n");
-                fprintf(STREAM, "\tje %s\n", node -> brk_label); // 条件式が偽の時は終了
+                inst2(I_CMP, reg_op(RAX, 8), imm_op(0));
+                emit_branch(I_JCC, CC_E, "%s", node -> brk_label); // 条件式が偽の時は終了
 
             }
             gen_stmt(node -> then); // thenは必ずあることが期待されている。
-            fprintf(STREAM, "%s:\n", node -> cont_label);
+            emit_label("%s", node -> cont_label);
             if(node -> inc){
                 gen_expr(node -> inc);
             }
-            fprintf(STREAM, "\tjmp .L.begin.%d\n", idx); // 条件式の評価に戻る
-            fprintf(STREAM, "%s:\n", node -> brk_label);
+            emit_branch(I_JMP, 0, ".L.begin.%s.%d", ctx -> current_fn -> name, idx); // 条件式の評価に戻る
+            emit_label("%s", node -> brk_label);
             return;
         }
         
         case ND_DO:{
             int idx = get_index();
-            fprintf(STREAM, ".L.begin.%d:\n", idx);
+            emit_label(".L.begin.%s.%d", ctx -> current_fn -> name, idx);
             gen_stmt(node -> then);
-            fprintf(STREAM, "%s:\n", node -> cont_label);
+            emit_label("%s", node -> cont_label);
             gen_expr(node -> cond);
-            fprintf(STREAM, "\tcmp rax, 0\n");
-            fprintf(STREAM, "\tjne .L.begin.%d\n", idx);
-            fprintf(STREAM, "%s:\n", node -> brk_label);
+            inst2(I_CMP, reg_op(RAX, 8), imm_op(0));
+            emit_branch(I_JCC, CC_NE, ".L.begin.%s.%d", ctx -> current_fn -> name, idx);
+            emit_label("%s", node -> brk_label);
             return;
         }
 
         case ND_GOTO:
-            fprintf(STREAM, "\tjmp %s\n", node -> unique_label);
+            emit_branch(I_JMP, 0, "%s", node -> unique_label);
             return;
         
         case ND_LABEL:
-            fprintf(STREAM, "%s:\n", node -> unique_label);
+            emit_label("%s", node -> unique_label);
             gen_stmt(node -> lhs);
             return;
         
         case ND_SWITCH:
             gen_expr(node -> cond);
-            for(Node *n = node -> case_next; n; n = n -> case_next){
-                char *reg = (node -> cond -> ty -> size == 8) ? "rax" : "eax";
-                fprintf(STREAM, "\tcmp %s, %ld\n", reg, n -> val);
-                fprintf(STREAM, "\tje %s\n", n -> unique_label);
+            for(Node *n = node -> cases; n; n = n -> case_next){
+                inst2(I_CMP, reg_op(RAX, node -> cond -> ty -> size == 8 ? 8 : 4), imm_op(n -> case_val));
+                emit_branch(I_JCC, CC_E, "%s", n -> unique_label);
             }
             if(node -> default_case)
-                fprintf(STREAM, "jmp %s\n", node -> default_case -> unique_label);
+                emit_branch(I_JMP, 0, "%s", node -> default_case -> unique_label);
             // 該当するcaseがなかった時
-            fprintf(STREAM, "\tjmp %s\n", node -> brk_label);
+            emit_branch(I_JMP, 0, "%s", node -> brk_label);
 
             gen_stmt(node -> then);
-            fprintf(STREAM, "%s:\n", node -> brk_label);
+            emit_label("%s", node -> brk_label);
             return;
         
         case ND_CASE:
-            fprintf(STREAM, "%s:", node -> unique_label);
+            emit_label("%s", node -> unique_label);
             gen_stmt(node -> lhs);
             return;
         
@@ -550,23 +551,7 @@ static void gen_stmt(Node* node){
 }
 
 static void store_arg(int i, int offset, unsigned int size){
-    switch(size){
-        case 1:
-            fprintf(STREAM, "\tmov [rbp + %d], %s\n", offset, argreg8[i]);
-            return;
-        
-        case 2:
-            fprintf(STREAM, "\tmov [rbp + %d], %s\n", offset, argreg16[i]);
-            return;
-        
-        case 4:
-            fprintf(STREAM, "\tmov [rbp + %d], %s\n", offset, argreg32[i]);
-            return;
-        
-        default:
-            fprintf(STREAM, "\tmov [rbp + %d], %s\n", offset, argreg64[i]);
-            return;
-    }
+    inst2(I_MOV, mem_op(RBP, offset, 0), reg_op(argreg[i], reg_size(size)));
 }
 
 int align_to(int offset, int align){
@@ -575,8 +560,8 @@ int align_to(int offset, int align){
 
 static void assign_lvar_offsets(Obj *globals){
     for(Obj *fn = globals; fn; fn = fn -> next){
-        if(!is_func(fn -> ty)){
-            continue;
+        if(!is_func(fn -> ty) || !fn -> is_definition){
+            continue; // 宣言はプリコンパイルしたヘッダのものかもしれず、書き換えてはいけない
         }
 
         int offset = 0;
@@ -589,6 +574,57 @@ static void assign_lvar_offsets(Obj *globals){
     }
 }
 
+static bool is_printable(char c){
+    return ' ' <= c && c <= '~';
+}
+
+// buf[pos, end)の先頭から続く0の数
+static int zero_run(char *buf, int pos, int end){
+    int i = pos;
+    while(i < end && !buf[i])
+        i++;
+    return i - pos;
+}
+
+// buf[pos, end)の先頭から続く表示可能な文字の数
+static int printable_run(char *buf, int pos, int end){
+    int i = pos;
+    while(i < end && is_printable(buf[i]))
+        i++;
+    return i - pos;
+}
+
+/*  グローバル変数の初期値data[pos, end)を出力する。1バイトずつ.byteで出すと行数が膨大になるので、
+    0の連続は.zero、表示可能な文字の連続は.ascii(後ろが0なら.string)、残りは8バイトごとに.quadにまとめる。 */
+static void emit_bytes(char *data, int pos, int end){
+    while(pos < end){
+        int n = zero_run(data, pos, end);
+        if(n >= 8){
+            emit_directive(I_ZERO, n, NULL);
+            pos += n;
+            continue;
+        }
+
+        n = printable_run(data, pos, end);
+        if(n >= 4){
+            bool nul = pos + n < end && !data[pos + n];
+            emit_string(data + pos, n, nul);
+            pos += n + nul;
+            continue;
+        }
+
+        if(pos % 8 == 0 && end - pos >= 8){
+            int64_t val;
+            memcpy(&val, data + pos, 8);
+            emit_directive(I_QUAD, val, NULL);
+            pos += 8;
+            continue;
+        }
+
+        emit_directive(I_BYTE, data[pos++], NULL);
+    }
+}
+
 static void emit_data(Obj *globals){
     for(Obj *gvar = globals; gvar; gvar = gvar -> next){
         if(is_func(gvar -> ty) || !gvar -> is_definition){
@@ -596,103 +632,150 @@ static void emit_data(Obj *globals){
         }
 
         if(gvar -> is_static)
-            fprintf(STREAM, ".local %s\n", gvar -> name);
+            emit_directive(I_LOCAL, 0, "%s", gvar -> name);
         else 
-            fprintf(STREAM, ".global %s\n", gvar -> name); 
-        fprintf(STREAM, ".align %d\n", gvar -> align);
+            emit_directive(I_GLOBAL, 0, "%s", gvar -> name); 
+        emit_directive(I_ALIGN, gvar -> align, NULL);
         
         if(gvar -> init_data){
-            fprintf(STREAM, ".data\n");
-            fprintf(STREAM, "%s:\n", gvar -> name);
+            emit_directive(I_SECTION, SEC_DATA, NULL);
+            emit_label("%s", gvar -> name);
             int pos = 0;
-            Relocation *rel = gvar -> rel;
-            while(pos < gvar -> ty -> size){
-                // offset == posは、.byteを使っているために必要なチェック。
-                if(rel && rel -> offset == pos){
-                    fprintf(STREAM, "\t.quad %s + %ld\n", rel -> label, rel -> addend);
-                    rel = rel -> next;
-                    pos += 8;
-                }else{
-                    fprintf(STREAM, "\t.byte %d\n", gvar -> init_data[pos++]);
-                }
+            for(Relocation *rel = gvar -> rel; rel; rel = rel -> next){
+                emit_bytes(gvar -> init_data, pos, rel -> offset);
+                emit_directive(I_QUAD_SYM, rel -> addend, "%s", rel -> label);
+                pos = rel -> offset + 8;
             }
+            emit_bytes(gvar -> init_data, pos, gvar -> ty -> size);
         }else{
-            fprintf(STREAM, ".bss\n");
-            fprintf(STREAM, "%s:\n", gvar -> name);
-            fprintf(STREAM, "\t.zero %d\n", gvar -> ty -> size);
+            emit_directive(I_SECTION, SEC_BSS, NULL);
+            emit_label("%s", gvar -> name);
+            emit_directive(I_ZERO, gvar -> ty -> size, NULL);
         }
     }
 }
 
-static void emit_text(Obj *globals){
-    fprintf(STREAM, ".text\n");
-    for(Obj *fn = globals; fn; fn = fn -> next){
-        if(!is_func(fn -> ty) || !fn -> is_definition){
-            continue;
-        }
-        current_fn = fn;
-       
-        if(fn -> is_static)
-            fprintf(STREAM, ".local %s\n", fn -> name);
-        else
-            fprintf(STREAM, ".global %s\n", fn -> name);
-        
-        fprintf(STREAM, "%s:\n", fn -> name);
-
-        /* プロローグ。 */
-        fprintf(STREAM, "\tpush rbp\n");
-        fprintf(STREAM, "\tmov rbp, rsp\n");
-        fprintf(STREAM, "\tsub rsp, %u\n", fn -> stack_size);
-
-        // 可変長引数関数
-        if(fn -> va_area){
-            int gp = 0;
-            for(Obj *var = fn -> params; var; var = var ->next)
-                gp++;
-            int off = fn -> va_area -> offset;
-
-            // va_elem
-            fprintf(STREAM, "\tmov [rbp + %d], DWORD PTR %d\n", off, gp * 8);
-            fprintf(STREAM, "\tmov [rbp + %d], DWORD PTR 0\n", off + 4);
-            fprintf(STREAM, "\tmovq [rbp + %d], rbp\n", off + 16);
-            fprintf(STREAM, "\taddq [rbp + %d], %d\n", off + 16, off + 24);
-            // __reg_save_area__
-            fprintf(STREAM, "\tmovq [rbp + %d], rdi\n", off + 24);
-            fprintf(STREAM, "\tmovq [rbp + %d], rsi\n", off + 32);
-            fprintf(STREAM, "\tmovq [rbp + %d], rdx\n", off + 40);
-            fprintf(STREAM, "\tmovq [rbp + %d], rcx\n", off + 48);
-            fprintf(STREAM, "\tmovq [rbp + %d], r8\n", off + 56);
-            fprintf(STREAM, "\tmovq [rbp + %d], r9\n", off + 64);
-            fprintf(STREAM, "\tmovsd [rbp + %d], xmm0\n", off + 72);
-            fprintf(STREAM, "\tmovsd [rbp + %d], xmm1\n", off + 80);
-            fprintf(STREAM, "\tmovsd [rbp + %d], xmm2\n", off + 88);
-            fprintf(STREAM, "\tmovsd [rbp + %d], xmm3\n", off + 96);
-            fprintf(STREAM, "\tmovsd [rbp + %d], xmm4\n", off + 104);
-            fprintf(STREAM, "\tmovsd [rbp + %d], xmm5\n", off + 112);
-            fprintf(STREAM, "\tmovsd [rbp + %d], xmm6\n", off + 120);
-            fprintf(STREAM, "\tmovsd [rbp + %d], xmm7\n", off + 128);
-        }
+/* 関数一つ分のコードを生成する。ctxは関数ごとのCompiler。 */
+static void gen_function(Obj *fn){
+    ctx -> current_fn = fn;
 
-        int i = 0;
-        /* パラメータをスタック領域にコピー */
-        for(Obj *var = fn -> params; var; var = var -> next)
-            store_arg(i++, var -> offset, var -> ty -> size);
+    if(fn -> is_static)
+        emit_directive(I_LOCAL, 0, "%s", fn -> name);
+    else
+        emit_directive(I_GLOBAL, 0, "%s", fn -> name);
     
-        /* コード生成 */
-        gen_stmt(fn -> body);
-        assert(depth == 0); //プロローグで確保したスタックフレーム以外の領域を使っていないことをチェック
-
-        /* エピローグ */
-        fprintf(STREAM, ".L.end.%s:\n", fn -> name); // このラベルは関数ごと。
-        fprintf(STREAM, "\tmov rsp, rbp\n");
-        fprintf(STREAM, "\tpop rbp\n");
-        fprintf(STREAM, "\tret\n"); /* 最後の式の評価結果が返り値になる。*/   
+    emit_label("%s", fn -> name);
+
+    /* プロローグ。 */
+    inst1(I_PUSH, reg_op(RBP, 8));
+    inst2(I_MOV, reg_op(RBP, 8), reg_op(RSP, 8));
+    inst2(I_SUB, reg_op(RSP, 8), imm_op(fn -> stack_size));
+
+    // 可変長引数関数
+    if(fn -> va_area){
+        int gp = 0;
+        for(Obj *var = fn -> params; var; var = var ->next)
+            gp++;
+        int off = fn -> va_area -> offset;
+
+        // va_elem
+        inst2(I_MOV, mem_op(RBP, off, 4), imm_op(gp * 8));
+        inst2(I_MOV, mem_op(RBP, off + 4, 4), imm_op(0));
+        inst2(I_MOV, mem_op(RBP, off + 16, 0), reg_op(RBP, 8));
+        inst2(I_ADD, mem_op(RBP, off + 16, 8), imm_op(off + 24));
+        // __reg_save_area__
+        for(int i = 0; i < 6; i++)
+            inst2(I_MOV, mem_op(RBP, off + 24 + i * 8, 0), reg_op(argreg[i], 8));
+        for(int i = 0; i < 8; i++)
+            inst2(I_MOVSD, mem_op(RBP, off + 72 + i * 8, 0), reg_op(i, 16));
+    }
+
+    int i = 0;
+    /* パラメータをスタック領域にコピー */
+    for(Obj *var = fn -> params; var; var = var -> next)
+        store_arg(i++, var -> offset, var -> ty -> size);
+
+    /* コード生成 */
+    gen_stmt(fn -> body);
+    assert(ctx -> depth == 0); //プロローグで確保したスタックフレーム以外の領域を使っていないことをチェック
+
+    /* エピローグ */
+    emit_label(".L.end.%s", fn -> name); // このラベルは関数ごと。
+    inst2(I_MOV, reg_op(RSP, 8), reg_op(RBP, 8));
+    inst1(I_POP, reg_op(RBP, 8));
+    inst0(I_RET); /* 最後の式の評価結果が返り値になる。*/   
+}
+
+typedef struct{
+    Compiler *parent;
+    Obj **fns; // 定義されている関数。ソースの順
+    Buffer *out; // fns[i]のコード
+    Buffer *diag; // fns[i]でエラーが起きた場合のメッセージ
+}TextJob;
+
+/*  fns[i]のコードを生成するタスク。別のスレッドで実行されるので、出力先、ラベルの通し番号、
+    エラーの戻り先を持つ自分用のCompilerをctxにして生成する。ASTは読むだけ。 */
+static void gen_function_task(int i, void *arg){
+    TextJob *job = arg;
+    Compiler c = {.opts = job -> parent -> opts, .path = job -> parent -> path, .input = job -> parent -> input};
+    Compiler *saved = ctx;
+    ctx = &c;
+    if(!setjmp(c.jmp)){
+        gen_function(job -> fns[i]);
+        job -> out[i] = c.out;
+    }else{
+        free(c.out.data);
+        job -> diag[i] = c.diag;
+    }
+    ctx = saved;
+}
+
+/*  関数ごとのコード生成をcodegen_threads個のスレッドで並列に行い、ソースの順につなげる。
+    ラベルは関数名を含むので、関数ごとに別々に番号を振っても衝突しない。 */
+static void emit_text(Obj *globals){
+    emit_directive(I_SECTION, SEC_TEXT, NULL);
+
+    int n = 0;
+    for(Obj *fn = globals; fn; fn = fn -> next)
+        if(is_func(fn -> ty) && fn -> is_definition)
+            n++;
+
+    TextJob job = {ctx, calloc(n, sizeof(Obj *)), calloc(n, sizeof(Buffer)), calloc(n, sizeof(Buffer))};
+    int i = 0;
+    for(Obj *fn = globals; fn; fn = fn -> next)
+        if(is_func(fn -> ty) && fn -> is_definition)
+            job.fns[i++] = fn;
+
+    parallel_for(n, codegen_threads, gen_function_task, &job);
+
+    // エラーは逐次に生成した場合と同じく、ソースで最初のものだけを報告する
+    Buffer *err = NULL;
+    for(i = 0; i < n; i++){
+        if(!err && job.diag[i].len)
+            err = &job.diag[i];
+        if(!err)
+            buf_append(&ctx -> out, job.out[i].data, job.out[i].len);
+    }
+    if(err)
+        buf_append(&ctx -> diag, err -> data, err -> len);
+
+    for(i = 0; i < n; i++){
+        free(job.out[i].data);
+        free(job.diag[i].data);
     }
+    free(job.fns);
+    free(job.out);
+    free(job.diag);
+    if(err)
+        longjmp(ctx -> jmp, 1);
 }
 
 void codegen(Obj *globals){
-    fprintf(STREAM, ".intel_syntax noprefix\n");
+    if(!ctx -> opts -> emit_object)
+        emit(".intel_syntax noprefix\n");
     assign_lvar_offsets(globals);
     emit_data(globals);
     emit_text(globals);
+    if(ctx -> opts -> emit_object)
+        assemble();
 }
@@ -0,0 +1,210 @@
+#define _GNU_SOURCE // mmapのMAP_ANONYMOUSのため
+#include "9cc.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*  コンパイラをライブラリとして使うための入り口。一回のコンパイルの状態はすべてCompilerにまとめてあり、
+    エラーが起きてもプロセスは終了せずに、メッセージをCompileResultのdiagに入れて返る。 */
+
+_Thread_local Compiler *ctx;
+CompileOptions compile_options = {.dir_fd = AT_FDCWD};
+
+/* -Iで指定されたディレクトリを追加する。コンパイルを始める前に呼ぶこと。 */
+void add_include_path(CompileOptions *opts, char *dir){
+    opts -> include_paths = realloc(opts -> include_paths, (opts -> ninclude_paths + 1) * sizeof(char *));
+    opts -> include_paths[opts -> ninclude_paths++] = dir;
+}
+
+/* パイプなどサイズが分からない入力を最後まで読む。末尾に\n\0を付け、その後ろをSCAN_PADDINGバイト0で埋める。 */
+static char *read_stream(char *path, int fd){
+    size_t cap = 64 * 1024;
+    size_t len = 0;
+    char *buf = malloc(cap);
+
+    for(;;){
+        if(cap - len < 2 + SCAN_PADDING + 1){
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        ssize_t n = read(fd, buf + len, cap - len - 2 - SCAN_PADDING); // \n\0と余白の分を残しておく
+        if(n == 0)
+            break;
+        if(n == -1){
+            if(errno == EINTR)
+                continue;
+            free(buf);
+            if(fd != STDIN_FILENO)
+                close(fd);
+            error("%s: read: %s", path, strerror(errno));
+        }
+        len += n;
+    }
+
+    if(len == 0 || buf[len - 1] != '\n')
+        buf[len++] = '\n';
+    memset(buf + len, 0, 1 + SCAN_PADDING);
+    return buf;
+}
+
+/* ファイルをメモリにマップして返す。tokenize()のためにファイルが\n\0で終わっている様にする。
+   マップした場合は*map_lenにその長さを、readで読んだ場合は0を入れる。 */
+char *read_file(char *path, size_t *map_len){
+    *map_len = 0;
+    if(!strcmp(path, "-"))
+        return read_stream(path, STDIN_FILENO);
+
+    int fd = openat(ctx -> opts -> dir_fd, path, O_RDONLY);
+    if(fd == -1){
+        error("cannot open %s: %s", path, strerror(errno));
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == -1){
+        close(fd);
+        error("%s: fstat: %s", path, strerror(errno));
+    }
+
+    /* 通常のファイルでなければ(FIFOなど)普通に読む */
+    if(!S_ISREG(st.st_mode)){
+        char *buf = read_stream(path, fd);
+        close(fd);
+        return buf;
+    }
+
+    size_t size = st.st_size;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t file_len = (size + page - 1) / page * page;
+    size_t len = (size + 2 + SCAN_PADDING + page - 1) / page * page; // \n\0と字句解析の余白の分
+
+    /*  先に\n\0と余白の分まで無名ページで領域を予約し、その先頭にファイルを重ねてマップする。
+        ファイルの末尾を超えた部分は0で埋められているので、\nを書き込むだけで\n\0で終わるようになる。
+        MAP_PRIVATEなので書き込んでもファイルは変更されない。 */
+    /* errorは戻ってこないので、呼ぶ前に予約した領域とfdを片付ける。サーバでは何度もコンパイルするのでリークさせない */
+    char *buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buf == MAP_FAILED){
+        close(fd);
+        error("%s: mmap: %s", path, strerror(errno));
+    }
+    if(size && mmap(buf, file_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED){
+        int err = errno;
+        munmap(buf, len);
+        close(fd);
+        error("%s: mmap: %s", path, strerror(err));
+    }
+    close(fd);
+    *map_len = len;
+
+    if(size == 0 || buf[size - 1] != '\n'){
+        buf[size] = '\n';
+    }
+    return buf;
+}
+
+/* コンパイル中に確保したものを解放する。エラーで途中から戻ってきた場合も同じ。 */
+static void release(Compiler *c){
+    free_scopes();
+    free_lexer();
+    free_preprocessor();
+    free_assembler();
+    hashmap_free(&c -> type_table);
+    arena_release(&c -> token_arena);
+    arena_release(&c -> node_arena);
+    arena_release(&c -> type_arena);
+    arena_release(&c -> scope_arena);
+    arena_release(&c -> init_arena);
+    free_pch();
+
+    if(!c -> input)
+        return;
+    if(c -> map_len)
+        munmap(c -> input, c -> map_len);
+    else
+        free(c -> input);
+}
+
+/* run()の本体。エラーならctx -> jmpに戻る */
+static void run_body(Compiler *c){
+    CompileOptions *opts = c -> opts;
+    if(!c -> input)
+        c -> input = read_file(c -> path, &c -> map_len);
+    if(opts -> include_pch)
+        pch_load(opts -> include_pch); // 古いイメージはキャッシュを引く前にエラーにする
+    unsigned char key[32];
+    if(!cache_dir || !cache_lookup(c -> path, c -> input, key, &c -> out)){
+        tokenize(c -> path, c -> input);
+        Obj *program = parse();
+        if(!opts -> emit_pch)
+            codegen(program);
+        if(cache_dir)
+            cache_store(key, c -> files, &c -> missed_includes, &c -> out);
+    }
+}
+
+/* srcがNULLならpathを読み込む。srcはmallocした領域で、\n\0と余白が付いていること。 */
+static bool run(CompileOptions *opts, char *path, char *src, CompileResult *res){
+    Compiler *c = calloc(1, sizeof(Compiler));
+    Compiler *saved = ctx;
+    ctx = c;
+    c -> opts = opts;
+    c -> path = path;
+    c -> input = src;
+
+    /* setjmpは代入の右辺には書けない(C11 7.13.1.1)ので、if文の条件にする */
+    bool ok = false;
+    if(setjmp(c -> jmp) == 0){
+        run_body(c);
+        ok = true;
+    }else if(c -> pch_private){
+        /* pch_unshareから戻ってきた。入力はそのままで、共有しないイメージを読んでやり直す */
+        char *input = c -> input;
+        size_t map_len = c -> map_len;
+        c -> input = NULL;
+        release(c);
+        free(c -> out.data);
+        free(c -> diag.data);
+        *c = (Compiler){.opts = opts, .path = path, .input = input, .map_len = map_len, .pch_private = true};
+        if(setjmp(c -> jmp) == 0){
+            run_body(c);
+            ok = true;
+        }
+    }
+
+    release(c);
+    res -> out = c -> out;
+    res -> diag = c -> diag;
+    if(!ok){
+        free(res -> out.data);
+        res -> out = (Buffer){};
+    }
+    free(c);
+    ctx = saved;
+    return ok;
+}
+
+/* メモリ上のlenバイトのソースをoptsでコンパイルする。pathはエラーメッセージとincludeの基準に使う名前。 */
+bool compile_with(CompileOptions *opts, char *path, char *src, size_t len, CompileResult *res){
+    char *buf = malloc(len + 2 + SCAN_PADDING);
+    memcpy(buf, src, len);
+    if(len == 0 || buf[len - 1] != '\n')
+        buf[len++] = '\n';
+    memset(buf + len, 0, 1 + SCAN_PADDING);
+    return run(opts, path, buf, res);
+}
+
+/* メモリ上のlenバイトのソースをコンパイルする。pathはエラーメッセージに使う名前。 */
+bool compile(char *path, char *src, size_t len, CompileResult *res){
+    return compile_with(&compile_options, path, src, len, res);
+}
+
+/* ファイルをコンパイルする。"-"なら標準入力から読む。 */
+bool compile_file(char *path, CompileResult *res){
+    return run(&compile_options, path, NULL, res);
+}
+
+void free_result(CompileResult *res){
+    free(res -> out.data);
+    free(res -> diag.data);
+    *res = (CompileResult){};
+}
@@ -0,0 +1,689 @@
+#include "9cc.h"
+#include <elf.h>
+
+/*  -cの場合に、codegenがctx -> outに並べた命令(InstRecord)をasを通さずに機械語にしてELF64の再配置可能オブジェクトにする。
+    アセンブリのテキストは作らず、読みもしない。受け付けるのはcodegenが使う命令とオペランドの組み合わせだけで、汎用のアセンブラではない。
+    命令を順にエンコードしてセクションに追加し、ラベルへの参照は最後にまとめて解決する。
+    ジャンプは常にrel32で、同じセクションのローカルなラベルへの参照はここで埋め、残りは再配置として出力する。 */
+
+static char *section_names[] = {".text", ".data", ".bss", ".rodata"};
+
+typedef struct{
+    Buffer buf; // .bssは中身を持たない
+    size_t size;
+    int align;
+}Section;
+
+typedef struct Symbol Symbol;
+struct Symbol{
+    Symbol *next; // 最初に現れた順
+    char *name;
+    int len;
+    int sec; // 定義されたセクション。-1なら未定義
+    size_t value;
+    bool global; // .global
+    int index; // .symtabでの番号
+};
+
+typedef struct Fixup Fixup;
+struct Fixup{
+    Fixup *next;
+    int sec;
+    size_t offset;
+    Symbol *sym;
+    int64_t addend;
+    int type; // R_X86_64_*
+};
+
+/* エラーで途中から戻ってもreleaseで解放できるように、ctx -> assemblerに置く */
+struct Assembler{
+    Section secs[NSECTIONS];
+    int cur; // 現在のセクション
+    HashMap syms; // 名前 -> Symbol
+    Symbol *sym_head;
+    Symbol **sym_last;
+    Fixup *fixups;
+    Fixup **fixup_last;
+    InstRecord *rec; // エンコードしている命令。エラーの表示用
+};
+
+noreturn static void asm_error(Assembler *as, char *msg){
+    InstRecord *rec = as -> rec;
+    if(rec -> op == I_JCC || rec -> op == I_SETCC)
+        error("%s: %s%s", msg, inst_names[rec -> op], cond_name(rec -> cc));
+    error("%s: %s", msg, inst_names[rec -> op]);
+}
+
+static Symbol *get_symbol(Assembler *as, char *name, int len){
+    Symbol *sym = hashmap_get2(&as -> syms, name, len);
+    if(sym)
+        return sym;
+    sym = arena_alloc(&ctx -> node_arena, sizeof(Symbol));
+    sym -> name = name;
+    sym -> len = len;
+    sym -> sec = -1;
+    hashmap_put2(&as -> syms, name, len, sym);
+    *as -> sym_last = sym;
+    as -> sym_last = &sym -> next;
+    return sym;
+}
+
+/* .L で始まる名前は.symtabに出さない */
+static bool is_temp_label(Symbol *sym){
+    return sym -> len >= 2 && sym -> name[0] == '.' && sym -> name[1] == 'L';
+}
+
+static Section *cur_sec(Assembler *as){
+    return &as -> secs[as -> cur];
+}
+
+static void out(Assembler *as, void *p, int len){
+    Section *sec = cur_sec(as);
+    if(as -> cur == SEC_BSS){
+        for(int i = 0; i < len; i++)
+            if(((char *)p)[i])
+                asm_error(as, "non-zero data in .bss");
+    }else{
+        buf_append(&sec -> buf, p, len);
+    }
+    sec -> size += len;
+}
+
+static void out8(Assembler *as, int v){
+    char c = v;
+    out(as, &c, 1);
+}
+
+static void out_le(Assembler *as, uint64_t v, int size){
+    char buf[8];
+    for(int i = 0; i < size; i++)
+        buf[i] = v >> (i * 8);
+    out(as, buf, size);
+}
+
+static void add_fixup(Assembler *as, Symbol *sym, int64_t addend, int type){
+    Fixup *fix = arena_alloc(&ctx -> node_arena, sizeof(Fixup));
+    fix -> sec = as -> cur;
+    fix -> offset = cur_sec(as) -> size;
+    fix -> sym = sym;
+    fix -> addend = addend;
+    fix -> type = type;
+    *as -> fixup_last = fix;
+    as -> fixup_last = &fix -> next;
+}
+
+static void out_zero(Assembler *as, size_t n){
+    static char zero[64];
+    while(n){
+        int k = MIN(n, sizeof(zero));
+        out(as, zero, k);
+        n -= k;
+    }
+}
+
+/* 現在のセクションの大きさをalignの倍数にする。.textはnopで埋める */
+static void align_section(Assembler *as, int align){
+    Section *sec = cur_sec(as);
+    sec -> align = MAX(sec -> align, align);
+    size_t pad = align_to(sec -> size, align) - sec -> size;
+    if(as -> cur != SEC_TEXT){
+        out_zero(as, pad);
+        return;
+    }
+    while(pad--)
+        out8(as, 0x90);
+}
+
+
+/* 8ビットのレジスタのうちspl, bpl, sil, dilはREXがないとah, ch, dh, bhになる */
+static bool needs_rex8(Operand *op){
+    return op -> kind == OP_REG && op -> size == 1 && 4 <= op -> reg && op -> reg < 8;
+}
+
+/*  ModRMを使う命令を出力する。opcodeは2バイトまで(0x0FBEなど)。regはModRMのregフィールドに入れる値で、
+    regopがあればそのレジスタ、なければext(/digit)を使う。immはこの後に続くイミディエイトのバイト数。 */
+static void encode_rm(Assembler *as, int prefix, bool w, int opcode, int ext, Operand *regop, Operand *rm, int imm){
+    int reg = regop ? regop -> reg : ext;
+    if(prefix)
+        out8(as, prefix);
+
+    int rex = 0;
+    if(w)
+        rex |= 8;
+    if(reg >= 8)
+        rex |= 4;
+    if(rm -> kind == OP_REG && rm -> reg >= 8)
+        rex |= 1;
+    if(rm -> kind == OP_MEM && rm -> base != RIP && rm -> base >= 8)
+        rex |= 1;
+    if(rex || (regop && needs_rex8(regop)) || needs_rex8(rm))
+        out8(as, 0x40 | rex);
+
+    if(opcode > 0xFF)
+        out8(as, opcode >> 8);
+    out8(as, opcode);
+
+    if(rm -> kind == OP_REG){
+        out8(as, 0xC0 | (reg & 7) << 3 | (rm -> reg & 7));
+        return;
+    }
+    if(rm -> kind != OP_MEM)
+        asm_error(as, "invalid operand");
+
+    if(rm -> base == RIP){
+        out8(as, (reg & 7) << 3 | 5);
+        // 再配置の値はdisp32の位置からではなく次の命令からの相対
+        add_fixup(as, get_symbol(as, rm -> sym, strlen(rm -> sym)), rm -> disp - 4 - imm, R_X86_64_PC32);
+        out_le(as, 0, 4);
+        return;
+    }
+
+    int base = rm -> base & 7;
+    int mod = (rm -> disp == 0 && base != 5) ? 0 : (rm -> disp == (int8_t)rm -> disp) ? 1 : 2;
+    out8(as, mod << 6 | (reg & 7) << 3 | base);
+    if(base == 4)
+        out8(as, 0x24); // rsp, r12はSIBが必要
+    if(mod == 1)
+        out8(as, rm -> disp);
+    else if(mod == 2)
+        out_le(as, rm -> disp, 4);
+}
+
+/* オペランドの大きさ。レジスタの大きさか、X PTRで指定された大きさ */
+static int operand_size(Assembler *as, Operand *a, Operand *b){
+    int size = a -> kind == OP_REG ? a -> size : b && b -> kind == OP_REG ? b -> size : a -> size ? a -> size : b ? b -> size : 0;
+    if(!size)
+        asm_error(as, "operand size not specified");
+    return size;
+}
+
+static bool is_imm32(int64_t v){
+    return v == (int32_t)v;
+}
+
+/* sizeバイトのオペランドに対するイミディエイトとして書けるか。4バイト以下ならasと同じく符号なしの値も受け付ける */
+static bool fits_imm(int64_t v, int size){
+    return size == 8 ? is_imm32(v) : -((int64_t)1 << 31) <= v && v < ((int64_t)1 << 32);
+}
+
+/* 大きさに応じたプレフィックスとREX.W */
+static int size_prefix(int size){
+    return size == 2 ? 0x66 : 0;
+}
+
+static void encode_mov(Assembler *as, Operand *dst, Operand *src){
+    int size = operand_size(as, dst, src);
+
+    if(src -> kind == OP_IMM){
+        if(dst -> kind == OP_REG){
+            if(size == 8 && !is_imm32(src -> imm)){
+                // movabs
+                out8(as, 0x48 | (dst -> reg >= 8));
+                out8(as, 0xB8 + (dst -> reg & 7));
+                out_le(as, src -> imm, 8);
+                return;
+            }
+            if(size != 8){
+                if(size == 2)
+                    out8(as, 0x66);
+                if(dst -> reg >= 8 || needs_rex8(dst))
+                    out8(as, 0x40 | (dst -> reg >= 8));
+                out8(as, (size == 1 ? 0xB0 : 0xB8) + (dst -> reg & 7));
+                out_le(as, src -> imm, MIN(size, 4));
+                return;
+            }
+        }
+        if(!fits_imm(src -> imm, size))
+            asm_error(as, "immediate out of range");
+        int imm = MIN(size, 4);
+        encode_rm(as, size_prefix(size), size == 8, size == 1 ? 0xC6 : 0xC7, 0, NULL, dst, imm);
+        out_le(as, src -> imm, imm);
+        return;
+    }
+
+    if(src -> kind == OP_REG && (dst -> kind == OP_REG || dst -> kind == OP_MEM)){
+        encode_rm(as, size_prefix(size), size == 8, size == 1 ? 0x88 : 0x89, 0, src, dst, 0);
+        return;
+    }
+    if(dst -> kind == OP_REG && src -> kind == OP_MEM){
+        encode_rm(as, size_prefix(size), size == 8, size == 1 ? 0x8A : 0x8B, 0, dst, src, 0);
+        return;
+    }
+    asm_error(as, "invalid operands");
+}
+
+/* add, or, and, sub, xor, cmp。extは/digitの値 */
+static void encode_alu(Assembler *as, int ext, Operand *dst, Operand *src){
+    int size = operand_size(as, dst, src);
+    if(src -> kind == OP_IMM){
+        if(!fits_imm(src -> imm, size))
+            asm_error(as, "immediate out of range");
+        int64_t v = size == 4 ? (int32_t)src -> imm : size == 2 ? (int16_t)src -> imm : src -> imm;
+        bool imm8 = size == 1 || v == (int8_t)v;
+        int opcode = size == 1 ? 0x80 : imm8 ? 0x83 : 0x81;
+        int imm = imm8 ? 1 : MIN(size, 4);
+        encode_rm(as, size_prefix(size), size == 8, opcode, ext, NULL, dst, imm);
+        out_le(as, src -> imm, imm);
+        return;
+    }
+    if(src -> kind == OP_REG){
+        encode_rm(as, size_prefix(size), size == 8, (ext << 3) | (size == 1 ? 0 : 1), 0, src, dst, 0);
+        return;
+    }
+    if(dst -> kind == OP_REG && src -> kind == OP_MEM){
+        encode_rm(as, size_prefix(size), size == 8, (ext << 3) | (size == 1 ? 2 : 3), 0, dst, src, 0);
+        return;
+    }
+    asm_error(as, "invalid operands");
+}
+
+/* neg, not, div, idivなどオペランドが一つのF7 /digitの命令 */
+static void encode_unary(Assembler *as, int ext, Operand *op){
+    int size = operand_size(as, op, NULL);
+    encode_rm(as, size_prefix(size), size == 8, size == 1 ? 0xF6 : 0xF7, ext, NULL, op, 0);
+}
+
+/* shl, shr, sar。シフト量はclかイミディエイト */
+static void encode_shift(Assembler *as, int ext, Operand *dst, Operand *src){
+    int size = operand_size(as, dst, NULL);
+    if(src -> kind == OP_IMM){
+        encode_rm(as, size_prefix(size), size == 8, size == 1 ? 0xC0 : 0xC1, ext, NULL, dst, 1);
+        out8(as, src -> imm);
+        return;
+    }
+    if(src -> kind != OP_REG || src -> reg != 1 || src -> size != 1)
+        asm_error(as, "shift count must be cl");
+    encode_rm(as, size_prefix(size), size == 8, size == 1 ? 0xD2 : 0xD3, ext, NULL, dst, 0);
+}
+
+/* movsx, movzx。srcの大きさで命令が決まる */
+static void encode_movx(Assembler *as, int opcode, Operand *dst, Operand *src){
+    int from = operand_size(as, src, NULL);
+    if(dst -> kind != OP_REG || (from != 1 && from != 2))
+        asm_error(as, "invalid operands");
+    encode_rm(as, size_prefix(dst -> size), dst -> size == 8, opcode + (from == 2), 0, dst, src, 0);
+}
+
+
+/* jmp, jcc, call。ラベルへのrel32 */
+static void encode_branch(Assembler *as, int opcode, Operand *op, int type){
+    if(op -> kind != OP_SYM)
+        asm_error(as, "expected a label");
+    if(opcode > 0xFF)
+        out8(as, opcode >> 8);
+    out8(as, opcode);
+    add_fixup(as, get_symbol(as, op -> sym, strlen(op -> sym)), -4, type);
+    out_le(as, 0, 4);
+}
+
+/* 命令ごとのオペランドの数。書いていないものは0 */
+static int inst_nops[I_REP_STOSB + 1] = {
+    [I_MOV] = 2, [I_PUSH] = 1, [I_POP] = 1, [I_LEA] = 2, [I_ADD] = 2, [I_SUB] = 2, [I_OR] = 2, [I_AND] = 2, [I_XOR] = 2,
+    [I_CMP] = 2, [I_IMUL] = 2, [I_MOVSX] = 2, [I_MOVZX] = 2, [I_MOVSXD] = 2, [I_MOVSD] = 2, [I_NEG] = 1, [I_NOT] = 1,
+    [I_DIV] = 1, [I_IDIV] = 1, [I_SHL] = 2, [I_SHR] = 2, [I_SAR] = 2, [I_CALL] = 1, [I_JMP] = 1, [I_JCC] = 1, [I_SETCC] = 1,
+};
+
+/* /digitの値 */
+static int inst_ext[] = {
+    [I_ADD] = 0, [I_OR] = 1, [I_AND] = 4, [I_SUB] = 5, [I_XOR] = 6, [I_CMP] = 7,
+    [I_NOT] = 2, [I_NEG] = 3, [I_DIV] = 6, [I_IDIV] = 7, [I_SHL] = 4, [I_SHR] = 5, [I_SAR] = 7,
+};
+
+/* 命令を一つエンコードする */
+static void encode(Assembler *as, InstRecord *rec){
+    Operand *a = &rec -> ops[0], *b = &rec -> ops[1];
+    if(rec -> nops != inst_nops[rec -> op])
+        asm_error(as, "wrong number of operands");
+
+    switch(rec -> op){
+        case I_MOV:
+            encode_mov(as, a, b);
+            return;
+        case I_PUSH:
+        case I_POP:
+            if(a -> kind != OP_REG || a -> size != 8)
+                asm_error(as, "invalid operand");
+            if(a -> reg >= 8)
+                out8(as, 0x41);
+            out8(as, (rec -> op == I_PUSH ? 0x50 : 0x58) + (a -> reg & 7));
+            return;
+        case I_LEA:
+            if(a -> kind != OP_REG || b -> kind != OP_MEM)
+                asm_error(as, "invalid operands");
+            encode_rm(as, 0, true, 0x8D, 0, a, b, 0);
+            return;
+        case I_ADD:
+        case I_OR:
+        case I_AND:
+        case I_SUB:
+        case I_XOR:
+        case I_CMP:
+            encode_alu(as, inst_ext[rec -> op], a, b);
+            return;
+        case I_IMUL:
+            if(a -> kind != OP_REG)
+                asm_error(as, "invalid operands");
+            encode_rm(as, size_prefix(a -> size), a -> size == 8, 0x0FAF, 0, a, b, 0);
+            return;
+        case I_MOVSX:
+        case I_MOVZX:
+            encode_movx(as, rec -> op == I_MOVSX ? 0x0FBE : 0x0FB6, a, b);
+            return;
+        case I_MOVSXD:
+            if(a -> kind != OP_REG || a -> size != 8)
+                asm_error(as, "invalid operands");
+            encode_rm(as, 0, true, 0x63, 0, a, b, 0);
+            return;
+        case I_MOVSD:
+            if(b -> kind == OP_REG && b -> size == 16)
+                encode_rm(as, 0xF2, false, 0x0F11, 0, b, a, 0);
+            else if(a -> kind == OP_REG && a -> size == 16)
+                encode_rm(as, 0xF2, false, 0x0F10, 0, a, b, 0);
+            else
+                asm_error(as, "invalid operands");
+            return;
+        case I_NEG:
+        case I_NOT:
+        case I_DIV:
+        case I_IDIV:
+            encode_unary(as, inst_ext[rec -> op], a);
+            return;
+        case I_SHL:
+        case I_SHR:
+        case I_SAR:
+            encode_shift(as, inst_ext[rec -> op], a, b);
+            return;
+        case I_CALL:
+            encode_branch(as, 0xE8, a, R_X86_64_PLT32);
+            return;
+        case I_JMP:
+            encode_branch(as, 0xE9, a, R_X86_64_PC32);
+            return;
+        case I_JCC:
+            encode_branch(as, 0x0F80 + rec -> cc, a, R_X86_64_PC32);
+            return;
+        case I_SETCC:
+            if(a -> kind != OP_REG || a -> size != 1)
+                asm_error(as, "invalid operand");
+            encode_rm(as, 0, false, 0x0F90 + rec -> cc, 0, NULL, a, 0);
+            return;
+        case I_RET:
+            out8(as, 0xC3);
+            return;
+        case I_CQO:
+            out8(as, 0x48);
+            out8(as, 0x99);
+            return;
+        case I_CDQ:
+            out8(as, 0x99);
+            return;
+        case I_REP_STOSB:
+            out8(as, 0xF3);
+            out8(as, 0xAA);
+            return;
+        default:
+            asm_error(as, "unsupported instruction");
+    }
+}
+
+/* ディレクティブかラベルなら処理してtrueを返す。nameは後ろに続く名前か.asciiの中身 */
+static bool directive(Assembler *as, InstRecord *rec, char *name){
+    switch(rec -> op){
+        case I_SECTION:
+            if(rec -> val < 0 || rec -> val >= NSECTIONS)
+                asm_error(as, "unsupported section");
+            as -> cur = rec -> val;
+            return true;
+        case I_GLOBAL:
+        case I_LOCAL:
+            get_symbol(as, name, rec -> nbytes) -> global = rec -> op == I_GLOBAL;
+            return true;
+        case I_ALIGN:
+            if(rec -> val <= 0 || (rec -> val & (rec -> val - 1)))
+                asm_error(as, "alignment is not a power of 2");
+            align_section(as, rec -> val);
+            return true;
+        case I_ZERO:
+            out_zero(as, rec -> val);
+            return true;
+        case I_BYTE:
+            out8(as, rec -> val);
+            return true;
+        case I_QUAD:
+            out_le(as, rec -> val, 8);
+            return true;
+        case I_QUAD_SYM:
+            add_fixup(as, get_symbol(as, name, rec -> nbytes), rec -> val, R_X86_64_64);
+            out_le(as, 0, 8);
+            return true;
+        case I_ASCII:
+        case I_STRING:
+            out(as, name, rec -> nbytes + (rec -> op == I_STRING)); // 中身の後ろには0が置いてある
+            return true;
+        case I_LABEL:{
+            Symbol *sym = get_symbol(as, name, rec -> nbytes);
+            if(sym -> sec != -1)
+                asm_error(as, "symbol already defined");
+            sym -> sec = as -> cur;
+            sym -> value = cur_sec(as) -> size;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/* 同じセクションのローカルなラベルへの相対参照はここで埋める。残りは再配置にする */
+static bool resolve_fixup(Assembler *as, Fixup *fix){
+    Symbol *sym = fix -> sym;
+    if(sym -> sec == -1)
+        return false;
+    if(sym -> global || sym -> sec != fix -> sec || fix -> type == R_X86_64_64)
+        return false;
+    int64_t val = (int64_t)sym -> value + fix -> addend - (int64_t)fix -> offset;
+    char *loc = as -> secs[fix -> sec].buf.data + fix -> offset;
+    for(int i = 0; i < 4; i++)
+        loc[i] = val >> (i * 8);
+    return true;
+}
+
+static void put_align(Buffer *buf, int align){
+    static char zero[16];
+    while(buf -> len % align)
+        buf_append(buf, zero, MIN(align - buf -> len % align, sizeof(zero)));
+}
+
+/* 文字列表にsを追加して位置を返す */
+static int add_str(Buffer *tab, char *s, int len){
+    int pos = tab -> len;
+    buf_append(tab, s, len);
+    buf_append(tab, "", 1);
+    return pos;
+}
+
+/*  ELFを組み立てる。セクションの並びは
+    NULL, .text, .data, .bss, .rodata, .rela.text, .rela.data, .rela.rodata, .symtab, .strtab, .shstrtab, .note.GNU-stack */
+static void write_elf(Assembler *as, Buffer *obj){
+    enum{ SH_NULL, SH_TEXT, SH_DATA, SH_BSS, SH_RODATA, SH_RELA_TEXT, SH_RELA_DATA, SH_RELA_RODATA, SH_SYMTAB, SH_STRTAB, SH_SHSTRTAB, SH_NOTE, NSH };
+    int rela_of[NSECTIONS] = {SH_RELA_TEXT, SH_RELA_DATA, -1, SH_RELA_RODATA};
+
+    // ここから先はバッファを確保するので、エラーになるものは先に調べておく
+    for(Fixup *fix = as -> fixups; fix; fix = fix -> next){
+        if(fix -> sym -> sec == -1 && is_temp_label(fix -> sym))
+            error("undefined label %.*s", fix -> sym -> len, fix -> sym -> name);
+        if(fix -> sec == SEC_BSS)
+            error("relocation in .bss");
+    }
+
+    /* シンボル表。ローカルなシンボルが先、.Lで始まるものは出さない */
+    Buffer symtab = {};
+    Buffer strtab = {};
+    buf_append(&strtab, "", 1);
+    Elf64_Sym null_sym = {};
+    buf_append(&symtab, (char *)&null_sym, sizeof(null_sym));
+    for(int i = 0; i < NSECTIONS; i++){
+        Elf64_Sym s = {.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION), .st_shndx = SH_TEXT + i};
+        buf_append(&symtab, (char *)&s, sizeof(s));
+    }
+    int nsyms = 1 + NSECTIONS;
+    int first_global = 0;
+    for(int pass = 0; pass < 2; pass++){
+        if(pass == 1)
+            first_global = nsyms;
+        for(Symbol *sym = as -> sym_head; sym; sym = sym -> next){
+            bool global = sym -> global || sym -> sec == -1;
+            if(global != pass || is_temp_label(sym))
+                continue;
+            Elf64_Sym s = {};
+            s.st_name = add_str(&strtab, sym -> name, sym -> len);
+            int type = sym -> sec == -1 ? STT_NOTYPE : sym -> sec == SEC_TEXT ? STT_FUNC : STT_OBJECT;
+            s.st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, type);
+            s.st_shndx = sym -> sec == -1 ? SHN_UNDEF : SH_TEXT + sym -> sec;
+            s.st_value = sym -> sec == -1 ? 0 : sym -> value;
+            sym -> index = nsyms++;
+            buf_append(&symtab, (char *)&s, sizeof(s));
+        }
+    }
+
+    /* 再配置。定義されているローカルなシンボルはセクションのシンボルからの相対にする */
+    Buffer rela[NSECTIONS] = {};
+    for(Fixup *fix = as -> fixups; fix; fix = fix -> next){
+        if(resolve_fixup(as, fix))
+            continue;
+        Symbol *sym = fix -> sym;
+        Elf64_Rela r = {.r_offset = fix -> offset, .r_addend = fix -> addend};
+        if(sym -> sec != -1 && !sym -> global){
+            r.r_info = ELF64_R_INFO(1 + sym -> sec, fix -> type);
+            r.r_addend += sym -> value;
+        }else{
+            r.r_info = ELF64_R_INFO(sym -> index, fix -> type);
+        }
+        buf_append(&rela[fix -> sec], (char *)&r, sizeof(r));
+    }
+
+    Buffer shstrtab = {};
+    buf_append(&shstrtab, "", 1);
+    Elf64_Shdr sh[NSH] = {};
+
+    Elf64_Ehdr eh = {};
+    memcpy(eh.e_ident, ELFMAG, SELFMAG);
+    eh.e_ident[EI_CLASS] = ELFCLASS64;
+    eh.e_ident[EI_DATA] = ELFDATA2LSB;
+    eh.e_ident[EI_VERSION] = EV_CURRENT;
+    eh.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    eh.e_type = ET_REL;
+    eh.e_machine = EM_X86_64;
+    eh.e_version = EV_CURRENT;
+    eh.e_ehsize = sizeof(Elf64_Ehdr);
+    eh.e_shentsize = sizeof(Elf64_Shdr);
+    eh.e_shnum = NSH;
+    eh.e_shstrndx = SH_SHSTRTAB;
+    buf_append(obj, (char *)&eh, sizeof(eh));
+
+    /* セクションの中身を順に置く */
+    static int flags[] = {SHF_ALLOC | SHF_EXECINSTR, SHF_ALLOC | SHF_WRITE, SHF_ALLOC | SHF_WRITE, SHF_ALLOC};
+    for(int i = 0; i < NSECTIONS; i++){
+        Section *sec = &as -> secs[i];
+        Elf64_Shdr *s = &sh[SH_TEXT + i];
+        int align = MAX(sec -> align, 1);
+        put_align(obj, align);
+        s -> sh_name = add_str(&shstrtab, section_names[i], strlen(section_names[i]));
+        s -> sh_type = i == SEC_BSS ? SHT_NOBITS : SHT_PROGBITS;
+        s -> sh_flags = flags[i];
+        s -> sh_offset = obj -> len;
+        s -> sh_size = sec -> size;
+        s -> sh_addralign = align;
+        if(i != SEC_BSS)
+            buf_append(obj, sec -> buf.data, sec -> buf.len);
+    }
+
+    for(int i = 0; i < NSECTIONS; i++){
+        if(rela_of[i] == -1)
+            continue;
+        Elf64_Shdr *s = &sh[rela_of[i]];
+        char name[32];
+        snprintf(name, sizeof(name), ".rela%s", section_names[i]);
+        put_align(obj, 8);
+        s -> sh_name = add_str(&shstrtab, name, strlen(name));
+        s -> sh_type = SHT_RELA;
+        s -> sh_flags = SHF_INFO_LINK;
+        s -> sh_offset = obj -> len;
+        s -> sh_size = rela[i].len;
+        s -> sh_link = SH_SYMTAB;
+        s -> sh_info = SH_TEXT + i;
+        s -> sh_addralign = 8;
+        s -> sh_entsize = sizeof(Elf64_Rela);
+        buf_append(obj, rela[i].data, rela[i].len);
+        free(rela[i].data);
+    }
+
+    put_align(obj, 8);
+    sh[SH_SYMTAB] = (Elf64_Shdr){
+        .sh_name = add_str(&shstrtab, ".symtab", 7), .sh_type = SHT_SYMTAB, .sh_offset = obj -> len, .sh_size = symtab.len,
+        .sh_link = SH_STRTAB, .sh_info = first_global, .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Sym),
+    };
+    buf_append(obj, symtab.data, symtab.len);
+
+    sh[SH_STRTAB] = (Elf64_Shdr){
+        .sh_name = add_str(&shstrtab, ".strtab", 7), .sh_type = SHT_STRTAB, .sh_offset = obj -> len, .sh_size = strtab.len, .sh_addralign = 1,
+    };
+    buf_append(obj, strtab.data, strtab.len);
+
+    // スタックを実行可能にしないための空のセクション
+    sh[SH_NOTE] = (Elf64_Shdr){
+        .sh_name = add_str(&shstrtab, ".note.GNU-stack", 15), .sh_type = SHT_PROGBITS, .sh_offset = obj -> len, .sh_addralign = 1,
+    };
+
+    sh[SH_SHSTRTAB] = (Elf64_Shdr){
+        .sh_name = add_str(&shstrtab, ".shstrtab", 9), .sh_type = SHT_STRTAB, .sh_offset = obj -> len, .sh_addralign = 1,
+    };
+    sh[SH_SHSTRTAB].sh_size = shstrtab.len;
+    buf_append(obj, shstrtab.data, shstrtab.len);
+
+    put_align(obj, 8);
+    ((Elf64_Ehdr *)obj -> data) -> e_shoff = obj -> len;
+    buf_append(obj, (char *)sh, sizeof(sh));
+
+    free(symtab.data);
+    free(strtab.data);
+    free(shstrtab.data);
+}
+
+
+/* releaseから呼ぶ。assembleの途中でエラーになった場合に残っているものを解放する */
+void free_assembler(void){
+    Assembler *as = ctx -> assembler;
+    if(!as)
+        return;
+    for(int i = 0; i < NSECTIONS; i++)
+        free(as -> secs[i].buf.data);
+    hashmap_free(&as -> syms);
+    free(as);
+    ctx -> assembler = NULL;
+}
+
+/* ctx -> outの命令の列をELFの再配置可能オブジェクトに置き換える */
+void assemble(void){
+    Assembler *as = ctx -> assembler = calloc(1, sizeof(Assembler));
+    as -> cur = SEC_TEXT;
+    as -> sym_last = &as -> sym_head;
+    as -> fixup_last = &as -> fixups;
+
+    for(size_t pos = 0; pos < ctx -> out.len;){
+        InstRecord *rec = (InstRecord *)(ctx -> out.data + pos);
+        char *name = (char *)(rec + 1); // emit.cが0で終えている
+        pos += rec -> len;
+        as -> rec = rec;
+        for(int i = 0; i < rec -> nops; i++)
+            if(rec -> ops[i].kind == OP_SYM || (rec -> ops[i].kind == OP_MEM && rec -> ops[i].base == RIP))
+                rec -> ops[i].sym = name;
+        if(!directive(as, rec, name))
+            encode(as, rec);
+    }
+
+    Buffer obj = {};
+    write_elf(as, &obj);
+    free_assembler();
+    free(ctx -> out.data);
+    ctx -> out = obj;
+}
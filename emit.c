@@ -0,0 +1,334 @@
+#include "9cc.h"
+
+/*  アセンブリの出力用。stdioを使わずにctx -> outのバッファに溜める。
+    書式の解釈と整数の変換も自前で行う。
+    codegenは命令をemit_instなどで一つずつ渡す。-Sならここでアセンブリの行にし、
+    -cならInstRecordにしてそのまま並べ、elf.cがテキストを経由せずに機械語にする。 */
+
+/* バッファの末尾にsのlenバイトを追加する。足りなくなったら倍に伸ばす。 */
+void buf_append(Buffer *buf, char *s, size_t len){
+    if(buf -> cap - buf -> len < len){
+        size_t cap = buf -> cap ? buf -> cap : 4096;
+        while(cap - buf -> len < len)
+            cap *= 2;
+        char *data = realloc(buf -> data, cap);
+        if(!data){
+            fprintf(ERROR, "out of memory\n"); // errorはdiagに書き込むので使えない
+            abort();
+        }
+        buf -> data = data;
+        buf -> cap = cap;
+    }
+    memcpy(buf -> data + buf -> len, s, len);
+    buf -> len += len;
+}
+
+static void put(char *s, size_t len){
+    buf_append(&ctx -> out, s, len);
+}
+
+static void put_uint(uint64_t val){
+    char buf[20];
+    char *p = buf + sizeof(buf);
+    do{
+        *--p = '0' + val % 10;
+        val /= 10;
+    }while(val);
+    put(p, buf + sizeof(buf) - p);
+}
+
+static void put_int(int64_t val){
+    if(val < 0){
+        put("-", 1);
+        put_uint(-(uint64_t)val);
+        return;
+    }
+    put_uint(val);
+}
+
+/* 文字列をそのまま出力する */
+void emit(char *s){
+    put(s, strlen(s));
+}
+
+/* %d %ld %u %sだけを解釈するprintf */
+static void vemitf(char *fmt, va_list ap){
+    for(char *p = fmt; *p;){
+        char *q = strchr(p, '%');
+        if(!q){
+            put(p, strlen(p));
+            break;
+        }
+        put(p, q - p);
+        q++;
+        switch(*q){
+            case 'd':
+                put_int(va_arg(ap, int));
+                break;
+            case 'u':
+                put_uint(va_arg(ap, unsigned int));
+                break;
+            case 'l':
+                q++; // %ldのみ
+                put_int(va_arg(ap, long));
+                break;
+            case 's':
+                emit(va_arg(ap, char *));
+                break;
+            default:
+                error("emitf: unsupported format %%%c", *q);
+        }
+        p = q + 1;
+    }
+}
+
+void emitf(char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    vemitf(fmt, ap);
+    va_end(ap);
+}
+
+char *inst_names[] = {
+    [I_MOV] = "mov", [I_PUSH] = "push", [I_POP] = "pop", [I_LEA] = "lea", [I_ADD] = "add", [I_SUB] = "sub",
+    [I_OR] = "or", [I_AND] = "and", [I_XOR] = "xor", [I_CMP] = "cmp", [I_IMUL] = "imul",
+    [I_MOVSX] = "movsx", [I_MOVZX] = "movzx", [I_MOVSXD] = "movsxd", [I_MOVSD] = "movsd",
+    [I_NEG] = "neg", [I_NOT] = "not", [I_DIV] = "div", [I_IDIV] = "idiv", [I_SHL] = "shl", [I_SHR] = "shr", [I_SAR] = "sar",
+    [I_CALL] = "call", [I_JMP] = "jmp", [I_JCC] = "j", [I_SETCC] = "set", [I_RET] = "ret", [I_CQO] = "cqo", [I_CDQ] = "cdq",
+    [I_REP_STOSB] = "rep stosb",
+    [I_SECTION] = ".section", [I_GLOBAL] = ".global", [I_LOCAL] = ".local", [I_ALIGN] = ".align", [I_ZERO] = ".zero",
+    [I_BYTE] = ".byte", [I_QUAD] = ".quad", [I_QUAD_SYM] = ".quad", [I_ASCII] = ".ascii", [I_STRING] = ".string", [I_LABEL] = "label",
+};
+
+/* je, setbなどの条件の部分 */
+char *cond_name(CondCode cc){
+    switch(cc){
+        case CC_B: return "b";
+        case CC_AE: return "ae";
+        case CC_E: return "e";
+        case CC_NE: return "ne";
+        case CC_BE: return "be";
+        case CC_A: return "a";
+        case CC_L: return "l";
+        case CC_GE: return "ge";
+        case CC_LE: return "le";
+        case CC_G: return "g";
+    }
+    return "?";
+}
+
+Operand reg_op(int reg, int size){
+    return (Operand){.kind = OP_REG, .reg = reg, .size = size};
+}
+
+Operand imm_op(int64_t val){
+    return (Operand){.kind = OP_IMM, .imm = val};
+}
+
+/* [base + disp]。sizeは大きさをBYTE PTRなどで指定する場合だけ。もう一方がレジスタなら0でよい */
+Operand mem_op(int base, int64_t disp, int size){
+    return (Operand){.kind = OP_MEM, .base = base, .disp = disp, .size = size};
+}
+
+/* sym[rip] */
+Operand rip_op(char *sym){
+    return (Operand){.kind = OP_MEM, .base = RIP, .sym = sym};
+}
+
+/* -cの場合。InstRecordを書き始め、そのオフセットを返す。名前などはこの後にputで書いてend_recordを呼ぶ */
+static size_t begin_record(InstRecord *rec){
+    size_t start = ctx -> out.len;
+    put((char *)rec, sizeof(InstRecord));
+    return start;
+}
+
+static void end_record(size_t start){
+    size_t nbytes = ctx -> out.len - start - sizeof(InstRecord);
+    static char zero[8];
+    put(zero, 1); // 名前をそのまま文字列として使えるように
+    put(zero, (8 - ctx -> out.len % 8) % 8);
+    InstRecord *rec = (InstRecord *)(ctx -> out.data + start);
+    rec -> nbytes = nbytes;
+    rec -> len = ctx -> out.len - start;
+}
+
+static bool emit_records(void){
+    return ctx -> opts -> emit_object;
+}
+
+static char *reg_names[][16] = {
+    {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"},
+    {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w"},
+    {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"},
+    {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"},
+    {"xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7"},
+};
+
+static char *reg_name(int reg, int size){
+    int row = size == 1 ? 0 : size == 2 ? 1 : size == 4 ? 2 : size == 8 ? 3 : 4;
+    return reg_names[row][reg];
+}
+
+static void put_operand(Operand *op){
+    switch(op -> kind){
+        case OP_REG:
+            emit(reg_name(op -> reg, op -> size));
+            return;
+        case OP_IMM:
+            put_int(op -> imm);
+            return;
+        case OP_SYM:
+            emit(op -> sym);
+            return;
+        case OP_MEM:
+            if(op -> size)
+                emit(op -> size == 1 ? "BYTE PTR " : op -> size == 2 ? "WORD PTR " : op -> size == 4 ? "DWORD PTR " : "QWORD PTR ");
+            if(op -> base == RIP){
+                emitf("%s[rip]", op -> sym);
+                return;
+            }
+            emitf("[%s", reg_name(op -> base, 8));
+            if(op -> disp > 0)
+                emitf(" + %ld", op -> disp);
+            else if(op -> disp < 0)
+                emitf(" - %ld", -op -> disp);
+            emit("]");
+            return;
+        default:
+            return;
+    }
+}
+
+/* 命令を一つ出力する。オペランドはnops個 */
+void emit_inst(InstOp op, int nops, Operand *a, Operand *b){
+    if(emit_records()){
+        InstRecord rec = {.op = op, .nops = nops};
+        if(nops >= 1)
+            rec.ops[0] = *a;
+        if(nops == 2)
+            rec.ops[1] = *b;
+        char *sym = nops >= 1 && a -> sym ? a -> sym : nops == 2 ? b -> sym : NULL;
+        rec.ops[0].sym = rec.ops[1].sym = NULL;
+        size_t start = begin_record(&rec);
+        if(sym)
+            emit(sym);
+        end_record(start);
+        return;
+    }
+
+    emitf("\t%s", inst_names[op]);
+    for(int i = 0; i < nops; i++){
+        emit(i ? ", " : " ");
+        put_operand(i ? b : a);
+    }
+    emit("\n");
+}
+
+void emit_setcc(CondCode cc, Operand *a){
+    if(emit_records()){
+        InstRecord rec = {.op = I_SETCC, .cc = cc, .nops = 1, .ops = {*a}};
+        end_record(begin_record(&rec));
+        return;
+    }
+    emitf("\tset%s ", cond_name(cc));
+    put_operand(a);
+    emit("\n");
+}
+
+/* call, jmp, jcc。飛び先のラベルの名前はemitfと同じ書式で渡す */
+void emit_branch(InstOp op, CondCode cc, char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    if(emit_records()){
+        InstRecord rec = {.op = op, .cc = cc, .nops = 1, .ops = {{.kind = OP_SYM}}};
+        size_t start = begin_record(&rec);
+        vemitf(fmt, ap);
+        end_record(start);
+    }else{
+        if(op == I_JCC)
+            emitf("\tj%s ", cond_name(cc));
+        else
+            emitf("\t%s ", inst_names[op]);
+        vemitf(fmt, ap);
+        emit("\n");
+    }
+    va_end(ap);
+}
+
+void emit_label(char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    if(emit_records()){
+        InstRecord rec = {.op = I_LABEL};
+        size_t start = begin_record(&rec);
+        vemitf(fmt, ap);
+        end_record(start);
+    }else{
+        vemitf(fmt, ap);
+        emit(":\n");
+    }
+    va_end(ap);
+}
+
+static char *section_directives[] = {".text", ".data", ".bss", ".section .rodata"};
+
+/*  .text(I_SECTIONでvalがSectionId)、.global, .local(名前)、.align, .zero, .byte, .quad(val)、.quad 名前 + val。
+    名前はemitfと同じ書式で渡す。名前を取らないものはfmtをNULLにする */
+void emit_directive(InstOp op, int64_t val, char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    if(emit_records()){
+        InstRecord rec = {.op = op, .val = val};
+        size_t start = begin_record(&rec);
+        if(fmt)
+            vemitf(fmt, ap);
+        end_record(start);
+        va_end(ap);
+        return;
+    }
+
+    switch(op){
+        case I_SECTION:
+            emitf("%s\n", section_directives[val]);
+            break;
+        case I_GLOBAL:
+        case I_LOCAL:
+            emitf("%s ", inst_names[op]);
+            vemitf(fmt, ap);
+            emit("\n");
+            break;
+        case I_ALIGN:
+            emitf(".align %ld\n", val);
+            break;
+        case I_QUAD_SYM:
+            emit("\t.quad ");
+            vemitf(fmt, ap);
+            emitf(" + %ld\n", val);
+            break;
+        default:
+            emitf("\t%s %ld\n", inst_names[op], val);
+            break;
+    }
+    va_end(ap);
+}
+
+/* .asciiか、nul_terminatedなら.string */
+void emit_string(char *s, int len, bool nul_terminated){
+    if(emit_records()){
+        InstRecord rec = {.op = nul_terminated ? I_STRING : I_ASCII};
+        size_t start = begin_record(&rec);
+        put(s, len);
+        end_record(start);
+        return;
+    }
+
+    emit(nul_terminated ? "\t.string \"" : "\t.ascii \"");
+    for(int i = 0; i < len; i++){
+        char buf[3] = {'\\', s[i]};
+        if(s[i] == '"' || s[i] == '\\')
+            emit(buf);
+        else
+            emit(buf + 1);
+    }
+    emit("\"\n");
+}
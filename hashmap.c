@@ -0,0 +1,111 @@
+#include "9cc.h"
+
+/* open addressing(linear probing)のハッシュテーブル。キーはバイト列(null終端でなくてもよい)かポインタ。*/
+
+#define INIT_SIZE 16
+#define HIGH_WATERMARK 70 // 使用率がこれ(%)を超えたら拡張する
+#define PTR_KEY -1 // keylenがこの値のエントリはポインタの値で比較する
+
+/* FNV-1a */
+uint64_t fnv_hash(char *s, int len){
+    uint64_t hash = 0xcbf29ce484222325;
+    for(int i = 0; i < len; i++){
+        hash ^= (unsigned char)s[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+/* ポインタをキーにする場合(internされた名前など)。アドレスそのものをハッシュ値にする。 */
+static uint64_t ptr_hash(void *key){
+    return ((uintptr_t)key >> 4) * 0x9e3779b97f4a7c15;
+}
+
+static bool match(HashEntry *ent, char *key, int keylen){
+    if(keylen == PTR_KEY)
+        return ent -> key == key;
+    return ent -> keylen == keylen && !memcmp(ent -> key, key, keylen);
+}
+
+static uint64_t hash_key(char *key, int keylen){
+    return keylen == PTR_KEY ? ptr_hash(key) : fnv_hash(key, keylen);
+}
+
+static void rehash(HashMap *map){
+    int cap = map -> capacity ? map -> capacity * 2 : INIT_SIZE;
+    HashMap map2 = {};
+    map2.buckets = calloc(cap, sizeof(HashEntry));
+    map2.capacity = cap;
+
+    for(int i = 0; i < map -> capacity; i++){
+        HashEntry *ent = &map -> buckets[i];
+        if(ent -> key)
+            hashmap_put2(&map2, ent -> key, ent -> keylen, ent -> val);
+    }
+    free(map -> buckets);
+    *map = map2;
+}
+
+static HashEntry *get_entry(HashMap *map, char *key, int keylen){
+    if(!map -> buckets || !key)
+        return NULL;
+
+    uint64_t hash = hash_key(key, keylen);
+    for(int i = 0; i < map -> capacity; i++){
+        HashEntry *ent = &map -> buckets[(hash + i) % map -> capacity];
+        if(!ent -> key)
+            return NULL;
+        if(match(ent, key, keylen))
+            return ent;
+    }
+    return NULL;
+}
+
+void *hashmap_get(HashMap *map, char *key){
+    return hashmap_get2(map, key, strlen(key));
+}
+
+void *hashmap_get2(HashMap *map, char *key, int keylen){
+    HashEntry *ent = get_entry(map, key, keylen);
+    return ent ? ent -> val : NULL;
+}
+
+void hashmap_put(HashMap *map, char *key, void *val){
+    hashmap_put2(map, key, strlen(key), val);
+}
+
+/* 同じキーが既にあれば上書きする。keyはコピーしないのでmapより長く生存している必要がある。*/
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val){
+    if(!map -> buckets || (map -> used + 1) * 100 / map -> capacity >= HIGH_WATERMARK)
+        rehash(map);
+
+    uint64_t hash = hash_key(key, keylen);
+    for(int i = 0; i < map -> capacity; i++){
+        HashEntry *ent = &map -> buckets[(hash + i) % map -> capacity];
+        if(ent -> key && match(ent, key, keylen)){
+            ent -> val = val;
+            return;
+        }
+        if(!ent -> key){
+            ent -> key = key;
+            ent -> keylen = keylen;
+            ent -> val = val;
+            map -> used++;
+            return;
+        }
+    }
+    assert(0); // unreachable
+}
+
+void hashmap_free(HashMap *map){
+    free(map -> buckets);
+    *map = (HashMap){};
+}
+
+void *hashmap_get_ptr(HashMap *map, void *key){
+    return hashmap_get2(map, key, PTR_KEY);
+}
+
+void hashmap_put_ptr(HashMap *map, void *key, void *val){
+    hashmap_put2(map, key, PTR_KEY, val);
+}
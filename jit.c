@@ -0,0 +1,315 @@
+#define _GNU_SOURCE // dlsymのRTLD_DEFAULTのため
+#include "9cc.h"
+#include <elf.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*  --runの場合に、ELFの再配置可能オブジェクトをプロセスのメモリにロードしてリンクし、mainを呼ぶ。
+    オブジェクトは-cで作ったものでも、ccで作ったもの(テストのcommonなど)でもよい。
+    実行するセクションと書き込むセクションを別々のページにまとめて置き、再配置を適用してから実行する方だけ読み出しと実行に変える。
+    オブジェクトで定義されていない名前はdlsymでこのプロセスにリンクされているlibcなどから探す。
+    libcは遠くにあってrel32が届かないことがあるので、外の関数の呼び出しは間接ジャンプの中継(stub)を通す。 */
+
+#define STUB_SIZE 16 // jmp [rip+0] (6バイト)と飛び先の8バイト。飛び先の8バイトはGOTとしても使う
+
+typedef struct{
+    ObjectFile *file;
+    Elf64_Ehdr *ehdr;
+    Elf64_Shdr *shdrs;
+    Elf64_Sym *syms;
+    int nsyms;
+    char *strtab;
+    char **sec_addr; // セクション番号 -> ロードしたアドレス。ロードしないセクションはNULL
+}Object;
+
+typedef struct{
+    char *addr;
+    bool weak;
+}Definition;
+
+typedef struct{
+    Object *objs;
+    int nobjs;
+    char *text; // 実行するセクションとstub
+    size_t text_size;
+    char *data; // 書き込むセクションと読み出すだけのセクション
+    size_t data_size;
+    char *stubs; // 次に使うstub
+    HashMap globals; // 名前 -> Definition
+    HashMap imports; // 名前 -> stub
+}Jit;
+
+static bool jit_error(char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(ERROR, "9cc: ");
+    vfprintf(ERROR, fmt, ap);
+    fprintf(ERROR, "\n");
+    va_end(ap);
+    return false;
+}
+
+static bool read_object(Object *obj, ObjectFile *file){
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)file -> data;
+    obj -> file = file;
+    obj -> ehdr = ehdr;
+    if(file -> len < sizeof(Elf64_Ehdr) || memcmp(ehdr -> e_ident, ELFMAG, SELFMAG) ||
+       ehdr -> e_ident[EI_CLASS] != ELFCLASS64 || ehdr -> e_type != ET_REL || ehdr -> e_machine != EM_X86_64)
+        return jit_error("%s: not an x86-64 relocatable object", file -> name);
+    if(ehdr -> e_shoff + (size_t)ehdr -> e_shnum * sizeof(Elf64_Shdr) > file -> len)
+        return jit_error("%s: broken section header table", file -> name);
+
+    obj -> shdrs = (Elf64_Shdr *)(file -> data + ehdr -> e_shoff);
+    obj -> sec_addr = calloc(ehdr -> e_shnum, sizeof(char *));
+    for(int i = 0; i < ehdr -> e_shnum; i++){
+        Elf64_Shdr *sh = &obj -> shdrs[i];
+        if(sh -> sh_type != SHT_NOBITS && sh -> sh_offset + sh -> sh_size > file -> len)
+            return jit_error("%s: section %d is out of the file", file -> name, i);
+        if(sh -> sh_type == SHT_SYMTAB){
+            obj -> syms = (Elf64_Sym *)(file -> data + sh -> sh_offset);
+            obj -> nsyms = sh -> sh_size / sizeof(Elf64_Sym);
+            obj -> strtab = file -> data + obj -> shdrs[sh -> sh_link].sh_offset;
+        }
+    }
+    return true;
+}
+
+/* 実行するセクションはtextに、それ以外はdataに詰める。ここではまだオフセットだけを決める */
+static void layout(Jit *jit){
+    size_t nstubs = 0;
+    for(int i = 0; i < jit -> nobjs; i++){
+        Object *obj = &jit -> objs[i];
+        for(int j = 0; j < obj -> ehdr -> e_shnum; j++){
+            Elf64_Shdr *sh = &obj -> shdrs[j];
+            if(sh -> sh_type == SHT_RELA){
+                // 外の名前への参照の数を超えてstubが必要になることはない
+                Elf64_Rela *rels = (Elf64_Rela *)(obj -> file -> data + sh -> sh_offset);
+                for(size_t k = 0; k < sh -> sh_size / sizeof(Elf64_Rela); k++)
+                    if(obj -> syms[ELF64_R_SYM(rels[k].r_info)].st_shndx == SHN_UNDEF ||
+                       ELF64_R_TYPE(rels[k].r_info) != R_X86_64_PC32)
+                        nstubs++;
+                continue;
+            }
+            if(!(sh -> sh_flags & SHF_ALLOC))
+                continue;
+            size_t *size = sh -> sh_flags & SHF_EXECINSTR ? &jit -> text_size : &jit -> data_size;
+            size_t align = sh -> sh_addralign ? sh -> sh_addralign : 1;
+            *size = (*size + align - 1) / align * align;
+            obj -> sec_addr[j] = (char *)*size; // mapした後に先頭のアドレスを足す
+            *size += sh -> sh_size;
+        }
+    }
+    jit -> text_size = (jit -> text_size + STUB_SIZE - 1) / STUB_SIZE * STUB_SIZE;
+    jit -> text_size += nstubs * STUB_SIZE;
+}
+
+static bool load(Jit *jit){
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t text_len = (jit -> text_size + page - 1) / page * page;
+    size_t data_len = (jit -> data_size + page - 1) / page * page;
+
+    char *base = mmap(NULL, text_len + data_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED)
+        return jit_error("mmap: %s", strerror(errno));
+    jit -> text = base;
+    jit -> data = base + text_len;
+    jit -> text_size = text_len;
+
+    size_t stub_start = 0;
+    for(int i = 0; i < jit -> nobjs; i++){
+        Object *obj = &jit -> objs[i];
+        for(int j = 0; j < obj -> ehdr -> e_shnum; j++){
+            Elf64_Shdr *sh = &obj -> shdrs[j];
+            if(!(sh -> sh_flags & SHF_ALLOC))
+                continue;
+            char *start = sh -> sh_flags & SHF_EXECINSTR ? jit -> text : jit -> data;
+            obj -> sec_addr[j] = start + (size_t)obj -> sec_addr[j];
+            if(sh -> sh_type != SHT_NOBITS)
+                memcpy(obj -> sec_addr[j], obj -> file -> data + sh -> sh_offset, sh -> sh_size);
+            if(sh -> sh_flags & SHF_EXECINSTR)
+                stub_start = MAX(stub_start, obj -> sec_addr[j] + sh -> sh_size - jit -> text);
+        }
+    }
+    jit -> stubs = jit -> text + (stub_start + STUB_SIZE - 1) / STUB_SIZE * STUB_SIZE; // layoutでセクションの後ろに確保してある
+    return true;
+}
+
+/* 各オブジェクトのグローバルな名前を登録する。弱い定義は強い定義で上書きする */
+static bool define_globals(Jit *jit){
+    for(int i = 0; i < jit -> nobjs; i++){
+        Object *obj = &jit -> objs[i];
+        for(int j = 1; j < obj -> nsyms; j++){
+            Elf64_Sym *sym = &obj -> syms[j];
+            int bind = ELF64_ST_BIND(sym -> st_info);
+            if(bind == STB_LOCAL || sym -> st_shndx == SHN_UNDEF)
+                continue;
+            char *name = obj -> strtab + sym -> st_name;
+            if(sym -> st_shndx == SHN_COMMON)
+                return jit_error("%s: %s: common symbols are not supported", obj -> file -> name, name);
+
+            char *addr = sym -> st_shndx == SHN_ABS ? (char *)sym -> st_value : obj -> sec_addr[sym -> st_shndx] + sym -> st_value;
+            Definition *def = hashmap_get(&jit -> globals, name);
+            if(def && !def -> weak && bind != STB_WEAK)
+                return jit_error("%s: multiple definition of `%s'", obj -> file -> name, name);
+            if(def && bind == STB_WEAK)
+                continue;
+            if(!def){
+                def = calloc(1, sizeof(Definition));
+                hashmap_put(&jit -> globals, name, def);
+            }
+            def -> addr = addr;
+            def -> weak = bind == STB_WEAK;
+        }
+    }
+    return true;
+}
+
+static bool symbol_address(Jit *jit, Object *obj, Elf64_Sym *sym, char **addr){
+    if(sym -> st_shndx == SHN_ABS){
+        *addr = (char *)sym -> st_value;
+        return true;
+    }
+    if(ELF64_ST_BIND(sym -> st_info) == STB_LOCAL){
+        *addr = obj -> sec_addr[sym -> st_shndx] + sym -> st_value;
+        return true;
+    }
+
+    char *name = obj -> strtab + sym -> st_name;
+    Definition *def = hashmap_get(&jit -> globals, name); // 自分で定義していても、弱い定義なら他のものが使われる
+    if(def){
+        *addr = def -> addr;
+        return true;
+    }
+    *addr = dlsym(RTLD_DEFAULT, name);
+    if(!*addr && ELF64_ST_BIND(sym -> st_info) != STB_WEAK)
+        return jit_error("%s: undefined reference to `%s'", obj -> file -> name, name);
+    return true;
+}
+
+/* addrへ飛ぶstubを作る。stubの7バイト目からの8バイトにはaddrが入っているので、GOTの代わりにもなる */
+static char *new_stub(Jit *jit, char *addr){
+    char *stub = jit -> stubs;
+    jit -> stubs += STUB_SIZE;
+    memcpy(stub, "\xff\x25\0\0\0\0", 6); // jmp [rip+0]
+    memcpy(stub + 6, &addr, 8);
+    return stub;
+}
+
+/* 外の名前へのstubは名前ごとに一つだけ作る */
+static char *get_stub(Jit *jit, Object *obj, Elf64_Sym *sym, char *addr){
+    if(sym -> st_shndx != SHN_UNDEF)
+        return new_stub(jit, addr);
+    char *name = obj -> strtab + sym -> st_name;
+    char *stub = hashmap_get(&jit -> imports, name);
+    if(!stub){
+        stub = new_stub(jit, addr);
+        hashmap_put(&jit -> imports, name, stub);
+    }
+    return stub;
+}
+
+static bool write_rel32(Object *obj, char *loc, int64_t val){
+    if(val != (int32_t)val)
+        return jit_error("%s: relocation out of range", obj -> file -> name);
+    int32_t v = val;
+    memcpy(loc, &v, 4);
+    return true;
+}
+
+static bool relocate(Jit *jit, Object *obj, Elf64_Shdr *sh){
+    char *target = obj -> sec_addr[sh -> sh_info];
+    if(!target)
+        return true; // ロードしないセクション(.debug_*など)への再配置
+    Elf64_Rela *rels = (Elf64_Rela *)(obj -> file -> data + sh -> sh_offset);
+
+    for(size_t i = 0; i < sh -> sh_size / sizeof(Elf64_Rela); i++){
+        Elf64_Rela *rel = &rels[i];
+        Elf64_Sym *sym = &obj -> syms[ELF64_R_SYM(rel -> r_info)];
+        char *loc = target + rel -> r_offset;
+        char *s;
+        if(!symbol_address(jit, obj, sym, &s))
+            return false;
+        int64_t a = rel -> r_addend;
+        uint64_t val;
+
+        switch(ELF64_R_TYPE(rel -> r_info)){
+            case R_X86_64_NONE:
+                break;
+            case R_X86_64_64:
+                val = (uint64_t)(s + a);
+                memcpy(loc, &val, 8);
+                break;
+            case R_X86_64_PC64:
+                val = s + a - loc;
+                memcpy(loc, &val, 8);
+                break;
+            case R_X86_64_PLT32:
+                if(sym -> st_shndx == SHN_UNDEF)
+                    s = get_stub(jit, obj, sym, s);
+                // fallthrough
+            case R_X86_64_PC32:
+                if(!write_rel32(obj, loc, s + a - loc))
+                    return false;
+                break;
+            case R_X86_64_32:
+            case R_X86_64_32S:
+                val = (uint64_t)(s + a);
+                if(ELF64_R_TYPE(rel -> r_info) == R_X86_64_32 ? val != (uint32_t)val : (int64_t)val != (int32_t)val)
+                    return jit_error("%s: relocation out of range", obj -> file -> name);
+                memcpy(loc, &val, 4);
+                break;
+            case R_X86_64_GOTPCREL:
+            case R_X86_64_GOTPCRELX:
+            case R_X86_64_REX_GOTPCRELX:
+                if(!write_rel32(obj, loc, get_stub(jit, obj, sym, s) + 6 + a - loc))
+                    return false;
+                break;
+            default:
+                return jit_error("%s: unsupported relocation type %d", obj -> file -> name, (int)ELF64_R_TYPE(rel -> r_info));
+        }
+    }
+    return true;
+}
+
+static void run_init_array(Object *obj){
+    for(int i = 0; i < obj -> ehdr -> e_shnum; i++){
+        Elf64_Shdr *sh = &obj -> shdrs[i];
+        if(sh -> sh_type != SHT_INIT_ARRAY || !obj -> sec_addr[i])
+            continue;
+        void (**fns)(void) = (void (**)(void))obj -> sec_addr[i];
+        for(size_t j = 0; j < sh -> sh_size / sizeof(void *); j++)
+            fns[j]();
+    }
+}
+
+/* objsをリンクしてmain(argc, argv)を呼び、その戻り値を*statusに入れる。リンクできなければfalseを返す */
+bool jit_run(ObjectFile *objs, int nobjs, int argc, char **argv, int *status){
+    Jit jit = {.nobjs = nobjs};
+    jit.objs = calloc(nobjs, sizeof(Object));
+    for(int i = 0; i < nobjs; i++)
+        if(!read_object(&jit.objs[i], &objs[i]))
+            return false;
+
+    layout(&jit);
+    if(!load(&jit) || !define_globals(&jit))
+        return false;
+    for(int i = 0; i < nobjs; i++){
+        Object *obj = &jit.objs[i];
+        for(int j = 0; j < obj -> ehdr -> e_shnum; j++)
+            if(obj -> shdrs[j].sh_type == SHT_RELA && !relocate(&jit, obj, &obj -> shdrs[j]))
+                return false;
+    }
+
+    Definition *main_def = hashmap_get(&jit.globals, "main");
+    if(!main_def)
+        return jit_error("undefined reference to `main'");
+    if(mprotect(jit.text, jit.text_size, PROT_READ | PROT_EXEC) == -1)
+        return jit_error("mprotect: %s", strerror(errno));
+
+    for(int i = 0; i < nobjs; i++)
+        run_init_array(&jit.objs[i]);
+    int (*main_fn)(int, char **, char **) = (int (*)(int, char **, char **))main_def -> addr;
+    *status = main_fn(argc, argv, environ);
+    return true;
+}
@@ -1,51 +1,279 @@
 #include "9cc.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
-static char *read_file(char *path){
-    FILE *fp = fopen(path, "r");
-    if(!fp){
-        error("cannot open %s: %s", path, strerror(errno));
-    }
-    
-    /* ファイルの最後まで移動 */
-    if(fseek(fp, 0, SEEK_END) == -1){
-        error("%s: fseek: %s", path, strerror(errno));
+/*  9cc file                       fileをコンパイルして標準出力に書く
+    9cc [-j N] [-o out] file       outに書く
+    9cc [-j N] [-d dir] file...    複数のファイルをN個のスレッドで同時にコンパイルする。
+                                   出力はdir/名前.s。dirがなければ入力と同じ場所に書く。
+    -I dirは#include <...>と"..."で探すディレクトリを追加する。
+    -cならアセンブリの代わりにELFの再配置可能オブジェクト(名前.o)を出力する。ファイルが一つでも標準出力には書かない。
+    9cc --run file... [-- arg...]  ファイルをコンパイルしてこのプロセスのメモリ上でリンクし、mainを呼ぶ。
+                                   .oのファイルはそのままリンクする。終了コードはmainの戻り値。
+    --cache DIRはコンパイル結果をDIRにキャッシュし、同じ入力ならコンパイルせずにそれを使う。
+    --cache-size SIZEはその上限(k, M, Gを付けられる。既定は1G)、--cache-statsはヒットした回数などを表示する。
+    9cc --emit-pch [-o out] header ヘッダをパースした後の宣言とマクロをイメージ(header.pch)に書く。
+    --include-pch FILEはFILEのヘッダを先にincludeしたのと同じ状態から、ヘッダをパースせずにコンパイルを始める。
+    9cc --server SOCKET [-j N]     SOCKETで待ち受けて、9cc-clientから送られたソースをN個のスレッドで同時にコンパイルする。
+                                   --include-pch FILEなら、FILEを使う要求に備えて最初に読んでおく。
+    Nの既定値はCPUの数。各スレッドは自分のコンパイラの状態(ctx)を持つ。
+    ファイルがNより少ない場合は、一つのファイルの字句解析と関数のコード生成も並列に行う。 */
+
+typedef struct{
+    char *input;
+    char *output; // NULLなら標準出力
+    Buffer obj; // --runの場合のオブジェクト
+}Job;
+
+static Job *jobs;
+static int njobs;
+static atomic_int next_job; // 次に取るjobの番号
+static atomic_int nfailed;
+static bool run_mode; // --run
+static pthread_mutex_t stderr_lock = PTHREAD_MUTEX_INITIALIZER; // エラーメッセージが混ざらないように
+
+noreturn static void usage(void){
+    fprintf(ERROR, "usage: 9cc [-c | --emit-pch] [-j N] [-I DIR] [--include-pch FILE] [-o FILE | -d DIR] [CACHE OPTIONS] FILE...\n"
+                   "       9cc --run [-j N] [-I DIR] [--include-pch FILE] [CACHE OPTIONS] FILE... [-- ARG...]\n"
+                   "       9cc --server SOCKET [-j N] [--include-pch FILE] [CACHE OPTIONS]\n"
+                   "cache options: --cache DIR [--cache-size SIZE] [--cache-stats]\n");
+    exit(EXIT_FAILURE);
+}
+
+static bool write_all(int fd, char *p, size_t len){
+    while(len){
+        ssize_t n = write(fd, p, len);
+        if(n == -1){
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
     }
+    return true;
+}
+
+static void report(char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&stderr_lock);
+    vfprintf(ERROR, fmt, ap);
+    pthread_mutex_unlock(&stderr_lock);
+    va_end(ap);
+}
+
+static bool write_output(Job *job, Buffer *out){
+    if(!job -> output)
+        return write_all(STDOUT_FILENO, out -> data, out -> len);
+
+    int fd = open(job -> output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1)
+        return false;
+    bool ok = write_all(fd, out -> data, out -> len);
+    return close(fd) == 0 && ok;
+}
 
-    size_t size = ftell(fp);
+/* リンクするだけの.oを読む */
+static bool read_object(Job *job){
+    int fd = open(job -> input, O_RDONLY);
+    if(fd == -1)
+        return false;
+    char buf[64 * 1024];
+    ssize_t n;
+    while((n = read(fd, buf, sizeof(buf))) > 0 || (n == -1 && errno == EINTR))
+        if(n > 0)
+            buf_append(&job -> obj, buf, n);
+    close(fd);
+    return n == 0;
+}
+
+static bool is_object(char *path){
+    size_t len = strlen(path);
+    return len > 2 && !strcmp(path + len - 2, ".o");
+}
 
-    /* ファイルの先頭に移動 */
-    if(fseek(fp, 0, SEEK_SET) == -1){
-        error("%s: fseek: %s", path, strerror(errno));
+static void run_job(Job *job){
+    if(run_mode && is_object(job -> input)){
+        if(!read_object(job)){
+            report("%s: %s\n", job -> input, strerror(errno));
+            nfailed++;
+        }
+        return;
     }
 
-    char *buf = calloc(1, size + 2); // \0\n用に+2
-    fread(buf, size, 1, fp);
+    CompileResult res;
+    bool ok = compile_file(job -> input, &res);
+    if(res.diag.len)
+        report("%.*s", (int)res.diag.len, res.diag.data);
+    if(ok && run_mode){
+        job -> obj = res.out; // 実行するまで取っておく
+        res.out = (Buffer){};
+    }else if(ok && !write_output(job, &res.out)){
+        report("%s: %s\n", job -> output ? job -> output : "write", strerror(errno));
+        ok = false;
+    }
+    free_result(&res);
+    if(!ok)
+        nfailed++;
+}
 
-    /* ファイルが\n\0で終わっている様にする。*/
-    if(size == 0 || buf[size - 1] != '\n'){
-        buf[size] = '\n';
+static void *worker(void *arg){
+    for(;;){
+        int i = next_job++;
+        if(i >= njobs)
+            return NULL;
+        run_job(&jobs[i]);
     }
+}
 
-    fclose(fp);
-    return buf;
+/* 1024, 64k, 2Gなど */
+static size_t parse_size(char *s){
+    char *end;
+    size_t size = strtoull(s, &end, 10);
+    switch(*end){
+        case 'k': case 'K': return size << 10;
+        case 'm': case 'M': return size << 20;
+        case 'g': case 'G': return size << 30;
+        case '\0': return size;
+    }
+    usage();
 }
 
 int main(int argc, char* argv[]){
-    if(argc != 2){
-        fprintf(ERROR, "引数の個数が正しくありません\n");
-        return EXIT_FAILURE;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *output = NULL;
+    char *dir = NULL;
+    char *cache = NULL;
+    char *server = NULL;
+    bool cache_stats = false;
+
+    // --の後ろは--runで実行するプログラムの引数
+    int prog_argc = 0;
+    char **prog_argv = NULL;
+    for(int i = 1; i < argc; i++){
+        if(!strcmp(argv[i], "--")){
+            prog_argv = argv + i + 1;
+            prog_argc = argc - i - 1;
+            argc = i;
+            break;
+        }
+    }
+
+    static struct option long_options[] = {
+        {"run", no_argument, NULL, 'r'},
+        {"server", required_argument, NULL, 'L'},
+        {"cache", required_argument, NULL, 'C'},
+        {"cache-size", required_argument, NULL, 'S'},
+        {"cache-stats", no_argument, NULL, 's'},
+        {"emit-pch", no_argument, NULL, 'P'},
+        {"include-pch", required_argument, NULL, 'H'},
+        {},
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "cj:o:d:I:", long_options, NULL)) != -1){
+        switch(opt){
+            case 'r':
+                run_mode = compile_options.emit_object = true;
+                break;
+            case 'L':
+                server = optarg;
+                break;
+            case 'C':
+                cache = optarg;
+                break;
+            case 'S':
+                cache_max_size = parse_size(optarg);
+                break;
+            case 's':
+                cache_stats = true;
+                break;
+            case 'P':
+                compile_options.emit_pch = true;
+                break;
+            case 'H':
+                compile_options.include_pch = optarg;
+                break;
+            case 'c':
+                compile_options.emit_object = true;
+                break;
+            case 'j':
+                nthreads = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'I':
+                add_include_path(&compile_options, optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+
+    njobs = argc - optind;
+    if(server){
+        if(njobs || nthreads < 1 || run_mode || output || dir || compile_options.emit_pch)
+            usage();
+        scan_select(SCAN_AVX2);
+        serve(server, nthreads, cache, cache_stats);
+    }
+    if(njobs == 0 || nthreads < 1 || (output && (dir || njobs > 1)) || (run_mode && (output || dir)) ||
+       (compile_options.emit_pch && (run_mode || compile_options.emit_object)))
+        usage();
+
+    if(cache)
+        cache_init(cache);
+
+    jobs = calloc(njobs, sizeof(Job));
+    for(int i = 0; i < njobs; i++){
+        jobs[i].input = argv[optind + i];
+        if(run_mode)
+            continue;
+        if(output)
+            jobs[i].output = output;
+        else if(dir || compile_options.emit_object || compile_options.emit_pch || (njobs > 1 && strcmp(jobs[i].input, "-")))
+            jobs[i].output = output_path(jobs[i].input, dir, compile_options.emit_pch ? "pch" : compile_options.emit_object ? "o" : "s");
+        // 入力が一つなら今まで通り標準出力に書く
     }
 
-    /* ファイルから入力を読み込む */
-    char *buf = read_file(argv[1]);
-    
-    /* tokenize */
-    tokenize(argv[1], buf);
+    scan_select(SCAN_AVX2);
 
-    /* 構文解析 */
-    Obj *program = parse();
+    // ファイルの数がスレッドより少なければ、余ったスレッドは各ファイルの字句解析とコード生成に回す
+    codegen_threads = lex_threads = nthreads / MIN(nthreads, njobs);
+    nthreads = MIN(nthreads, njobs);
+    if(nthreads == 1){
+        worker(NULL);
+    }else{
+        pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+        for(int i = 0; i < nthreads; i++)
+            pthread_create(&threads[i], NULL, worker, NULL);
+        for(int i = 0; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+    }
+    if(cache)
+        cache_finish(cache_stats);
+    if(nfailed)
+        return EXIT_FAILURE;
 
-    codegen(program);
-    
+    if(run_mode){
+        // argv[0]は最初の入力ファイルの名前にする
+        ObjectFile *objs = calloc(njobs, sizeof(ObjectFile));
+        char **args = calloc(prog_argc + 2, sizeof(char *));
+        for(int i = 0; i < njobs; i++)
+            objs[i] = (ObjectFile){jobs[i].input, jobs[i].obj.data, jobs[i].obj.len};
+        args[0] = jobs[0].input;
+        memcpy(args + 1, prog_argv, prog_argc * sizeof(char *));
+        int status;
+        if(!jit_run(objs, njobs, prog_argc + 1, args, &status))
+            return EXIT_FAILURE;
+        exit(status); // 実行したプログラムのstdioのバッファを書き出すためにexitで終わる
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -1,32 +1,5 @@
 #include "9cc.h"
 
-Token *token;
-
-static Obj *locals;
-static Obj *globals;
-
-static Obj *current_fn; // 現在parseしている関数
-
-// current_fn内のlabeled statementとgotoのリスト
-static Node *labels;
-static Node *gotos;
-
-static char *brk_label;
-static char *cont_label;
-
-static Node *current_switch;
-
-typedef struct VarScope VarScope;
-
-struct VarScope {
-    VarScope *next;
-    char *name;
-    Obj *var;
-    Type *type_def;
-    Type *enum_ty;
-    int enum_val;
-};
-
 typedef struct {
     bool is_typedef;
     bool is_static;
@@ -34,22 +7,6 @@ typedef struct {
     int align;
 }VarAttr;
 
-typedef struct TagScope TagScope;
-struct TagScope{
-    TagScope *next;
-    char *name;
-    Type *ty;
-};
-
-typedef struct Scope Scope;
-/* Cには変数のスコープと構造体タグのスコープがある */
-struct Scope{
-    Scope *next;
-    VarScope *vars;
-    TagScope *tags;
-};
-
-static Scope *scope = &(Scope){}; //現在のスコープ
 
 typedef struct Initializer Initializer;
 struct Initializer{
@@ -59,7 +16,10 @@ struct Initializer{
     
     Node *expr;
 
+    /*  構造体と共用体はメンバごとに一つ。配列は明示的に初期化された先頭のlen個だけを持ち、
+        残りの要素は0で初期化されるものとして扱う。 */
     Initializer **children;
+    int len;
 };
 
 typedef struct InitDesg InitDesg;
@@ -71,61 +31,63 @@ struct InitDesg{
 };
 
 static void enter_scope(void){
-    Scope *sc = calloc(1, sizeof(Scope));
-    sc -> next = scope;
-    scope = sc;
+    ArenaMark mark = arena_mark(&ctx -> scope_arena);
+    Scope *sc = arena_alloc(&ctx -> scope_arena, sizeof(Scope));
+    sc -> next = ctx -> scope;
+    sc -> mark = mark;
+    ctx -> scope = sc;
 }
 
 static void leave_scope(void){
-    scope = scope -> next;
+    Scope *sc = ctx -> scope;
+    ctx -> scope = sc -> next;
+    free(sc -> vars.buckets);
+    free(sc -> tags.buckets);
+    arena_reset(&ctx -> scope_arena, sc -> mark); // このスコープのVarScopeをまとめて解放
+}
+
+/* エラーで途中のスコープが残っている場合に、まとめて解放する。 */
+void free_scopes(void){
+    while(ctx -> scope)
+        leave_scope();
 }
 
-/* 現在のScopeに名前を登録 */
+/* 現在のScopeに名前を登録。同じスコープの同名のエントリは上書きされる。nameはinternされた名前 */
 static VarScope *push_scope(char *name){
-    VarScope *vsc = calloc(1, sizeof(VarScope));
+    VarScope *vsc = arena_alloc(&ctx -> scope_arena, sizeof(VarScope));
     vsc -> name = name;
-    vsc -> next = scope -> vars;
-    scope -> vars = vsc;
+    hashmap_put_ptr(&ctx -> scope -> vars, name, vsc);
     return vsc;
 }
 
 /* 現在のScopeにstruct tagを登録 */
 static void push_tag_scope(char *name, Type *ty){
-    TagScope *tsc = calloc(1, sizeof(TagScope));
-    tsc -> name = name;
-    tsc -> ty = ty;
-    tsc -> next = scope -> tags;
-    scope -> tags = tsc;
+    hashmap_put_ptr(&ctx -> scope -> tags, name, ty);
 }
 
-/* トークンの名前をバッファに格納してポインタを返す。strndupと同じ動作。 */
+/* 識別子のinternされた名前を返す。 */
 static char* get_ident(Token* tok){
     if(tok -> kind != TK_IDENT)
         error_at(tok -> str, "expected an identifier\n");
-    char* name = calloc(1, tok -> len + 1); // null終端するため。
-    return strncpy(name, tok -> str, tok -> len);
+    return tok -> name;
 }
 
 /* 名前で検索する。見つからなかった場合はNULLを返す。 */
 static VarScope *find_var(Token* tok) {
-    for(Scope *sc = scope; sc; sc = sc -> next){
-        for(VarScope *vsc = sc -> vars; vsc; vsc = vsc -> next){
-            if(is_equal(tok, vsc -> name)){
-                return vsc;
-            }
-        }
+    for(Scope *sc = ctx -> scope; sc; sc = sc -> next){
+        VarScope *vsc = hashmap_get_ptr(&sc -> vars, tok -> name);
+        if(vsc)
+            return vsc;
     }
     return NULL;
 }
 
-/* struct tagを名前で検索する(同じタグ名の場合新しいほうが優先される。) */
+/* struct tagを名前で検索する(内側のスコープのタグが優先される。) */
 static Type* find_tag(Token *tok){
-    for(Scope *sc = scope; sc; sc = sc -> next){
-        for(TagScope *tsc = sc -> tags; tsc; tsc = tsc -> next){
-            if(is_equal(tok, tsc -> name)){
-                return tsc -> ty;
-            }
-        }
+    for(Scope *sc = ctx -> scope; sc; sc = sc -> next){
+        Type *ty = hashmap_get_ptr(&sc -> tags, tok -> name);
+        if(ty)
+            return ty;
     }
     return NULL;
 }
@@ -143,7 +105,7 @@ static Type *find_typedef(Token *tok){
 
 /* 新しい変数を作成 */
 static Obj* new_var(char* name, Type* ty){
-    Obj* var = calloc(1, sizeof(Obj));
+    Obj* var = arena_alloc(&ctx -> node_arena, sizeof(Obj));
     var -> ty = ty;
     var -> align = ty -> align;
     var -> name = name;
@@ -154,8 +116,8 @@ static Obj* new_var(char* name, Type* ty){
 /* 新しい変数を作成してリストに登録。 TODO: 重複定義を落とす*/
 static Obj *new_lvar(char* name, Type *ty){
     Obj *lvar = new_var(name, ty);
-    lvar -> next = locals;
-    locals = lvar;
+    lvar -> next = ctx -> locals;
+    ctx -> locals = lvar;
     return lvar;
 }
 
@@ -164,16 +126,14 @@ static Obj *new_gvar(char *name, Type *ty) {
     gvar -> is_definition = true;
     gvar -> is_global = true;
     gvar -> is_static = true;
-    gvar -> next = globals;
-    globals = gvar;
+    gvar -> next = ctx -> globals;
+    ctx -> globals = gvar;
     return gvar;
 }
 
 static char* new_unique_name(void){
-    static int idx;
-    char *buf = calloc(1, 10);
-    sprintf(buf, ".L.%d", idx);
-    idx++;
+    char *buf = arena_alloc(&ctx -> node_arena, 16);
+    sprintf(buf, ".L.%d", ctx -> unique_idx++);
     return buf;
 }
 
@@ -183,13 +143,42 @@ static Obj *new_anon_gvar(Type *ty){
 
 static Obj *new_string_literal(Token *tok){
     Obj *strl = new_anon_gvar(tok -> ty);
-    strl -> init_data = tok -> str;
+    strl -> init_data = tok -> data;
     return strl;
 }
 
+/* kindが使うフィールドまでの大きさ。lhsとrhsだけを使うkindはNodeの共用体部分を確保しない。 */
+static size_t node_size(NodeKind kind){
+    switch(kind){
+        case ND_NUM:
+        case ND_VAR:
+        case ND_MEMZERO:
+        case ND_MEMBER:
+        case ND_BLOCK:
+        case ND_STMT_EXPR:
+            return offsetof(Node, val) + sizeof(int64_t);
+        case ND_FUNCCALL:
+            return offsetof(Node, args) + sizeof(Node*);
+        case ND_GOTO:
+        case ND_LABEL:
+        case ND_CASE:
+            return offsetof(Node, goto_next) + sizeof(Node*);
+        case ND_IF:
+        case ND_COND:
+            return offsetof(Node, els) + sizeof(Node*);
+        case ND_DO:
+            return offsetof(Node, cont_label) + sizeof(char*);
+        case ND_FOR:
+        case ND_SWITCH:
+            return sizeof(Node);
+        default:
+            return offsetof(Node, val);
+    }
+}
+
 /* 新しいnodeを作成 */
 static Node *new_node(NodeKind kind){
-    Node* np = calloc(1, sizeof(Node));
+    Node* np = arena_alloc(&ctx -> node_arena, node_size(kind));
     np -> kind = kind;
     return np;
 }
@@ -242,7 +231,7 @@ static Type *abstract_declarator(Type *ty);
 static Node *expr_stmt(void);
 static Node* stmt(void);
 static Node* compound_stmt(void);
-static Node* declaration(Type *base, VarAttr *attr);
+static Node* declaration(Type *base, VarAttr *attr, Type *first);
 static void assign_initializer(Initializer *init);
 static Node *lvar_initializer(Obj *var);
 static void gvar_initialzier(Obj *var);
@@ -277,19 +266,16 @@ static void parse_typedef(Type *base){
         if(!ty -> name)
             error_at(ty -> name_pos -> str, "typedef name omitted");
         push_scope(get_ident(ty -> name)) -> type_def = ty;
-    }while(consume(","));
-    expect(";");
+    }while(consume(','));
+    expect(';');
 }
 
-// tokenを先読みして関数かどうか調べる
-static bool is_function(void){
-    if(is_equal(token, ";"))
-        return false;
-    Token *tok = token;
-    Type dummy = {};
-    Type *ty = declarator(&dummy);
-    token = tok;
-    return ty -> kind == TY_FUNC;
+/*  最初の宣言子を読む。宣言子がない場合(struct S {...};など)はNULLを返す。
+    読んだ型が関数かどうかで関数定義か変数宣言かを決めるので、宣言子を読み直す必要はない。 */
+static Type *first_declarator(Type *base){
+    if(is_equal(ctx -> token, ';'))
+        return NULL;
+    return declarator(base);
 }
 
 /* ty->paramsは arg1->arg2->arg3 ...のようになっている。これを素直に前からnew_lvarを読んでいくと、localsは arg3->arg2->arg1という風になる。関数の先頭では渡されたパラメータを退避する必要があり、そのためにはlocalsをarg1->arg2->arg3のようにしたい。そこでty->paramsの最後の要素から生成している。*/
@@ -303,9 +289,9 @@ static void create_param_lvars(Type* param){
 }
 
 static void resolve_goto_labels(void){
-    for(Node *x = gotos; x; x = x -> goto_next){
-        for(Node *y = labels; y; y = y -> goto_next){
-            if(!strcmp(x -> label, y -> label)){
+    for(Node *x = ctx -> gotos; x; x = x -> goto_next){
+        for(Node *y = ctx -> labels; y; y = y -> goto_next){
+            if(x -> label == y -> label){
                 x -> unique_label = y -> unique_label;
                 break;
             }
@@ -313,47 +299,47 @@ static void resolve_goto_labels(void){
         if(!x -> unique_label)
             error("use of undeclaraed label");
     }
-    gotos = labels = NULL;
+    ctx -> gotos = ctx -> labels = NULL;
 }
 
-// function = declarator ( ";" | "{" compound_stmt)
-static void function(Type *base, VarAttr *attr){
-    Type *ty = declarator(base);
-
+// function = declarator ( ";" | "{" compound_stmt)。declaratorは呼び出し側で読んである。
+static void function(Type *ty, VarAttr *attr){
     if(!ty -> name)
         error_at(ty -> name_pos -> str, "function name omitted");
 
     Obj* func = new_gvar(get_ident(ty -> name), ty);
-    func -> is_definition = !consume(";");
+    func -> is_definition = !consume(';');
     func -> is_static = attr -> is_static;
 
     if(!func -> is_definition)
         return;
     
-    current_fn = func;
-    locals = NULL;
+    ctx -> current_fn = func;
+    ctx -> locals = NULL;
     enter_scope(); //仮引数を関数のスコープに入れるため。
     create_param_lvars(ty -> params);
-    func -> params = locals; // 可変長引数はparamには含まない。
+    func -> params = ctx -> locals; // 可変長引数はparamには含まない。
 
     if(ty -> is_variadic)
-        func -> va_area = new_lvar("__va_area__", array_of(ty_char, 136));
+        func -> va_area = new_lvar(intern("__va_area__", 11), array_of(ty_char, 136));
     
-    expect("{");
+    expect('{');
     func -> body = compound_stmt();
-    func-> locals = locals;
+    func-> locals = ctx -> locals;
     leave_scope();
     resolve_goto_labels();
 }
 
 // global_variable = declarator ( "=" global-initialzier )? ("," declarator ("=" global-initialzier )? )* 
-static void global_variable(Type *base, VarAttr *attr){
+// firstは呼び出し側で読んだ最初の宣言子。なければNULL。
+static void global_variable(Type *base, VarAttr *attr, Type *first){
     bool is_first = true;
-    while(!consume(";")){
+    while(first || !consume(';')){
         if(!is_first)
-            expect(",");
+            expect(',');
         is_first = false;
-        Type *ty = declarator(base);
+        Type *ty = first ? first : declarator(base);
+        first = NULL;
         if(!ty -> name)
             error_at(ty -> name_pos -> str, "variable name omitted");
         Obj *var = new_gvar(get_ident(ty -> name), ty);
@@ -363,15 +349,18 @@ static void global_variable(Type *base, VarAttr *attr){
         if(attr -> align)
             var -> align = attr -> align;
     
-        if(consume("="))
+        if(consume('='))
             gvar_initialzier(var);
     }
 }
 
 /* program = (function-definition | global-variable)* */
 Obj * parse(void){
-    globals = NULL;
+    enter_scope(); // ファイルスコープ
+    if(ctx -> pch)
+        pch_restore_scope(); // プリコンパイルしたヘッダの宣言
     while(!at_eof()){
+        discard_tokens(); // トップレベルの宣言をまたいで前のトークンに戻ることはない
         VarAttr attr = {};
         Type *base = declspec(&attr);
 
@@ -380,24 +369,28 @@ Obj * parse(void){
             continue;
         }
         
-        if(is_function()){
-            function(base, &attr);
+        Type *ty = first_declarator(base);
+        if(ty && is_func(ty)){
+            function(ty, &attr);
             continue;
         }
         
-        global_variable(base, &attr);
+        global_variable(base, &attr, ty);
     }
-    return globals;
+    if(ctx -> opts -> emit_pch)
+        pch_save(); // ファイルスコープを抜ける前に書き出す
+    leave_scope();
+    return ctx -> globals;
 }
 
 /* expr-stmt = expr? ";" */
 static Node *expr_stmt(void){
-    if(consume(";")){
+    if(consume(';')){
         return new_node(ND_BLOCK); // null statement
     }
     Node *node = new_node(ND_EXPR_STMT);
     node -> lhs = expr();
-    expect(";");
+    expect(';');
     return node;
 }
 
@@ -417,180 +410,180 @@ static Node *expr_stmt(void){
         | expr-stmt */
 static Node* stmt(void){
 
-    if(consume("return")){
+    if(consume(KW_RETURN)){
         Node *node = new_node(ND_RET);
-        if(consume(";"))
+        if(consume(';'))
             return node;
         
         Node *exp = expr();
         add_type(exp);
-        expect(";");
-        node -> lhs = new_cast(exp, current_fn -> ty -> ret_ty);
+        expect(';');
+        node -> lhs = new_cast(exp, ctx -> current_fn -> ty -> ret_ty);
         return node;
     }
 
-    if(consume("if")){
-        expect("(");
+    if(consume(KW_IF)){
+        expect('(');
         Node *node = new_node(ND_IF);
         node -> cond = expr();
-        expect(")");
+        expect(')');
         node -> then = stmt();
-        if(consume("else")){
+        if(consume(KW_ELSE)){
             node -> els = stmt();
         }
         return node;
     }
 
-    if(consume("while")){
+    if(consume(KW_WHILE)){
         Node *node = new_node(ND_FOR);
-        char *brk = brk_label;
-        char *cont = cont_label;
-        brk_label = node -> brk_label = new_unique_name();
-        cont_label = node -> cont_label = new_unique_name();
-        expect("(");
+        char *brk = ctx -> brk_label;
+        char *cont = ctx -> cont_label;
+        ctx -> brk_label = node -> brk_label = new_unique_name();
+        ctx -> cont_label = node -> cont_label = new_unique_name();
+        expect('(');
         node -> cond = expr();
-        expect(")");
+        expect(')');
         node -> then = stmt();
-        brk_label = brk;
-        cont_label = cont;
+        ctx -> brk_label = brk;
+        ctx -> cont_label = cont;
         return node;
     }
 
-    if(consume("do")){
+    if(consume(KW_DO)){
         Node *node = new_node(ND_DO);
-        char *brk = brk_label;
-        char *cont = cont_label;
-        brk_label = node -> brk_label = new_unique_name();
-        cont_label = node -> cont_label = new_unique_name();
+        char *brk = ctx -> brk_label;
+        char *cont = ctx -> cont_label;
+        ctx -> brk_label = node -> brk_label = new_unique_name();
+        ctx -> cont_label = node -> cont_label = new_unique_name();
         node -> then = stmt();
 
-        brk_label = brk;
-        cont_label = cont;
+        ctx -> brk_label = brk;
+        ctx -> cont_label = cont;
 
-        expect("while");
-        expect("(");
+        expect(KW_WHILE);
+        expect('(');
         node -> cond = expr();
-        expect(")");
-        expect(";");
+        expect(')');
+        expect(';');
         return node;
     }
 
-    if(consume("for")){
+    if(consume(KW_FOR)){
         enter_scope();
         Node *node = new_node(ND_FOR);
-        char *brk = brk_label;
-        char *cont = cont_label;
-        brk_label = node -> brk_label = new_unique_name();
-        cont_label = node -> cont_label = new_unique_name();
-        expect("(");
-        if(is_typename(token)){
+        char *brk = ctx -> brk_label;
+        char *cont = ctx -> cont_label;
+        ctx -> brk_label = node -> brk_label = new_unique_name();
+        ctx -> cont_label = node -> cont_label = new_unique_name();
+        expect('(');
+        if(is_typename(ctx -> token)){
             Type *base = declspec(NULL);
-            node -> init = declaration(base, NULL);
+            node -> init = declaration(base, NULL, NULL);
         }else{
             node -> init = expr_stmt();
         }
-        if(!is_equal(token, ";")){
+        if(!is_equal(ctx -> token, ';')){
             node -> cond = expr();
         }
-        expect(";");
-        if(!is_equal(token, ")")){
+        expect(';');
+        if(!is_equal(ctx -> token, ')')){
             node -> inc = expr();
         }
-        expect(")");
+        expect(')');
         node -> then = stmt();
-        brk_label = brk;
-        cont_label = cont;
+        ctx -> brk_label = brk;
+        ctx -> cont_label = cont;
         leave_scope();
         return node;
     }
 
-    if(consume("goto")){
+    if(consume(KW_GOTO)){
         Node *node = new_node(ND_GOTO);
-        node -> label = get_ident(token);
+        node -> label = get_ident(ctx -> token);
         next_token();
-        expect(";");
-        node -> goto_next = gotos;
-        gotos = node;
+        expect(';');
+        node -> goto_next = ctx -> gotos;
+        ctx -> gotos = node;
         return node;
     }
 
-    if(token -> kind == TK_IDENT && is_equal(token -> next, ":")){
+    if(ctx -> token -> kind == TK_IDENT && is_equal(next_of(ctx -> token), ':')){
         Node *node = new_node(ND_LABEL);
-        node -> label = get_ident(token);
+        node -> label = get_ident(ctx -> token);
         node -> unique_label = new_unique_name();
         next_token();
-        expect(":");
+        expect(':');
         node -> lhs = stmt();
-        node -> goto_next = labels;
-        labels = node;
+        node -> goto_next = ctx -> labels;
+        ctx -> labels = node;
         return node;
     }
 
-    if(consume("break")){
-        if(!brk_label)
+    if(consume(KW_BREAK)){
+        if(!ctx -> brk_label)
             error("stary break");
         Node *node = new_node(ND_GOTO);
-        node -> unique_label = brk_label;
-        expect(";");
+        node -> unique_label = ctx -> brk_label;
+        expect(';');
         return node;
     }
 
-    if(consume("continue")){
-        if(!cont_label)
+    if(consume(KW_CONTINUE)){
+        if(!ctx -> cont_label)
             error("stary continue");
         Node *node = new_node(ND_GOTO);
-        node -> unique_label = cont_label;
-        expect(";");
+        node -> unique_label = ctx -> cont_label;
+        expect(';');
         return node;
     }
 
-    if(consume("switch")){
-        Node *sw = current_switch;
-        Node *node = current_switch = new_node(ND_SWITCH);
-        char *brk = brk_label;
-        brk_label = node -> brk_label = new_unique_name(); 
-        expect("(");
+    if(consume(KW_SWITCH)){
+        Node *sw = ctx -> current_switch;
+        Node *node = ctx -> current_switch = new_node(ND_SWITCH);
+        char *brk = ctx -> brk_label;
+        ctx -> brk_label = node -> brk_label = new_unique_name(); 
+        expect('(');
         node -> cond = expr();
-        expect(")");
+        expect(')');
         node -> then = stmt();
-        brk_label = brk;
-        current_switch = sw;
+        ctx -> brk_label = brk;
+        ctx -> current_switch = sw;
         return node;
     }
 
-    if(consume("case")){
-        if(!current_switch)
+    if(consume(KW_CASE)){
+        if(!ctx -> current_switch)
             error("stray case");
         
         Node *node = new_node(ND_CASE);
-        node -> val = const_expr();
-        expect(":");
+        node -> case_val = const_expr();
+        expect(':');
 
         node -> unique_label = new_unique_name();
         node -> lhs = stmt();
 
         /* リストに登録 */
-        node -> case_next = current_switch -> case_next;
-        current_switch -> case_next = node;
+        node -> case_next = ctx -> current_switch -> cases;
+        ctx -> current_switch -> cases = node;
 
         return node;
     }
 
-    if(consume("default")){
-        if(!current_switch)
+    if(consume(KW_DEFAULT)){
+        if(!ctx -> current_switch)
             error("stary default");
-        if(current_switch -> default_case)
+        if(ctx -> current_switch -> default_case)
             error("muliple default labels in one switch");
         
-        expect(":");
+        expect(':');
         Node *node = new_node(ND_CASE);
         node -> unique_label = new_unique_name();
         node -> lhs = stmt();
-        current_switch -> default_case = node;
+        ctx -> current_switch -> default_case = node;
         return node;
     }
 
-    if(consume("{")){
+    if(consume('{')){
         return compound_stmt();
     }
 
@@ -598,11 +591,31 @@ static Node* stmt(void){
 }
 
 static bool is_typename(Token *tok){
-    static char* kw[] = {"void", "char", "short", "int", "long", "void", "struct", "union", "typedef", "_Bool", "enum", "static", "extern", "_Alignas", "signed", "unsigned", "const", "volatile", "auto", "register", "restrict", "__restrict", "__restrict__", "_Noreturn"};
-    for(int i =0; i < sizeof(kw) / sizeof(*kw); i++){
-        if(is_equal(tok, kw[i])){
+    switch(tok -> id){
+        case KW_VOID:
+        case KW_CHAR:
+        case KW_SHORT:
+        case KW_INT:
+        case KW_LONG:
+        case KW_STRUCT:
+        case KW_UNION:
+        case KW_TYPEDEF:
+        case KW_BOOL:
+        case KW_ENUM:
+        case KW_STATIC:
+        case KW_EXTERN:
+        case KW_ALIGNAS:
+        case KW_SIGNED:
+        case KW_UNSIGNED:
+        case KW_CONST:
+        case KW_VOLATILE:
+        case KW_AUTO:
+        case KW_REGISTER:
+        case KW_RESTRICT:
+        case KW_RESTRICT2:
+        case KW_RESTRICT3:
+        case KW_NORETURN:
             return true;
-        }
     }
     return find_typedef(tok);
 }
@@ -613,8 +626,8 @@ static Node* compound_stmt(void){
     Node head = {};
     Node *cur = &head;
     enter_scope();
-    while(!consume("}")){
-        if(is_typename(token) && !is_equal(token -> next, ":")){
+    while(!consume('}')){
+        if(is_typename(ctx -> token) && !is_equal(next_of(ctx -> token), ':')){
             VarAttr attr = {};
             Type *base = declspec(&attr);
             if(attr.is_typedef){
@@ -623,16 +636,17 @@ static Node* compound_stmt(void){
             }
 
             if(attr.is_extern){
-                global_variable(base, &attr);
+                global_variable(base, &attr, NULL);
                 continue;
             }
 
-            if(is_function()){
-                function(base, &attr);
+            Type *ty = first_declarator(base);
+            if(ty && is_func(ty)){
+                function(ty, &attr);
                 continue;
             }
 
-            cur = cur -> next = declaration(base, &attr);
+            cur = cur -> next = declaration(base, &attr, ty);
         }
         else{
             cur = cur -> next = stmt();
@@ -649,18 +663,18 @@ static void struct_members(Type *ty){
     Member head = {};
     Member *cur = &head;
     int idx = 0;
-    while(!consume("}")){
+    while(!consume('}')){
         VarAttr attr = {};
         Type *base = declspec(&attr);
         bool is_first = true;
-        while(!consume(";")){
+        while(!consume(';')){
              if(!is_first)
-                expect(",");
+                expect(',');
             is_first = false;
 
-            struct Member *mem = calloc(1, sizeof(Member));
+            struct Member *mem = arena_alloc(&ctx -> type_arena, sizeof(Member));
             mem -> ty = declarator(base);
-            mem -> name = mem -> ty -> name;
+            mem -> name = mem -> ty -> name ? mem -> ty -> name -> name : NULL;
             mem -> idx = idx++;
             mem -> align = attr.align? attr.align : mem -> ty -> align;
             cur = cur -> next = mem;
@@ -683,11 +697,11 @@ static Type *struct_union_decl(void){
     Token *tag = NULL;
 
     if(is_ident()){
-        tag = token;
+        tag = ctx -> token;
         next_token();
     }
 
-    if(tag && !is_equal(token, "{")){
+    if(tag && !is_equal(ctx -> token, '{')){
         Type *ty = find_tag(tag);
         if(ty)
             return ty;
@@ -697,17 +711,18 @@ static Type *struct_union_decl(void){
         return ty;
     }
 
-    expect("{");
+    expect('{');
     Type *ty = struct_type();
     struct_members(ty);
 
     if(tag){
         /* 現在のスコープに同名のタグがある場合。不完全型なので上書き */
-        for(TagScope *tsc = scope -> tags; tsc; tsc = tsc -> next){
-            if(is_equal(tag, tsc -> name)){
-                *tsc -> ty = *ty; // 不完全型を修正
-                return tsc -> ty;
-            }
+        Type *ty2 = hashmap_get_ptr(&ctx -> scope -> tags, tag -> name);
+        if(ty2){
+            if(pch_is_shared(ty2))
+                pch_unshare(); // 他のコンパイルと共有しているイメージの型は書き換えられない
+            *ty2 = *ty; // 不完全型を修正
+            return ty2;
         }
         push_tag_scope(get_ident(tag), ty);
     }
@@ -718,6 +733,8 @@ static Type *struct_union_decl(void){
 /* struct-decl = struct-union-decl */
 static Type *struct_decl(void){
     Type *ty = struct_union_decl();
+    if(pch_is_shared(ty))
+        return ty; // プリコンパイルしたヘッダで定義済みの型。配置も済んでいる
     ty -> kind = TY_STRUCT;
 
     /* 不完全型なら何もしない */
@@ -741,6 +758,8 @@ static Type *struct_decl(void){
 /* union-decl = struct-union-decl */
 static Type *union_decl(void){
     Type *ty = struct_union_decl();
+    if(pch_is_shared(ty))
+        return ty; // プリコンパイルしたヘッダで定義済みの型。配置も済んでいる
     ty -> kind = TY_UNION;
 
      /* 不完全型なら何もしない */
@@ -759,16 +778,17 @@ static Type *union_decl(void){
 }
 
 static bool consume_end(void){
-    if(consume("}"))
+    if(consume('}'))
         return true;
-    if(is_equal(token, ",") && is_equal(token -> next, "}")){
-        token = token -> next -> next;
+    if(is_equal(ctx -> token, ',') && is_equal(next_of(ctx -> token), '}')){
+        next_token();
+        next_token();
         return true;
     }
 }
 
 static bool is_end(void){
-    return is_equal(token, "}") || (is_equal(token, ",") && is_equal(token -> next, "}"));
+    return is_equal(ctx -> token, '}') || (is_equal(ctx -> token, ',') && is_equal(next_of(ctx -> token), '}'));
 }
 
 /*  enum-specifier   = ident? "{" enum-list? "}"
@@ -779,33 +799,33 @@ static Type *enum_specifier(void){
     Token *tag = NULL;
     Type *ty = enum_type();
 
-    if(token -> kind == TK_IDENT){
-        tag = token;
+    if(ctx -> token -> kind == TK_IDENT){
+        tag = ctx -> token;
         next_token();
     }
 
-    if(tag && !is_equal(token, "{")){
+    if(tag && !is_equal(ctx -> token, '{')){
         ty = find_tag(tag);
         if(!ty)
-            error_at(token -> str, "unknown enum type\n");
+            error_at(ctx -> token -> str, "unknown enum type\n");
         if(ty -> kind != TY_ENUM)
-            error_at(token -> str, "not an enum type tag\n");
+            error_at(ctx -> token -> str, "not an enum type tag\n");
         return ty;
     }
 
-    expect("{");
+    expect('{');
 
     int64_t val = 0;
     while(!consume_end()){
-        char *name = get_ident(token);
+        char *name = get_ident(ctx -> token);
         next_token();
-        if(consume("=")){
+        if(consume('=')){
             val = const_expr();
         }
         VarScope *vsc = push_scope(name);
         vsc -> enum_ty = ty;
         vsc -> enum_val = val++;
-        consume(",");
+        consume(',');
     }
 
     if(tag)
@@ -837,43 +857,54 @@ static Type* declspec(VarAttr *attr){
     Type *ty = ty_int; // typedef tのように既存の型が指定されていない場合、intになる。
 
     /* counterの値を調べているのはint main(){ typedef int t; {typedef long t;} }のように同名の型が来た時に二回目のtでfind_typedef()がtrueになってしまうから。*/
-    while(is_typename(token)){
+    while(is_typename(ctx -> token)){
+
+        switch(ctx -> token -> id){
+            /* handle strorage class specifiers */
+            case KW_TYPEDEF:
+            case KW_STATIC:
+            case KW_EXTERN:
+                if(!attr){
+                    error_at(ctx -> token -> str, "storage class specifier is not allowed in this context");
+                }
+                if(ctx -> token -> id == KW_TYPEDEF)
+                    attr -> is_typedef = true;
+                else if(ctx -> token -> id == KW_STATIC)
+                    attr -> is_static = true;
+                else
+                    attr -> is_extern = true;
+
+                if(attr -> is_typedef && attr -> is_static + attr -> is_extern > 1)
+                    error_at(ctx -> token -> str, "typedef may not be used with static or extern\n");
+                next_token();
+                continue;
 
-        /* handle strorage class specifiers */
-        if(is_equal(token, "typedef") || is_equal(token, "static") || is_equal(token, "extern")){
-            if(!attr){
-                error_at(token -> str, "storage class specifier is not allowed in this context");
-            }
-            if(is_equal(token, "typedef"))
-                attr -> is_typedef = true;
-            else if(is_equal(token, "static"))
-                attr -> is_static = true;
-            else
-                attr -> is_extern = true;
-
-            if(attr -> is_typedef && attr -> is_static + attr -> is_extern > 1)
-                error_at(token -> str, "typedef may not be used with static or extern\n");
-            token = token -> next;
-            continue;
+            case KW_CONST:
+            case KW_VOLATILE:
+            case KW_AUTO:
+            case KW_REGISTER:
+            case KW_RESTRICT:
+            case KW_RESTRICT2:
+            case KW_RESTRICT3:
+            case KW_NORETURN:
+                next_token();
+                continue;
         }
 
-        if(consume("const") || consume("volatile") || consume("auto") || consume("register") || consume("restrict") || consume("__restrict") || consume("__restrict__") || consume("_Noreturn"))
-            continue;
-
         // "Alignas" "(" num | typename ")" 
-        if(consume("_Alignas")){
-            expect("(");
-            if(is_typename(token))
+        if(consume(KW_ALIGNAS)){
+            expect('(');
+            if(is_typename(ctx -> token))
                 attr -> align = typename() -> align;
             else 
                 attr -> align = const_expr();
-            expect(")");
+            expect(')');
             continue;
         }
 
 
         // handle user-degine types
-        ty = find_typedef(token); // 型名で無ければNULL
+        ty = find_typedef(ctx -> token); // 型名で無ければNULL
         
         // typedefされた型名と同名の変数定義
         if(ty && counter)
@@ -885,38 +916,38 @@ static Type* declspec(VarAttr *attr){
             break;
         }
         
-        if(consume("struct"))
+        if(consume(KW_STRUCT))
             return struct_decl();
 
-        if(consume("union"))
+        if(consume(KW_UNION))
             return union_decl();
 
-        if(consume("enum"))
+        if(consume(KW_ENUM))
             return enum_specifier();
 
         // handle built-in types
-        if(consume("_Bool"))
+        if(consume(KW_BOOL))
             counter += BOOL;
         
-        if(consume("void"))
+        if(consume(KW_VOID))
             counter += VOID;
         
-        if(consume("char"))
+        if(consume(KW_CHAR))
             counter += CHAR;
         
-        if(consume("short"))
+        if(consume(KW_SHORT))
             counter += SHORT ;
         
-        if(consume("int"))
+        if(consume(KW_INT))
             counter += INT ;
 
-        if(consume("long"))
+        if(consume(KW_LONG))
             counter += LONG;
 
-        if(consume("signed"))
+        if(consume(KW_SIGNED))
             counter |= SIGNED;
 
-        if(consume("unsigned"))
+        if(consume(KW_UNSIGNED))
             counter |= UNSIGNED;
         
         switch(counter){
@@ -979,7 +1010,7 @@ static Type* declspec(VarAttr *attr){
                 break;
             
             default:
-                error_at(token -> str, "unknown type");
+                error_at(ctx -> token -> str, "unknown type");
         }
     }
     return ty;
@@ -989,8 +1020,9 @@ static Type* declspec(VarAttr *attr){
  param       = type-specifier declarator*/
 static Type* func_params(Type *ret_ty){ 
     // func(void)は引数を取らないことを意味する。
-    if(is_equal(token, "void") && is_equal(token -> next, ")")){
-        token = token -> next ->next;
+    if(is_equal(ctx -> token, KW_VOID) && is_equal(next_of(ctx -> token), ')')){
+        next_token();
+        next_token();
         return func_type(ret_ty);
     }
 
@@ -998,13 +1030,13 @@ static Type* func_params(Type *ret_ty){
     Type *cur = &head;
     bool is_variadic = false;
 
-    while(!consume(")")){
+    while(!consume(')')){
         if(cur != &head)
-            expect(",");
+            expect(',');
         
-        if(consume("...")){
+        if(consume(PUNCT_ELLIPSIS)){
             is_variadic = true;
-            expect(")");
+            expect(')');
             break;
         }
 
@@ -1014,7 +1046,7 @@ static Type* func_params(Type *ret_ty){
         /* array of T を pointer to T に変換する */
         if(ty -> kind == TY_ARRAY){
             Token *name = ty -> name;
-            ty = pointer_to(ty -> base);
+            ty = copy_type(pointer_to(ty -> base)); // pointer_toの型は共有しているので名前を書き込まない
             ty -> name = name;
         }
 
@@ -1034,35 +1066,35 @@ static Type* func_params(Type *ret_ty){
                 | "[" array-dementions
                 | ε */ 
 static Type* type_suffix(Type *ty){
-    if(consume("(")){
+    if(consume('(')){
         return func_params(ty);
     }
-    if(consume("["))
+    if(consume('['))
         return array_dementions(ty);
     return ty;
 }
 
 /* array-dementions = ("static" | "restrict")* const-expr? "}" type-suffix */
 static Type *array_dementions(Type *ty){
-    while(is_equal(token, "static") || is_equal(token, "restrict"))
-        token = token -> next;
+    while(is_equal(ctx -> token, KW_STATIC) || is_equal(ctx -> token, KW_RESTRICT))
+        next_token();
     
-    if(consume("]")){
+    if(consume(']')){
         ty = type_suffix(ty);
         return array_of(ty, -1);
     }
     int siz = const_expr();
-    expect("]");
+    expect(']');
     ty = type_suffix(ty);
     return array_of(ty , siz);
 }
 
 // pointers = ("*" ( "const" | "volatile" | "restrict" | "__restrict" | "__restrict__")* )*
 static Type *pointers(Type *ty){
-    while(consume("*")){
+    while(consume('*')){
         ty = pointer_to(ty);
-        while(is_equal(token, "const") || is_equal(token, "volatile") || is_equal(token, "restrict") || is_equal(token, "__restrict") || is_equal(token, "__restrict__"))
-            token = token -> next;
+        while(ctx -> token -> id == KW_CONST || ctx -> token -> id == KW_VOLATILE || ctx -> token -> id == KW_RESTRICT || ctx -> token -> id == KW_RESTRICT2 || ctx -> token -> id == KW_RESTRICT3)
+            next_token();
     }
     return ty;
 }
@@ -1073,30 +1105,32 @@ static Type *pointers(Type *ty){
 static Type* declarator(Type *ty){
     ty = pointers(ty);
 
-    if(consume("(")){
-        Token *start = token;
+    if(consume('(')){
+        Token *start = ctx -> token;
         Type dummy = {};
         declarator(&dummy); // とりあえず読み飛ばす
-        expect(")");
+        expect(')');
         ty = type_suffix(ty); // ()の外側の型を確定させる。
-        Token *end = token;
-        token  = start;
+        Token *end = ctx -> token;
+        ctx -> token  = start;
         ty = declarator(ty); // ()の中の型を確定させる。
-        token = end;
+        ctx -> token = end;
         return ty;
     }
 
     Token *name = NULL;
-    Token *name_pos = token;
+    Token *name_pos = ctx -> token;
 
-    if(token -> kind == TK_IDENT){
-        name = token;
-        token = token -> next;
+    if(ctx -> token -> kind == TK_IDENT){
+        name = ctx -> token;
+        next_token();
     }
 
     ty = type_suffix(ty);
-    ty -> name = name;
-    ty -> name_pos = name_pos;
+    if(is_builtin(ty) || pch_is_shared(ty))
+        ty = copy_type(ty); // 共有している型に名前を書き込まないようにする
+    ty -> name = name ? keep_token(name) : NULL;
+    ty -> name_pos = (name == name_pos) ? ty -> name : keep_token(name_pos);
     return ty;
 }
 
@@ -1104,16 +1138,16 @@ static Type* declarator(Type *ty){
 static Type *abstract_declarator(Type *ty){
     ty = pointers(ty);
     
-    if(consume("(")){
-        Token *start = token;
+    if(consume('(')){
+        Token *start = ctx -> token;
         Type dummy = {};
         abstract_declarator(&dummy); // とりあえず読み飛ばす
-        expect(")");
+        expect(')');
         ty = type_suffix(ty); // ()の外側の型を確定させる。
-        Token *end = token;
-        token  = start;
+        Token *end = ctx -> token;
+        ctx -> token  = start;
         ty = abstract_declarator(ty); // ()の中の型を確定させる。
-        token = end;
+        ctx -> token = end;
         return ty;
     }
 
@@ -1126,11 +1160,13 @@ static Type *typename(void){
 }
 
 /* declspec declarator ("=" initalizer)? ("," declarator ("=" intializer)?)* ";" */
-static Node *declaration(Type *base, VarAttr *attr){
+// firstは呼び出し側で読んだ最初の宣言子。なければNULL。
+static Node *declaration(Type *base, VarAttr *attr, Type *first){
     Node head = {};
     Node *cur = &head;
-    while(!consume(";")){
-        Type* ty = declarator(base);
+    while(first || !consume(';')){
+        Type* ty = first ? first : declarator(base);
+        first = NULL;
 
         if(is_void(ty))
             error_at(ty -> name -> str, "variable declared void");
@@ -1140,7 +1176,7 @@ static Node *declaration(Type *base, VarAttr *attr){
         if(attr && attr -> is_static){
             Obj *var = new_anon_gvar(ty);
             push_scope(get_ident(ty -> name)) -> var = var;
-            if(consume("="))
+            if(consume('='))
                 gvar_initialzier(var);
             continue;
         }
@@ -1150,7 +1186,7 @@ static Node *declaration(Type *base, VarAttr *attr){
         if(attr && attr -> align)
             lvar -> align = attr -> align;
         
-        if(consume("=")){
+        if(consume('=')){
             Node *expr = lvar_initializer(lvar);
             cur = cur -> next  = new_unary(ND_EXPR_STMT, expr);
         }
@@ -1158,7 +1194,7 @@ static Node *declaration(Type *base, VarAttr *attr){
         if(lvar -> ty -> size < 0)
              error_at(ty -> name -> str, "variable has incomplete type");
 
-        if(consume(",")){
+        if(consume(',')){
             continue;
         }
     }
@@ -1168,27 +1204,22 @@ static Node *declaration(Type *base, VarAttr *attr){
 }
 
 static Initializer *new_initializer(Type *ty, bool is_flexible){
-    Initializer *init = calloc(1, sizeof(Initializer));
+    Initializer *init = arena_alloc(&ctx -> init_arena, sizeof(Initializer));
     init -> ty = ty;
     if(ty -> kind == TY_ARRAY){
         // 要素数の省略が許されるかつ要素数が指定されていない場合
-        if(is_flexible && ty -> size < 0){
+        if(is_flexible && ty -> size < 0)
             init -> is_flexible = true;
-            return init;
-        }
-        init -> children = calloc(ty -> array_len, sizeof(Initializer));
-        for(int i = 0; i < ty -> array_len; i++){
-            init -> children[i] = new_initializer(ty -> base, false);
-        }
+        return init; // 要素は初期化式を読みながら作る
     }
     if(ty -> kind == TY_STRUCT || ty -> kind == TY_UNION){
         int len = 0;
         for(Member *mem = ty -> members; mem; mem = mem -> next)
             len++;
-        init -> children = calloc(len, sizeof(Initializer*));
+        init -> children = arena_alloc(&ctx -> init_arena, len * sizeof(Initializer*));
         for(Member *mem = ty -> members; mem; mem = mem -> next){
             if(is_flexible && ty -> is_flexible){
-                Initializer *child = calloc(1, sizeof(Initializer));
+                Initializer *child = arena_alloc(&ctx -> init_arena, sizeof(Initializer));
                 child -> ty = mem -> ty;
                 child -> is_flexible = true;
                 init -> children[mem -> idx] = child;
@@ -1202,63 +1233,74 @@ static Initializer *new_initializer(Type *ty, bool is_flexible){
 
 // {が出てきたら}まで読み飛ばす。それ以外はassignか文字列リテラルを一つ読み飛ばす。
 static void skip_excess_element(void){
-    if(consume("{")){
-        for(int i = 0; !consume("}"); i++){
+    if(consume('{')){
+        for(int i = 0; !consume('}'); i++){
             if(0 < i)
-                expect(",");
+                expect(',');
             skip_excess_element();
         }
         return;
     }
-    if(token -> kind == TK_STR)
+    if(ctx -> token -> kind == TK_STR)
         next_token();
     else 
         assign();
 }
 
+/*  配列のi番目の要素を作る。要素は先頭から順に作られる。childrenは足りなくなるたびに倍の大きさに取り直す。
+    要素数が省略された配列は、要素を読み終えたらfix_array_lenで要素数を確定させる。 */
+static Initializer *new_array_element(Initializer *init, int i, int *cap){
+    if(i == *cap){
+        *cap = *cap ? *cap * 2 : 16;
+        Initializer **children = arena_alloc(&ctx -> init_arena, *cap * sizeof(Initializer*));
+        if(i)
+            memcpy(children, init -> children, i * sizeof(Initializer*));
+        init -> children = children;
+    }
+    init -> len = i + 1;
+    return init -> children[i] = new_initializer(init -> ty -> base, false);
+}
+
+static void fix_array_len(Initializer *init, int len){
+    init -> ty = array_of(init -> ty -> base, len);
+    init -> is_flexible = false;
+}
+
 // stirng-intizlier = string-literal
 static void string_initializer(Initializer *init){
     // 要素数が指定されていない場合修正
     if(init -> is_flexible)
-        *init = *new_initializer(array_of(ty_char, token -> ty -> array_len), false);
+        fix_array_len(init, ctx -> token -> ty -> array_len);
     
-    int len = MIN(init -> ty -> array_len, token -> ty -> array_len);
+    int len = MIN(init -> ty -> array_len, ctx -> token -> ty -> array_len);
     
-    for(int i = 0; i < len; i++){
-        init -> children[i] -> expr = new_num_node(token -> str[i]);
+    for(int i = 0, cap = 0; i < len; i++){
+        new_array_element(init, i, &cap) -> expr = new_num_node(ctx -> token -> data[i]);
     }
     next_token();
 }
 
-static int count_array_init_elements(Type *ty){
-    Token * tok = token; // tokenを保存しておく。(assing_initializerはtokenを変更してしますため)
-    Initializer *dummy = new_initializer(ty -> base, false);
-    int i = 0;
-
-    for(;!consume_end(); i++){
-        if(0 < i)
-            expect(",");
-        assign_initializer(dummy);
-    }
-    token = tok;
-    return i;
-}
-
 // array-initializer1 = "{" initializer ("," initizlier )* ","? }"
 static void array_initializer1(Initializer *init){
-    expect("{");
+    expect('{');
 
     if(init -> is_flexible){
-        int len = count_array_init_elements(init -> ty);
-        *init = *new_initializer(array_of(init -> ty -> base, len), false);
+        int i = 0, cap = 0;
+        for(; !consume_end(); i++){
+            if(0 < i)
+                expect(',');
+            assign_initializer(new_array_element(init, i, &cap));
+        }
+        fix_array_len(init, i);
+        return;
     }
 
-    for(int i = 0; !consume_end(); i++){
+    for(int i = 0, cap = 0; !consume_end(); i++){
         if(0 < i)
-            expect(",");
+            expect(',');
 
         if(i < init -> ty -> array_len)
-            assign_initializer(init -> children[i]);
+            assign_initializer(new_array_element(init, i, &cap));
         else 
             skip_excess_element();
     }
@@ -1266,26 +1308,31 @@ static void array_initializer1(Initializer *init){
 
 // array-initializer2 = initializer ("," initizlier )*
 static void array_initializer2(Initializer *init){
-
     if(init -> is_flexible){
-        int len = count_array_init_elements(init -> ty);
-        *init = *new_initializer(array_of(init -> ty -> base, len), false);
+        int i = 0, cap = 0;
+        for(; !is_end(); i++){
+            if(0 < i)
+                expect(',');
+            assign_initializer(new_array_element(init, i, &cap));
+        }
+        fix_array_len(init, i);
+        return;
     }
 
-    for(int i = 0; i < init -> ty -> array_len && !is_end(); i++){
+    for(int i = 0, cap = 0; i < init -> ty -> array_len && !is_end(); i++){
         if(0 < i)
-            expect(",");
-        assign_initializer(init -> children[i]);
+            expect(',');
+        assign_initializer(new_array_element(init, i, &cap));
     }
 }
 
 // struct-initializer1 = "{" initializer ("," initializer)* ","? "}"
 static void struct_initializer1(Initializer *init){
-    expect("{");
+    expect('{');
     Member *mem = init -> ty -> members;
     while(!consume_end()){
         if(mem != init -> ty -> members)
-            expect(",");
+            expect(',');
         
         if(mem){
             assign_initializer(init -> children[mem -> idx]);
@@ -1301,7 +1348,7 @@ static void struct_initializer2(Initializer *init){
     bool is_first = true;
     for(Member *mem = init -> ty -> members; mem && !is_end(); mem = mem -> next){
         if(!is_first)
-            expect(",");
+            expect(',');
         is_first = false;
         assign_initializer(init -> children[mem -> idx]);
     }
@@ -1309,10 +1356,10 @@ static void struct_initializer2(Initializer *init){
 
 // union-initializer = "{" initializer ","? "}" | initializer"
 static void union_initializer(Initializer *init){
-    if(consume("{")){
+    if(consume('{')){
         assign_initializer(init -> children[0]);
-        consume(",");
-        expect("}");
+        consume(',');
+        expect('}');
         return;
     }
     assign_initializer(init -> children[0]);
@@ -1323,13 +1370,13 @@ static void union_initializer(Initializer *init){
 //              | struct-initializer | union-initializer
 //              | assign
 static void assign_initializer(Initializer *init){
-    if(init -> ty -> kind == TY_ARRAY && token -> kind == TK_STR){
+    if(init -> ty -> kind == TY_ARRAY && ctx -> token -> kind == TK_STR){
         string_initializer(init);
         return;
     }
 
     if(init -> ty -> kind == TY_ARRAY){
-        if(is_equal(token, "{"))
+        if(is_equal(ctx -> token, '{'))
             array_initializer1(init);
         else 
             array_initializer2(init);
@@ -1337,20 +1384,20 @@ static void assign_initializer(Initializer *init){
     }
 
     if(init -> ty -> kind == TY_STRUCT){
-        if(is_equal(token, "{")){
+        if(is_equal(ctx -> token, '{')){
             struct_initializer1(init);
             return;
         }
 
-        if(!is_equal(token, "{")){
-            Token *tok = token;
+        if(!is_equal(ctx -> token, '{')){
+            Token *tok = ctx -> token;
             Node *expr = assign();
             add_type(expr);
             if(expr -> ty -> kind == TY_STRUCT){
                 init -> expr = expr;
                 return;
             }
-            token = tok;
+            ctx -> token = tok;
         }
 
         struct_initializer2(init); // {が省略された構造体の初期化式
@@ -1362,9 +1409,9 @@ static void assign_initializer(Initializer *init){
         return;
     }
 
-    if(consume("{")){
+    if(consume('{')){
         assign_initializer(init); // init -> expr = assign()じゃだめなのか?
-        expect("}");
+        expect('}');
         return;
     }
 
@@ -1387,7 +1434,8 @@ static Node *create_target(InitDesg *desg){
 static Node *create_lvar_init(Initializer *init, Type *ty, InitDesg *desg){
     if(ty -> kind == TY_ARRAY){
         Node *node = new_node(ND_NULL_EXPR);
-        for(int i = 0; i < ty -> array_len; i++){
+        // 残りの要素はND_MEMZEROで0になっている
+        for(int i = 0; i < init -> len; i++){
             InitDesg desg2 = {desg, i};
             Node *rhs = create_lvar_init(init -> children[i], ty -> base, &desg2);
             node = new_binary(ND_COMMA, node, rhs);
@@ -1424,7 +1472,7 @@ static Type *copy_struct_type(Type *ty){
     Member head = {};
     Member *cur = &head;
     for(Member *mem = ty -> members; mem; mem = mem -> next){
-        Member *m = calloc(1, sizeof(Member));
+        Member *m = arena_alloc(&ctx -> type_arena, sizeof(Member));
         *m = *mem;
         cur = cur -> next = m;
     }
@@ -1453,6 +1501,7 @@ static Initializer *initializer(Obj *var){
 }
 
 static Node *lvar_initializer(Obj *var){
+    ArenaMark mark = arena_mark(&ctx -> init_arena);
     Initializer *init = initializer(var);
 
     InitDesg desg = {NULL, 0, NULL, var};
@@ -1462,6 +1511,7 @@ static Node *lvar_initializer(Obj *var){
     lhs -> var = var;
     
     Node *rhs = create_lvar_init(init, var -> ty, &desg);
+    arena_reset(&ctx -> init_arena, mark); // Initializerはもう使わない
     return new_binary(ND_COMMA, lhs, rhs);
 }
 
@@ -1482,7 +1532,8 @@ static void write_buf(char *buf, int64_t val, int size){
 static Relocation *write_gvar_data(Relocation *cur, Initializer *init, Type *ty, char *buf, int offset){
     if(ty -> kind == TY_ARRAY){
         int size = ty -> base -> size;
-        for(int i = 0; i < ty -> array_len; i++)
+        // 残りの要素はbufが0で初期化されている
+        for(int i = 0; i < init -> len; i++)
             cur = write_gvar_data(cur, init -> children[i], ty -> base, buf, offset + size * i);
         return cur;
     }
@@ -1508,7 +1559,7 @@ static Relocation *write_gvar_data(Relocation *cur, Initializer *init, Type *ty,
         return cur;
     }
 
-    Relocation *rel = calloc(1, sizeof(Relocation));
+    Relocation *rel = arena_alloc(&ctx -> node_arena, sizeof(Relocation));
     rel -> offset = offset;
     rel -> label = label;
     rel -> addend = val;
@@ -1518,9 +1569,11 @@ static Relocation *write_gvar_data(Relocation *cur, Initializer *init, Type *ty,
 
 static void gvar_initialzier(Obj *var){
     Relocation head = {};
+    ArenaMark mark = arena_mark(&ctx -> init_arena);
     Initializer *init = initializer(var);
-    char *buf = calloc(1, var -> ty -> size);
+    char *buf = arena_alloc(&ctx -> node_arena, var -> ty -> size);
     write_gvar_data(&head, init, var -> ty, buf, 0);
+    arena_reset(&ctx -> init_arena, mark); // Initializerはもう使わない
     var -> init_data = buf;
     var -> rel = head.next;
 }
@@ -1600,13 +1653,21 @@ static int64_t eval(Node *node, char** label){
         case ND_CAST:{
             int64_t val = eval(node -> lhs, label);
             if(is_integer(node -> ty)){
+                /* 三項演算子だと共通型のuint32_tに揃って符号拡張されないのでifで分ける */
+                bool u = node -> ty -> is_unsigned;
                 switch(node -> ty -> size){
                     case 1:
-                        return node -> ty -> is_unsigned ? (uint8_t)val : (int8_t)val;
+                        if(u)
+                            return (uint8_t)val;
+                        return (int8_t)val;
                     case 2:
-                        return node -> ty -> is_unsigned ? (uint16_t)val :(int16_t)val;
+                        if(u)
+                            return (uint16_t)val;
+                        return (int16_t)val;
                     case 4:
-                        return node -> ty -> is_unsigned ? (uint32_t)val : (int32_t)val;
+                        if(u)
+                            return (uint32_t)val;
+                        return (int32_t)val;
                 }
             }
             return val;
@@ -1638,10 +1699,21 @@ static int64_t const_expr(void){
     return eval(node, NULL);
 }
 
+/* #ifの式を評価する。tokはTK_EOFで終わるリスト */
+int64_t eval_pp_expr(Token *tok){
+    Token *saved = ctx -> token;
+    ctx -> token = tok;
+    int64_t val = const_expr();
+    if(!at_eof())
+        error_at(ctx -> token -> str, "extra token in #if");
+    ctx -> token = saved;
+    return val;
+}
+
 /* expr = assign ("," expr)? */
 static Node* expr(void){
     Node *node = assign();
-    if(consume(","))
+    if(consume(','))
         node = new_binary(ND_COMMA, node, expr());
     return node;
 }
@@ -1664,40 +1736,53 @@ static Node *to_assign(Node *binary){
     assing-op = "+=" | "-=" | "*=" | "/=" | "%=" | "|=" | "^=" | "&=" | "<<=" | ">>=" | "=" */
 static Node* assign(void){
     Node* node = conditional();
-    if(consume("+="))
-        node = to_assign(new_add(node, assign()));
-    if(consume("-="))
-        node = to_assign(new_sub(node, assign()));
-    if(consume("*="))
-        node = to_assign(new_binary(ND_MUL, node, assign()));
-    if(consume("/="))
-        node = to_assign(new_binary(ND_DIV, node, assign()));
-    if(consume("%="))
-        node = to_assign(new_binary(ND_MOD, node, assign()));
-    if(consume("|="))
-        node = to_assign(new_binary(ND_BITOR, node, assign()));
-    if(consume("^="))
-        node = to_assign(new_binary(ND_BITXOR, node, assign()));
-    if(consume("&="))
-        node = to_assign(new_binary(ND_BITAND, node, assign()));
-    if(consume("<<="))
-        node = to_assign(new_binary(ND_SHL, node, assign()));
-    if(consume(">>="))
-        node = to_assign(new_binary(ND_SHR, node, assign()));
-    if(consume("="))
-        node = new_binary(ND_ASSIGN, node, assign());
+    switch(ctx -> token -> id){
+        case '=':
+            next_token();
+            return new_binary(ND_ASSIGN, node, assign());
+        case PUNCT_ADD_ASSIGN:
+            next_token();
+            return to_assign(new_add(node, assign()));
+        case PUNCT_SUB_ASSIGN:
+            next_token();
+            return to_assign(new_sub(node, assign()));
+        case PUNCT_MUL_ASSIGN:
+            next_token();
+            return to_assign(new_binary(ND_MUL, node, assign()));
+        case PUNCT_DIV_ASSIGN:
+            next_token();
+            return to_assign(new_binary(ND_DIV, node, assign()));
+        case PUNCT_MOD_ASSIGN:
+            next_token();
+            return to_assign(new_binary(ND_MOD, node, assign()));
+        case PUNCT_OR_ASSIGN:
+            next_token();
+            return to_assign(new_binary(ND_BITOR, node, assign()));
+        case PUNCT_XOR_ASSIGN:
+            next_token();
+            return to_assign(new_binary(ND_BITXOR, node, assign()));
+        case PUNCT_AND_ASSIGN:
+            next_token();
+            return to_assign(new_binary(ND_BITAND, node, assign()));
+        case PUNCT_SHL_ASSIGN:
+            next_token();
+            return to_assign(new_binary(ND_SHL, node, assign()));
+        case PUNCT_SHR_ASSIGN:
+            next_token();
+            return to_assign(new_binary(ND_SHR, node, assign()));
+    }
     return node;
 }
 
 /* conditional = logor ("?" expr ":" conditional)? */
 static Node *conditional(void){
     Node *cond = logor();
-    if(!consume("?"))
+    if(!consume('?'))
         return cond;
     Node *node = new_node(ND_COND);
     node -> cond = cond;
     node -> then = expr();
-    expect(":");
+    expect(':');
     node -> els = conditional();
     return node;
 }
@@ -1705,7 +1790,7 @@ static Node *conditional(void){
 /* logor = logand ("||" logand)* */
 static Node *logor(void){
     Node *node = logand();
-    while(consume("||"))
+    while(consume(PUNCT_LOGOR))
         node = new_binary(ND_LOGOR, node, logand());
     return node;
 }
@@ -1713,7 +1798,7 @@ static Node *logor(void){
 /* logand = bitor ("&&" bior)* */
 static Node *logand(void){
     Node *node = bitor();
-    while(consume("&&"))
+    while(consume(PUNCT_LOGAND))
         node = new_binary(ND_LOGAND, node, bitor());
     return node;
 }
@@ -1721,7 +1806,7 @@ static Node *logand(void){
 /* bitor = bitxor ("|" bitxor )* */ 
 static Node *bitor(void){
     Node *node = bitxor();
-    while(consume("|"))
+    while(consume('|'))
         node = new_binary(ND_BITOR, node, bitxor());
     return node;
 }
@@ -1729,7 +1814,7 @@ static Node *bitor(void){
 /* bitxor = bitand ("^" binand)* */
 static Node *bitxor(void){
     Node *node = bitand();
-    while(consume("^"))
+    while(consume('^'))
         node = new_binary(ND_BITXOR, node, bitand());
     return node;
 }
@@ -1737,7 +1822,7 @@ static Node *bitxor(void){
 /* bitand = equality ("&" equality)* */
 static Node *bitand(void){
     Node *node = equality();
-    while(consume("&"))
+    while(consume('&'))
         node = new_binary(ND_BITAND, node, equality());
     return node;
 }
@@ -1746,11 +1831,11 @@ static Node *bitand(void){
 static Node* equality(void){
     Node* np = relational();
     for(;;){
-        if(consume("==")){
+        if(consume(PUNCT_EQ)){
             np = new_binary(ND_EQ, np, relational());
             continue;
         }
-        if(consume("!=")){
+        if(consume(PUNCT_NE)){
             np = new_binary(ND_NE, np, relational()); 
             continue;
         }
@@ -1762,19 +1847,19 @@ static Node* equality(void){
 static Node* relational(void){
     Node* node = shift();
     for(;;){
-        if(consume("<")){
+        if(consume('<')){
             node = new_binary(ND_LT, node, shift());
             continue;
         }
-        if(consume("<=")){
+        if(consume(PUNCT_LE)){
             node = new_binary(ND_LE, node , shift());
             continue;
         }
-        if(consume(">")){
+        if(consume('>')){
             node = new_binary(ND_LT, shift(), node); /* x > y は y < xと同じ。 */
             continue;
         }
-        if(consume(">=")){
+        if(consume(PUNCT_GE)){
             node = new_binary(ND_LE, shift(), node); /* x >= y は y <= xと同じ */
             continue;
         }
@@ -1786,11 +1871,11 @@ static Node* relational(void){
 static Node *shift(void){
     Node *node = add();
     for(;;){
-        if(consume("<<")){
+        if(consume(PUNCT_SHL)){
             node = new_binary(ND_SHL, node, add());
             continue;
         }
-        if(consume(">>")){
+        if(consume(PUNCT_SHR)){
             node = new_binary(ND_SHR, node, add());
             continue;
         }
@@ -1849,11 +1934,11 @@ static Node* new_sub(Node *lhs, Node *rhs){
 static Node* add(void){
     Node* np = mul();
     for(;;){
-        if(consume("+")){
+        if(consume('+')){
             np = new_add(np, mul());
             continue;
         }
-        if(consume("-")){
+        if(consume('-')){
             np = new_sub(np, mul());
             continue;
         }
@@ -1865,15 +1950,15 @@ static Node* add(void){
 static Node* mul(void){
     Node* node = cast();
     for(;;){
-        if(consume("*")){
+        if(consume('*')){
             node = new_binary(ND_MUL, node, cast());
             continue;
         }
-        if(consume("/")){
+        if(consume('/')){
             node = new_binary(ND_DIV, node, cast());
             continue;
         }
-        if(consume("%")){
+        if(consume('%')){
             node = new_binary(ND_MOD, node, cast());
             continue;
         }
@@ -1885,21 +1970,21 @@ Node *new_cast(Node *lhs, Type *ty){
     add_type(lhs); // from 
     Node *node = new_node(ND_CAST);
     node -> lhs = lhs;
-    node -> ty = copy_type(ty); // to
+    node -> ty = ty; // to
     return node;
 }
 
 /* cast = ( typename ) cast | unary */
 static Node *cast(void){
-    if(is_equal(token, "(") && is_typename(token -> next)){
-        Token *tok = token;
-        consume("(");
+    if(is_equal(ctx -> token, '(') && is_typename(next_of(ctx -> token))){
+        Token *tok = ctx -> token;
+        consume('(');
         Type *ty = typename();
-        expect(")");
+        expect(')');
         
         // compound literal
-        if(is_equal(token , "{")){
-            token = tok;
+        if(is_equal(ctx -> token , '{')){
+            ctx -> token = tok;
             return unary();
         }
 
@@ -1913,32 +1998,32 @@ static Node *cast(void){
             | postfix */
 static Node* unary(void){
     /* +はそのまま */
-    if(consume("+")){
+    if(consume('+')){
         return cast();
     }
-    if(consume("-")){
+    if(consume('-')){
         return new_unary(ND_NEG, cast());
     }
-    if(consume("&")){
+    if(consume('&')){
         return new_unary(ND_ADDR, cast());
     }
-    if(consume("*")){
+    if(consume('*')){
         return new_unary(ND_DEREF, cast());
     }
-    if(consume("!"))
+    if(consume('!'))
         return new_unary(ND_NOT, cast());
-    if(consume("~"))
+    if(consume('~'))
         return new_unary(ND_BITNOT, cast());
-    if(consume("++"))
+    if(consume(PUNCT_INC))
         return to_assign(new_add(cast(), new_num_node(1)));
-    if(consume("--"))
+    if(consume(PUNCT_DEC))
         return to_assign(new_sub(cast(), new_num_node(1)));
     return postfix();
 }
 
 Member *get_struct_member(Type *ty, Token *name){
     for(Member *m = ty -> members; m; m = m -> next){
-        if(m -> name -> len == name -> len && !strncmp(m -> name -> str, name -> str, name -> len)){
+        if(m -> name == name -> name){
             return m;
         }
     }
@@ -1967,12 +2052,12 @@ static Node *new_inc_dec(Node *node, int64_t added){
             | primary ("[" expr "]" | "." ident | "->" ident | "++" | "--")* */
 static Node* postfix(void){
 
-    if(is_equal(token, "(") && is_typename(token -> next)){
-        expect("(");
+    if(is_equal(ctx -> token, '(') && is_typename(next_of(ctx -> token))){
+        expect('(');
         Type *ty = typename();
-        expect(")");
+        expect(')');
 
-        if(scope -> next == NULL){
+        if(ctx -> scope -> next == NULL){
             Obj *var = new_anon_gvar(ty);
             gvar_initialzier(var);
             return new_var_node(var);
@@ -1986,28 +2071,28 @@ static Node* postfix(void){
 
     Node *node = primary();
     for(;;){
-        if(consume("[")){
+        if(consume('[')){
             Node *idx = expr();
             node = new_unary(ND_DEREF, new_add(node, idx));
-            expect("]");
+            expect(']');
             continue;
         }
-        if(consume(".")){
-            node = struct_ref(node, token);
+        if(consume('.')){
+            node = struct_ref(node, ctx -> token);
             next_token();
             continue;
         }
-        if(consume("->")){
+        if(consume(PUNCT_ARROW)){
             node = new_unary(ND_DEREF, node);
-            node = struct_ref(node, token);
+            node = struct_ref(node, ctx -> token);
             next_token();
             continue;
         }
-        if(consume("++")){
+        if(consume(PUNCT_INC)){
             node = new_inc_dec(node, 1);
             continue;
         }
-        if(consume("--")){
+        if(consume(PUNCT_DEC)){
             node = new_inc_dec(node, -1);
             continue;
         }
@@ -2028,24 +2113,24 @@ static Node* postfix(void){
 static Node* primary(void){
     Node* np;
 
-    if(consume("(")){
-        if(consume("{")){
+    if(consume('(')){
+        if(consume('{')){
             np = new_node(ND_STMT_EXPR);
             np -> body = compound_stmt() -> body;
-            expect(")");
+            expect(')');
             return np; 
         }else{
             np = expr();
-            expect(")");
+            expect(')');
             return np;
         }
     }
 
-    if(consume("_Alignof")){
-        if(is_equal(token, "(") && is_typename(token -> next)){
-            expect("(");
+    if(consume(KW_ALIGNOF)){
+        if(is_equal(ctx -> token, '(') && is_typename(next_of(ctx -> token))){
+            expect('(');
             Type *ty = typename();
-            expect(")");
+            expect(')');
             return new_ulong(ty -> align);
         }
         Node *node = unary();
@@ -2054,12 +2139,12 @@ static Node* primary(void){
     }
 
     if(is_ident()){
-        if(is_equal(token -> next, "(")){
+        if(is_equal(next_of(ctx -> token), '(')){
             return funcall();
         }
-        VarScope *vsc = find_var(token);
+        VarScope *vsc = find_var(ctx -> token);
         if(!vsc || (!vsc -> var && !vsc -> enum_ty)){
-            error_at(token -> str, "undefined variable");
+            error_at(ctx -> token -> str, "undefined variable");
         }
         next_token();
         if(vsc -> var)
@@ -2069,15 +2154,15 @@ static Node* primary(void){
     }
 
     if(is_str()){
-        Obj * str = new_string_literal(token);
+        Obj * str = new_string_literal(ctx -> token);
         next_token();
         return new_var_node(str);
     }
-    if(consume("sizeof")){
-        if(is_equal(token, "(") && is_typename(token -> next)){
+    if(consume(KW_SIZEOF)){
+        if(is_equal(ctx -> token, '(') && is_typename(next_of(ctx -> token))){
             next_token(); // '('を読み飛ばす
             Type *ty = typename();
-            expect(")");
+            expect(')');
             return new_ulong(ty -> size);
         }else{
             Node *node = unary();
@@ -2086,25 +2171,25 @@ static Node* primary(void){
         }
     }
 
-    if(token -> kind == TK_NUM){
-        Node *node = new_num_node(token -> val);
-        node -> ty = token -> ty;
+    if(ctx -> token -> kind == TK_NUM){
+        Node *node = new_num_node(ctx -> token -> val);
+        node -> ty = ctx -> token -> ty;
         next_token();
         return node;
     }
 
-    error_at(token -> str, "expected an expression\n");
+    error_at(ctx -> token -> str, "expected an expression\n");
 }
 
 /* funcall = ident "(" func-args? ")" */
 static Node* funcall(void){
-    VarScope *vsc = find_var(token);
+    VarScope *vsc = find_var(ctx -> token);
     if(!vsc)
-        error_at(token -> str, "implicit declaration of a function");
+        error_at(ctx -> token -> str, "implicit declaration of a function");
     if (!vsc -> var || vsc -> var -> ty -> kind != TY_FUNC)
-        error_at(token -> str, "not a function");
+        error_at(ctx -> token -> str, "not a function");
     
-    char *func_name = get_ident(token);
+    char *func_name = get_ident(ctx -> token);
     Type *ty = vsc -> var -> ty;
 
     next_token();
@@ -2113,11 +2198,11 @@ static Node* funcall(void){
     Node head = {};
     Node *cur = &head;
     Type *param_ty = ty -> params;
-    expect("(");
+    expect('(');
     /* 例えばf(1,2,3)の場合、リストは3->2->1のようにする。これはコード生成を簡単にするため。 */
-    while(!consume(")")){
+    while(!consume(')')){
         if(cur != &head)
-            expect(",");
+            expect(',');
     
         Node *arg = assign();
         add_type(arg);
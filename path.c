@@ -0,0 +1,19 @@
+#define _GNU_SOURCE // asprintfのため
+#include "9cc.h"
+
+/* 9ccと9cc-clientで共有する。9cc-clientはコンパイラ本体をリンクしないので、このファイルだけをリンクする */
+
+/* dir/foo.ext、dirがNULLなら入力と同じディレクトリのfoo.ext。mallocした領域を返す */
+char *output_path(char *input, char *dir, char *ext){
+    char *base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    char *dot = strrchr(base, '.');
+    int stem = dot && dot != base ? dot - base : strlen(base);
+
+    char *buf;
+    if(dir)
+        asprintf(&buf, "%s/%.*s.%s", dir, stem, base, ext);
+    else
+        asprintf(&buf, "%.*s.%s", (int)(base - input) + stem, input, ext);
+    return buf;
+}
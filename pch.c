@@ -0,0 +1,694 @@
+#define _GNU_SOURCE // st_mtimのため
+#include "9cc.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*  プリコンパイルしたヘッダ。9cc --emit-pch header.hはヘッダを最後までパースした時点のファイルスコープ
+    (変数、typedef、enumの定数、構造体のタグ)とそこから指されるObj, Type, Member, 定義されているマクロ、
+    include guardを一つのファイル(イメージ)に書く。--include-pchはコンパイルの最初にイメージをmmapし、
+    ヘッダを先にincludeしたのと同じ状態からパースを始める。
+    イメージの中のポインタはファイルの先頭からのオフセットで書き、その位置の表を付けておく。
+    読むときはmmapしたアドレスを足すだけで、オブジェクトは作り直さない。ty_intなどは番号で書いて今のアドレスに置き換える。
+    ハッシュ表はアドレスをキーにしているので、エントリを配列で書いて読むときに作り直す。
+    関数の本体(Node)は書けないので、ヘッダに関数の定義があればエラーにする。
+    イメージを書いたコンパイラと読んだファイルの大きさと更新時刻を入れておき、変わっていたらエラーにする。
+    --serverでは再配置したイメージを残しておき、同じイメージを使う要求の間で読み取り専用で共有する。
+    イメージは別のディレクトリから別の綴りで使われることもあるので、ファイルのパスは絶対パスにして書く。 */
+
+#define PCH_MAGIC "9cc-pch1"
+
+/* イメージを作るときに読んだファイル */
+typedef struct{
+    char *path; // 絶対パス
+    int64_t size;
+    int64_t mtime[2];
+}PchDep;
+
+/* 名前をキーにしたハッシュ表のエントリ */
+typedef struct{
+    char *name;
+    void *val;
+}PchEntry;
+
+/* イメージの先頭 */
+struct PchImage{
+    char magic[8];
+    int64_t exe_size; // 書いたコンパイラの実行ファイル。構造体の配置が同じであることを確かめる
+    int64_t exe_mtime[2];
+    uint64_t size; // イメージ全体の大きさ
+    uint64_t relocs; // 先頭のアドレスを足すポインタの位置(uint32_t)の表
+    uint64_t nrelocs;
+    uint64_t builtins; // ty_intなどを指すポインタの位置と型の番号(uint32_tの組)の表
+    uint64_t nbuiltins;
+    uint64_t atoms; // internした名前のオフセット(uint32_t)のハッシュ表。0は空き
+    uint64_t atoms_cap; // 2の冪
+
+    /* ここから下のポインタは再配置する */
+    char *header; // --emit-pchに渡したヘッダ
+    PchDep *deps;
+    int ndeps;
+    VarScope **vars; // ファイルスコープの名前
+    int nvars;
+    int ntags;
+    PchEntry *tags; // ファイルスコープの構造体のタグ -> Type
+    Obj *globals;
+    Macro **macros;
+    int nmacros;
+    int nfile_info;
+    PchEntry *file_info; // includeしたファイルの絶対パス -> FileInfo。読むときにデバイスとinode番号をキーにして入れ直す
+    Type **shared_types; // pointer_toとarray_ofの表に入っている型
+    int nshared_types;
+    int unique_idx;
+    bool keyword_macros;
+};
+
+static Type **builtin_types[] = {
+    &ty_long, &ty_int, &ty_short, &ty_char, &ty_void, &ty_bool, &ty_uchar, &ty_ushort, &ty_uint, &ty_ulong,
+};
+
+typedef struct{
+    Buffer *buf; // イメージ。ctx -> outに直接書く
+    HashMap done; // 書いたオブジェクトのアドレス -> オフセット
+    HashMap atom_done; // atomsに入れた名前
+    Buffer atoms; // internした名前のオフセット(size_t)の並び
+    Buffer relocs;
+    Buffer builtins;
+}Writer;
+
+#define AT(w, off) ((w) -> buf -> data + (off))
+
+/* 0で埋めたsizeバイトをalignに揃えて確保し、そのオフセットを返す */
+static size_t reserve(Writer *w, size_t size, size_t align){
+    Buffer *buf = w -> buf;
+    size_t off = (buf -> len + align - 1) / align * align;
+    size_t end = off + size;
+    if(end > buf -> cap){
+        buf -> cap = MAX(buf -> cap * 2, end);
+        buf -> data = realloc(buf -> data, buf -> cap);
+    }
+    memset(buf -> data + buf -> len, 0, end - buf -> len);
+    buf -> len = end;
+    return off;
+}
+
+/* slotのポインタにtargetのオフセットを書く。0ならNULL */
+static void set_ptr(Writer *w, size_t slot, size_t target){
+    uint64_t val = target;
+    memcpy(AT(w, slot), &val, sizeof(val));
+    if(target){
+        uint32_t pos = slot;
+        buf_append(&w -> relocs, (char *)&pos, sizeof(pos));
+    }
+}
+
+static size_t find_done(Writer *w, void *p){
+    return (uintptr_t)hashmap_get_ptr(&w -> done, p);
+}
+
+/* オブジェクトをそのままコピーする。ポインタのフィールドは呼び出し側で書き直すこと */
+static size_t put_copy(Writer *w, void *p, size_t size){
+    size_t off = reserve(w, size, 8);
+    memcpy(AT(w, off), p, size);
+    hashmap_put_ptr(&w -> done, p, (void *)(uintptr_t)off);
+    return off;
+}
+
+static size_t put_bytes(Writer *w, char *p, size_t len){
+    size_t off = reserve(w, len + 1, 1);
+    memcpy(AT(w, off), p, len);
+    return off;
+}
+
+static size_t put_string(Writer *w, char *s){
+    if(!s)
+        return 0;
+    size_t off = find_done(w, s);
+    if(!off){
+        off = put_bytes(w, s, strlen(s));
+        hashmap_put_ptr(&w -> done, s, (void *)(uintptr_t)off);
+    }
+    return off;
+}
+
+/* internした名前。読むときにinternし直すので覚えておく */
+static size_t put_atom(Writer *w, char *name){
+    size_t off = put_string(w, name);
+    if(off && !hashmap_get_ptr(&w -> atom_done, name)){
+        hashmap_put_ptr(&w -> atom_done, name, name);
+        buf_append(&w -> atoms, (char *)&off, sizeof(off));
+    }
+    return off;
+}
+
+static size_t put_type(Writer *w, Type *ty);
+
+/* 型へのポインタ。ty_intなどは番号で書く */
+static void ref_type(Writer *w, size_t slot, Type *ty){
+    if(!ty || !is_builtin(ty)){
+        set_ptr(w, slot, put_type(w, ty));
+        return;
+    }
+    for(uint32_t i = 0;; i++){
+        if(*builtin_types[i] == ty){
+            uint32_t ent[2] = {slot, i};
+            buf_append(&w -> builtins, (char *)ent, sizeof(ent));
+            set_ptr(w, slot, 0);
+            return;
+        }
+    }
+}
+
+/* listならnextをたどってマクロの本体のリストを書く。型の名前などは一つだけ */
+static size_t put_token(Writer *w, Token *tok, bool list){
+    size_t head = 0, slot = 0;
+    for(; tok; tok = list ? tok -> next : NULL){
+        size_t off = find_done(w, tok);
+        bool done = off != 0;
+        if(!done){
+            off = put_copy(w, tok, sizeof(Token));
+            ((Token *)AT(w, off)) -> round = 0;
+            ref_type(w, off + offsetof(Token, ty), tok -> ty);
+            set_ptr(w, off + offsetof(Token, str), put_bytes(w, tok -> str, tok -> len)); // ##と#のために綴りが要る
+            size_t name = 0;
+            if(tok -> kind == TK_IDENT || tok -> kind == TK_PP_END)
+                name = put_atom(w, tok -> name);
+            else if(tok -> kind == TK_STR)
+                name = put_bytes(w, tok -> data, tok -> ty -> size);
+            set_ptr(w, off + offsetof(Token, name), name);
+        }
+        if(slot)
+            set_ptr(w, slot, off);
+        else
+            head = off;
+        if(done)
+            return head;
+        slot = off + offsetof(Token, next);
+    }
+    if(slot)
+        set_ptr(w, slot, 0);
+    return head;
+}
+
+static size_t put_member(Writer *w, Member *mem){
+    if(!mem)
+        return 0;
+    size_t off = find_done(w, mem);
+    if(off)
+        return off;
+    off = put_copy(w, mem, sizeof(Member));
+    ref_type(w, off + offsetof(Member, ty), mem -> ty);
+    set_ptr(w, off + offsetof(Member, name), put_atom(w, mem -> name));
+    set_ptr(w, off + offsetof(Member, next), put_member(w, mem -> next));
+    return off;
+}
+
+static size_t put_type(Writer *w, Type *ty){
+    if(!ty)
+        return 0;
+    size_t off = find_done(w, ty);
+    if(off)
+        return off;
+    off = put_copy(w, ty, sizeof(Type));
+    ref_type(w, off + offsetof(Type, base), ty -> base);
+    set_ptr(w, off + offsetof(Type, name), put_token(w, ty -> name, false));
+    set_ptr(w, off + offsetof(Type, name_pos), put_token(w, ty -> name_pos, false));
+    ref_type(w, off + offsetof(Type, next), ty -> next);
+    if(ty -> kind == TY_STRUCT || ty -> kind == TY_UNION)
+        set_ptr(w, off + offsetof(Type, members), put_member(w, ty -> members));
+    if(ty -> kind == TY_FUNC){
+        ref_type(w, off + offsetof(Type, ret_ty), ty -> ret_ty);
+        ref_type(w, off + offsetof(Type, params), ty -> params);
+    }
+    return off;
+}
+
+static size_t put_relocation(Writer *w, Relocation *rel){
+    size_t head = 0, slot = 0;
+    for(; rel; rel = rel -> next){
+        size_t off = reserve(w, sizeof(Relocation), 8);
+        memcpy(AT(w, off), rel, sizeof(Relocation));
+        set_ptr(w, off + offsetof(Relocation, label), put_string(w, rel -> label));
+        if(slot)
+            set_ptr(w, slot, off);
+        else
+            head = off;
+        slot = off + offsetof(Relocation, next);
+    }
+    if(slot)
+        set_ptr(w, slot, 0);
+    return head;
+}
+
+/* nextをたどってglobalsのリストを書く。数千になるので再帰しない */
+static size_t put_obj(Writer *w, Obj *var){
+    size_t head = 0, slot = 0;
+    for(; var; var = var -> next){
+        size_t off = find_done(w, var);
+        bool done = off != 0;
+        if(!done){
+            if(var -> body)
+                error("%s: cannot precompile the definition of function %s", ctx -> path, var -> name);
+            off = put_copy(w, var, sizeof(Obj));
+            ref_type(w, off + offsetof(Obj, ty), var -> ty);
+            set_ptr(w, off + offsetof(Obj, name), put_string(w, var -> name));
+            set_ptr(w, off + offsetof(Obj, init_data), var -> init_data ? put_bytes(w, var -> init_data, var -> ty -> size) : 0);
+            set_ptr(w, off + offsetof(Obj, rel), put_relocation(w, var -> rel));
+        }
+        if(slot)
+            set_ptr(w, slot, off);
+        else
+            head = off;
+        if(done)
+            return head;
+        slot = off + offsetof(Obj, next);
+    }
+    if(slot)
+        set_ptr(w, slot, 0);
+    return head;
+}
+
+static size_t put_var_scope(Writer *w, VarScope *vsc){
+    size_t off = put_copy(w, vsc, sizeof(VarScope));
+    set_ptr(w, off + offsetof(VarScope, name), put_atom(w, vsc -> name));
+    set_ptr(w, off + offsetof(VarScope, var), put_obj(w, vsc -> var));
+    ref_type(w, off + offsetof(VarScope, type_def), vsc -> type_def);
+    ref_type(w, off + offsetof(VarScope, enum_ty), vsc -> enum_ty);
+    return off;
+}
+
+static size_t put_macro(Writer *w, Macro *m){
+    size_t off = put_copy(w, m, sizeof(Macro));
+    set_ptr(w, off + offsetof(Macro, name), put_atom(w, m -> name));
+    size_t params = m -> nparams ? reserve(w, m -> nparams * sizeof(char *), 8) : 0;
+    for(int i = 0; i < m -> nparams; i++)
+        set_ptr(w, params + i * sizeof(char *), put_atom(w, m -> params[i]));
+    set_ptr(w, off + offsetof(Macro, params), params);
+    set_ptr(w, off + offsetof(Macro, body), put_token(w, m -> body, true));
+    return off;
+}
+
+/* dir_fdからの相対パスを絶対パスにする。mallocした領域を返す */
+static char *absolute_path(char *path){
+    char buf[PATH_MAX];
+    char *p = path;
+    if(path[0] != '/' && ctx -> opts -> dir_fd != AT_FDCWD){
+        snprintf(buf, sizeof(buf), "/proc/self/fd/%d/%s", ctx -> opts -> dir_fd, path);
+        p = buf;
+    }
+    char *abs = realpath(p, NULL);
+    if(!abs)
+        error("%s: %s", path, strerror(errno));
+    return abs;
+}
+
+/* 絶対パスにしてイメージに書く */
+static size_t put_path(Writer *w, char *path){
+    char *abs = absolute_path(path);
+    size_t off = put_bytes(w, abs, strlen(abs)); // put_stringはアドレスで覚えるので、すぐ解放するものには使わない
+    free(abs);
+    return off;
+}
+
+/* file_infoのslot番目のエントリ。名前とinfo -> pathは同じ絶対パスにする */
+static void put_file_info(Writer *w, size_t slot, FileInfo *info){
+    size_t path = put_path(w, info -> path);
+    size_t off = put_copy(w, info, sizeof(FileInfo));
+    set_ptr(w, off + offsetof(FileInfo, path), path);
+    set_ptr(w, off + offsetof(FileInfo, guard), put_atom(w, info -> guard));
+    set_ptr(w, slot + offsetof(PchEntry, name), path);
+    set_ptr(w, slot + offsetof(PchEntry, val), off);
+}
+
+static void put_dep(Writer *w, size_t off, char *path){
+    struct stat st = {};
+    if(fstatat(ctx -> opts -> dir_fd, path, &st, 0) == -1)
+        error("%s: %s", path, strerror(errno));
+    PchDep *dep = (PchDep *)AT(w, off);
+    dep -> size = st.st_size;
+    dep -> mtime[0] = st.st_mtim.tv_sec;
+    dep -> mtime[1] = st.st_mtim.tv_nsec;
+    set_ptr(w, off + offsetof(PchDep, path), put_path(w, path));
+}
+
+/* ポインタの配列を確保して、slotにそのオフセットを書く */
+static size_t put_array(Writer *w, size_t slot, int n, size_t size){
+    size_t off = n ? reserve(w, n * size, 8) : 0;
+    set_ptr(w, slot, off);
+    return off;
+}
+
+#define FIELD(field) (offsetof(PchImage, field))
+#define SET_COUNT(w, field, n) (((PchImage *)AT(w, 0)) -> field = (n))
+
+/* パースし終えたファイルスコープをイメージにしてctx -> outに書く。parseがファイルスコープを抜ける前に呼ぶ */
+void pch_save(void){
+    Writer w = {.buf = &ctx -> out};
+    reserve(&w, sizeof(PchImage), 8);
+    Scope *sc = ctx -> scope;
+
+    /* VarScopeのvarが先にnextをたどらないように、globalsのリストから書く */
+    set_ptr(&w, FIELD(globals), put_obj(&w, ctx -> globals));
+    SET_COUNT(&w, unique_idx, ctx -> unique_idx);
+
+    size_t vars = put_array(&w, FIELD(vars), sc -> vars.used, sizeof(VarScope *));
+    int n = 0;
+    for(int i = 0; i < sc -> vars.capacity; i++)
+        if(sc -> vars.buckets[i].key)
+            set_ptr(&w, vars + n++ * sizeof(VarScope *), put_var_scope(&w, sc -> vars.buckets[i].val));
+    SET_COUNT(&w, nvars, n);
+
+    size_t tags = put_array(&w, FIELD(tags), sc -> tags.used, sizeof(PchEntry));
+    n = 0;
+    for(int i = 0; i < sc -> tags.capacity; i++){
+        HashEntry *ent = &sc -> tags.buckets[i];
+        if(!ent -> key)
+            continue;
+        set_ptr(&w, tags + n * sizeof(PchEntry) + offsetof(PchEntry, name), put_atom(&w, ent -> key));
+        ref_type(&w, tags + n++ * sizeof(PchEntry) + offsetof(PchEntry, val), ent -> val);
+    }
+    SET_COUNT(&w, ntags, n);
+
+    /* #undefしたマクロ(値がNULL)と、__FILE__などinit_preprocessorが作るものは書かない */
+    size_t macros = put_array(&w, FIELD(macros), ctx -> macros.used, sizeof(Macro *));
+    n = 0;
+    for(int i = 0; i < ctx -> macros.capacity; i++){
+        Macro *m = ctx -> macros.buckets[i].val;
+        if(ctx -> macros.buckets[i].key && m && !m -> handler)
+            set_ptr(&w, macros + n++ * sizeof(Macro *), put_macro(&w, m));
+    }
+    SET_COUNT(&w, nmacros, n);
+    SET_COUNT(&w, keyword_macros, ctx -> keyword_macros);
+
+    /* ヘッダ自身は#pragma onceと同じ扱いにして、もう一度includeされても読まない */
+    size_t info = put_array(&w, FIELD(file_info), ctx -> file_info.used + 1, sizeof(PchEntry));
+    n = 0;
+    for(int i = 0; i < ctx -> file_info.capacity; i++){
+        FileInfo *fi = ctx -> file_info.buckets[i].val;
+        if(!ctx -> file_info.buckets[i].key || fi -> path[0] == '<' || !strcmp(fi -> path, ctx -> path))
+            continue; // <built-in>
+        put_file_info(&w, info + n++ * sizeof(PchEntry), fi);
+    }
+    if(strcmp(ctx -> path, "-"))
+        put_file_info(&w, info + n++ * sizeof(PchEntry), &(FileInfo){ctx -> path, .once = true});
+    SET_COUNT(&w, nfile_info, n);
+
+    /* 書いた型のうち、pointer_toとarray_ofの表に入っているもの */
+    size_t shared = put_array(&w, FIELD(shared_types), ctx -> type_table.used, sizeof(Type *));
+    n = 0;
+    for(int i = 0; i < ctx -> type_table.capacity; i++){
+        Type *ty = ctx -> type_table.buckets[i].val;
+        if(ctx -> type_table.buckets[i].key && find_done(&w, ty))
+            set_ptr(&w, shared + n++ * sizeof(Type *), find_done(&w, ty));
+    }
+    SET_COUNT(&w, nshared_types, n);
+
+    /* 読んだファイル。--include-pchで読んだイメージを使っていれば、そのイメージと、それが読んだファイルも */
+    int ndeps = strcmp(ctx -> path, "-") != 0;
+    for(File *file = ctx -> files; file; file = file -> next)
+        ndeps += file -> name[0] != '<';
+    if(ctx -> pch)
+        ndeps += ctx -> pch -> ndeps + 1;
+    size_t deps = put_array(&w, FIELD(deps), ndeps, sizeof(PchDep));
+    n = 0;
+    if(strcmp(ctx -> path, "-"))
+        put_dep(&w, deps + n++ * sizeof(PchDep), ctx -> path);
+    for(File *file = ctx -> files; file; file = file -> next)
+        if(file -> name[0] != '<')
+            put_dep(&w, deps + n++ * sizeof(PchDep), file -> name);
+    if(ctx -> pch){
+        put_dep(&w, deps + n++ * sizeof(PchDep), ctx -> opts -> include_pch);
+        for(int i = 0; i < ctx -> pch -> ndeps; i++)
+            put_dep(&w, deps + n++ * sizeof(PchDep), ctx -> pch -> deps[i].path);
+    }
+    SET_COUNT(&w, ndeps, n);
+    set_ptr(&w, FIELD(header), put_string(&w, ctx -> path));
+
+    /*  名前はここまでに全部出てくる。読むときに全部をinternし直すと名前の数に比例して時間がかかるので、
+        internと同じハッシュ値で引ける表にしておき、internが見つからなかった時に引く */
+    int natoms = w.atoms.len / sizeof(size_t);
+    size_t cap = 16;
+    while(cap < natoms * 2)
+        cap *= 2;
+    size_t atoms = reserve(&w, cap * sizeof(uint32_t), 4);
+    for(int i = 0; i < natoms; i++){
+        size_t off = ((size_t *)w.atoms.data)[i];
+        char *name = AT(&w, off);
+        uint32_t *table = (uint32_t *)AT(&w, atoms);
+        size_t j = fnv_hash(name, strlen(name)) & (cap - 1);
+        while(table[j])
+            j = (j + 1) & (cap - 1);
+        table[j] = off;
+    }
+
+    /* 再配置の表は最後。これより後にset_ptrしないこと */
+    size_t relocs = reserve(&w, w.relocs.len, 4);
+    memcpy(AT(&w, relocs), w.relocs.data, w.relocs.len);
+    size_t builtins = reserve(&w, w.builtins.len, 4);
+    memcpy(AT(&w, builtins), w.builtins.data, w.builtins.len);
+
+    struct stat exe = {};
+    stat("/proc/self/exe", &exe);
+    PchImage *img = (PchImage *)AT(&w, 0);
+    memcpy(img -> magic, PCH_MAGIC, sizeof(img -> magic));
+    img -> exe_size = exe.st_size;
+    img -> exe_mtime[0] = exe.st_mtim.tv_sec;
+    img -> exe_mtime[1] = exe.st_mtim.tv_nsec;
+    img -> size = w.buf -> len;
+    img -> relocs = relocs;
+    img -> nrelocs = w.relocs.len / sizeof(uint32_t);
+    img -> builtins = builtins;
+    img -> nbuiltins = w.builtins.len / (2 * sizeof(uint32_t));
+    img -> atoms = atoms;
+    img -> atoms_cap = cap;
+
+    hashmap_free(&w.done);
+    hashmap_free(&w.atom_done);
+    free(w.atoms.data);
+    free(w.relocs.data);
+    free(w.builtins.data);
+}
+
+/* 読んだファイルがイメージを作った時から変わっていないか */
+static void check_deps(char *path, PchImage *img){
+    for(int i = 0; i < img -> ndeps; i++){
+        PchDep *dep = &img -> deps[i];
+        struct stat st;
+        if(fstatat(ctx -> opts -> dir_fd, dep -> path, &st, 0) == -1 || st.st_size != dep -> size ||
+           st.st_mtim.tv_sec != dep -> mtime[0] || st.st_mtim.tv_nsec != dep -> mtime[1])
+            error("%s: %s has been modified since the precompiled header was built", path, dep -> path);
+    }
+}
+
+/*  fdのイメージをmmapして確かめ、再配置してctx -> pchに置く。fdは閉じる。
+    エラーになってもreleaseでmunmapされるように、mmapしたらすぐにctx -> pchに入れる */
+static void map_image(char *path, int fd, size_t size){
+    if(size < sizeof(PchImage)){
+        close(fd);
+        error("%s: not a precompiled header", path);
+    }
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0); // ほぼ全てのページを再配置で書き換える
+    close(fd);
+    if(base == MAP_FAILED)
+        error("%s: mmap: %s", path, strerror(errno));
+    PchImage *img = ctx -> pch = (PchImage *)base;
+    ctx -> pch_len = size;
+
+    struct stat exe = {};
+    stat("/proc/self/exe", &exe);
+    if(memcmp(img -> magic, PCH_MAGIC, sizeof(img -> magic)) || img -> size != size ||
+       img -> relocs + img -> nrelocs * sizeof(uint32_t) > img -> size ||
+       img -> builtins + img -> nbuiltins * 2 * sizeof(uint32_t) > img -> size ||
+       (img -> atoms_cap & (img -> atoms_cap - 1)) || img -> atoms + img -> atoms_cap * sizeof(uint32_t) > img -> size)
+        error("%s: not a precompiled header", path);
+    if(img -> exe_size != exe.st_size || img -> exe_mtime[0] != exe.st_mtim.tv_sec || img -> exe_mtime[1] != exe.st_mtim.tv_nsec)
+        error("%s: precompiled header was built by a different compiler", path);
+
+    uint32_t *relocs = (uint32_t *)(base + img -> relocs);
+    for(uint64_t i = 0; i < img -> nrelocs; i++){
+        if(relocs[i] > img -> size - sizeof(uintptr_t))
+            error("%s: broken precompiled header", path);
+        *(uintptr_t *)(base + relocs[i]) += (uintptr_t)base;
+    }
+    uint32_t *builtins = (uint32_t *)(base + img -> builtins);
+    int nbuiltin_types = sizeof(builtin_types) / sizeof(*builtin_types);
+    for(uint64_t i = 0; i < img -> nbuiltins; i++){
+        if(builtins[i * 2] > img -> size - sizeof(Type *) || builtins[i * 2 + 1] >= nbuiltin_types)
+            error("%s: broken precompiled header", path);
+        *(Type **)(base + builtins[i * 2]) = *builtin_types[builtins[i * 2 + 1]];
+    }
+}
+
+/*  --serverで読んだイメージ。再配置したものを残しておき、同じファイルを使う要求はそれを読み取り専用で共有する。
+    コンパイルが書き換えるもの(マクロのbusy、FileInfo、宣言子の名前を書き込む型)はuse_imageとparseがコピーしてから使う。
+    ヘッダで不完全だった構造体を完成させる場合だけは型をその場で書き換えるしかないので、pch_unshareで自分用に読み直す。 */
+struct SharedImage{
+    SharedImage *next;
+    char *path; // 絶対パス
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    PchImage *img;
+    int refs; // 使っているコンパイルの数
+    bool stale; // ファイルが書き換えられた。使い終わったら解放する
+};
+
+bool pch_share_images;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static SharedImage *shared_images;
+
+static bool same_file(SharedImage *si, struct stat *st){
+    return si -> dev == st -> st_dev && si -> ino == st -> st_ino && si -> size == st -> st_size &&
+           si -> mtime.tv_sec == st -> st_mtim.tv_sec && si -> mtime.tv_nsec == st -> st_mtim.tv_nsec;
+}
+
+/* 解放する。shared_lockを持って呼ぶ */
+static void drop_shared(SharedImage *si){
+    for(SharedImage **p = &shared_images; *p; p = &(*p) -> next){
+        if(*p == si){
+            *p = si -> next;
+            break;
+        }
+    }
+    munmap(si -> img, si -> img -> size);
+    free(si -> path);
+    free(si);
+}
+
+/* fdのイメージを共有しているものから探し、なければ読んで加える。fdは閉じる */
+static SharedImage *get_shared(char *path, int fd, struct stat *st){
+    pthread_mutex_lock(&shared_lock);
+    SharedImage *si = shared_images;
+    while(si && (si -> stale || !same_file(si, st)))
+        si = si -> next;
+    if(si)
+        si -> refs++;
+    pthread_mutex_unlock(&shared_lock);
+    if(si){
+        close(fd);
+        return si;
+    }
+
+    // errorはロックを持ったまま戻らないように、読むのはロックの外で
+    map_image(path, fd, st -> st_size);
+    char *abs = absolute_path(path);
+    mprotect(ctx -> pch, ctx -> pch_len, PROT_READ); // 書き換えてしまう場所が残っていれば、他の要求を壊す前に落ちる
+    si = calloc(1, sizeof(SharedImage));
+    *si = (SharedImage){
+        .path = abs, .dev = st -> st_dev, .ino = st -> st_ino, .size = st -> st_size, .mtime = st -> st_mtim, .img = ctx -> pch, .refs = 1,
+    };
+    ctx -> pch = NULL;
+
+    // 同じファイルの古いイメージは、使っているコンパイルがなくなったら解放する
+    pthread_mutex_lock(&shared_lock);
+    for(SharedImage *old = shared_images, *next; old; old = next){
+        next = old -> next;
+        if((old -> dev == si -> dev && old -> ino == si -> ino) || !strcmp(old -> path, si -> path)){
+            old -> stale = true;
+            if(!old -> refs)
+                drop_shared(old);
+        }
+    }
+    si -> next = shared_images;
+    shared_images = si;
+    pthread_mutex_unlock(&shared_lock);
+    return si;
+}
+
+/*  マクロ、include guard、型の表、globalsをctxに入れる。ファイルスコープの名前はparseがpch_restore_scopeで入れる。
+    マクロとFileInfoはコンパイル中に書き換えるので、イメージのものではなくコピーを入れる。 */
+static void use_image(char *path, PchImage *img){
+    ctx -> pch = img;
+    check_deps(path, img);
+
+    for(int i = 0; i < img -> nmacros; i++){
+        Macro *m = arena_alloc(&ctx -> token_arena, sizeof(Macro));
+        *m = *img -> macros[i];
+        register_macro(m);
+    }
+    ctx -> keyword_macros = img -> keyword_macros;
+    for(int i = 0; i < img -> nfile_info; i++){
+        FileInfo *info = arena_alloc(&ctx -> token_arena, sizeof(FileInfo));
+        *info = *(FileInfo *)img -> file_info[i].val;
+        register_file_info(img -> file_info[i].name, info);
+    }
+    for(int i = 0; i < img -> nshared_types; i++)
+        share_type(img -> shared_types[i]);
+    ctx -> globals = img -> globals;
+    ctx -> unique_idx = img -> unique_idx;
+}
+
+/*  --include-pch。字句解析を始める前に呼ぶ。イメージはmmapして再配置し、そのままこのコンパイルのオブジェクトとして使う。
+    pch_share_imagesなら他のコンパイルと共有しているものを使う。 */
+void pch_load(char *path){
+    int fd = openat(ctx -> opts -> dir_fd, path, O_RDONLY);
+    if(fd == -1)
+        error("cannot open %s: %s", path, strerror(errno));
+    struct stat st;
+    if(fstat(fd, &st) == -1){
+        close(fd);
+        error("%s: fstat: %s", path, strerror(errno));
+    }
+
+    if(pch_share_images && !ctx -> pch_private){
+        ctx -> pch_shared = get_shared(path, fd, &st);
+        use_image(path, ctx -> pch_shared -> img);
+        return;
+    }
+    map_image(path, fd, st.st_size);
+    use_image(path, ctx -> pch);
+}
+
+/* pがこのコンパイルが他と共有しているイメージの中にあるか。あれば書き換えてはいけない */
+bool pch_is_shared(void *p){
+    PchImage *img = ctx -> pch;
+    return ctx -> pch_shared && (char *)img <= (char *)p && (char *)p < (char *)img + img -> size;
+}
+
+/* 共有しているイメージの中のオブジェクトを書き換える必要があった。自分用にイメージを読み直してコンパイルをやり直す */
+noreturn void pch_unshare(void){
+    ctx -> pch_private = true;
+    longjmp(ctx -> jmp, 1);
+}
+
+/* releaseから呼ぶ */
+void free_pch(void){
+    SharedImage *si = ctx -> pch_shared;
+    if(si){
+        pthread_mutex_lock(&shared_lock);
+        if(--si -> refs == 0 && si -> stale)
+            drop_shared(si);
+        pthread_mutex_unlock(&shared_lock);
+    }else if(ctx -> pch){
+        munmap(ctx -> pch, ctx -> pch_len);
+    }
+    ctx -> pch = NULL;
+    ctx -> pch_shared = NULL;
+}
+
+/* イメージの中の名前。hashはfnv_hash(s, len)。internから呼ぶ。イメージは書き換えないので並列の字句解析のタスクから呼んでもよい */
+char *pch_find_atom(char *s, int len, uint64_t hash){
+    PchImage *img = ctx -> pch;
+    char *base = (char *)img;
+    uint32_t *table = (uint32_t *)(base + img -> atoms);
+    for(size_t i = hash & (img -> atoms_cap - 1); table[i]; i = (i + 1) & (img -> atoms_cap - 1)){
+        char *atom = base + table[i];
+        if(!strncmp(atom, s, len) && atom[len] == '\0')
+            return atom;
+    }
+    return NULL;
+}
+
+/* ファイルスコープに入った直後に、イメージの名前とタグを入れる */
+void pch_restore_scope(void){
+    PchImage *img = ctx -> pch;
+    for(int i = 0; i < img -> nvars; i++)
+        hashmap_put_ptr(&ctx -> scope -> vars, img -> vars[i] -> name, img -> vars[i]);
+    for(int i = 0; i < img -> ntags; i++)
+        hashmap_put_ptr(&ctx -> scope -> tags, img -> tags[i].name, img -> tags[i].val);
+}
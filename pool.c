@@ -0,0 +1,163 @@
+#include "9cc.h"
+#include <pthread.h>
+
+/*  work stealing方式でタスク0..n-1を複数のスレッドで実行する。
+    最初に各スレッドへ連続した範囲を均等に割り当て、各スレッドは自分の範囲を先頭から一つずつ実行する。
+    自分の範囲が空になったら、他のスレッドの残りの範囲の後ろ半分を奪う。
+    タスクが新しいタスクを作ることはないので、全員の範囲が空になったら終わり。
+    ワーカーのスレッドは最初に必要になったときに作り、プロセスが終わるまで残しておく。仕事がない間は条件変数で眠る。
+    parallel_forは範囲を分けたJobを公開して眠っているワーカーを起こすだけで、スレッドを作ったり待ったりはしない。
+    複数のスレッドが同時にparallel_forを呼んでもよい。呼んだスレッドも実行に加わり、
+    空いているワーカーがいなければ残りの範囲をすべて自分で奪って実行するので、ワーカーの数が足りなくても終わる。 */
+
+typedef struct{
+    pthread_mutex_t lock;
+    int begin; // まだ実行していない範囲[begin, end)
+    int end;
+}Deque;
+
+typedef struct Job Job;
+struct Job{
+    Job *next; // 公開中のJobのリスト
+    Deque *queues; // queues[0]は呼んだスレッドの分
+    int nthreads;
+    int nclaimed; // 実行者が決まった範囲の数。1..nthreads
+    int nrunning; // 範囲を受け持って実行中のワーカーの数
+    void (*fn)(int i, void *arg);
+    void *arg;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER; // Jobが公開された
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER; // ワーカーがJobの実行を終えた
+static Job *jobs; // 受け持たれていない範囲が残っているJob
+static int nworkers;
+
+static bool pop(Deque *q, int *i){
+    pthread_mutex_lock(&q -> lock);
+    bool ok = q -> begin < q -> end;
+    if(ok)
+        *i = q -> begin++;
+    pthread_mutex_unlock(&q -> lock);
+    return ok;
+}
+
+/* victimの残りの後ろ半分(一つしかなければそれ)をqに移す */
+static bool steal(Deque *victim, Deque *q){
+    pthread_mutex_lock(&victim -> lock);
+    int begin = victim -> begin + (victim -> end - victim -> begin) / 2;
+    int end = victim -> end;
+    bool ok = begin < end;
+    if(ok)
+        victim -> end = begin;
+    pthread_mutex_unlock(&victim -> lock);
+    if(!ok)
+        return false;
+
+    // qは持ち主が空にした後なので、他のスレッドが触ることはない
+    pthread_mutex_lock(&q -> lock);
+    q -> begin = begin;
+    q -> end = end;
+    pthread_mutex_unlock(&q -> lock);
+    return true;
+}
+
+/* jobのid番目の範囲を実行し、空になったら他の範囲から奪う。まだ受け持たれていない範囲からも奪う */
+static void work(Job *job, int id){
+    Deque *mine = &job -> queues[id];
+    for(;;){
+        int i;
+        while(pop(mine, &i))
+            job -> fn(i, job -> arg);
+
+        bool stolen = false;
+        for(int k = 1; k < job -> nthreads && !stolen; k++)
+            stolen = steal(&job -> queues[(id + k) % job -> nthreads], mine);
+        if(!stolen)
+            return;
+    }
+}
+
+/* jobsから外す。pool_lockを持って呼ぶ */
+static void unpublish(Job *job){
+    for(Job **p = &jobs; *p; p = &(*p) -> next){
+        if(*p == job){
+            *p = job -> next;
+            return;
+        }
+    }
+}
+
+static void *worker_main(void *arg){
+    pthread_mutex_lock(&pool_lock);
+    for(;;){
+        while(!jobs)
+            pthread_cond_wait(&work_cond, &pool_lock);
+
+        Job *job = jobs;
+        int id = job -> nclaimed++;
+        if(job -> nclaimed == job -> nthreads)
+            unpublish(job);
+        job -> nrunning++;
+        pthread_mutex_unlock(&pool_lock);
+
+        work(job, id);
+
+        pthread_mutex_lock(&pool_lock);
+        if(--job -> nrunning == 0)
+            pthread_cond_broadcast(&done_cond);
+    }
+    return NULL;
+}
+
+/* ワーカーがn人以上いるようにする。pool_lockを持って呼ぶ */
+static void grow_workers(int n){
+    for(; nworkers < n; nworkers++){
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, worker_main, NULL))
+            return; // 作れなくても呼んだスレッドが残りを実行する
+        pthread_detach(thread);
+    }
+}
+
+/* fn(i, arg)をi = 0..n-1について最大nthreadsスレッドで実行し、すべて終わるまで待つ。呼び出したスレッドも実行に加わる。 */
+void parallel_for(int n, int nthreads, void (*fn)(int i, void *arg), void *arg){
+    nthreads = MAX(1, MIN(nthreads, n));
+    if(nthreads == 1){
+        for(int i = 0; i < n; i++)
+            fn(i, arg);
+        return;
+    }
+
+    Deque *queues = calloc(nthreads, sizeof(Deque));
+    Job job = {NULL, queues, nthreads, 1, 0, fn, arg};
+    for(int t = 0; t < nthreads; t++){
+        pthread_mutex_init(&queues[t].lock, NULL);
+        queues[t].begin = (long)n * t / nthreads;
+        queues[t].end = (long)n * (t + 1) / nthreads;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    grow_workers(nthreads - 1);
+    job.next = jobs;
+    jobs = &job;
+    if(nthreads == 2)
+        pthread_cond_signal(&work_cond);
+    else
+        pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    work(&job, 0);
+
+    // 自分で見た範囲はすべて空なので、これ以上ワーカーを受け付けず、実行中のワーカーだけを待つ
+    pthread_mutex_lock(&pool_lock);
+    if(job.nclaimed < nthreads)
+        unpublish(&job);
+    while(job.nrunning)
+        pthread_cond_wait(&done_cond, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+
+    for(int t = 0; t < nthreads; t++)
+        pthread_mutex_destroy(&queues[t].lock);
+    free(queues);
+}
@@ -0,0 +1,1149 @@
+#define _GNU_SOURCE // faccessatのため
+#include "9cc.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*  プリプロセッサ。字句解析したトークンを一つずつ受け取り、ディレクティブを処理してマクロを展開したトークンをパーサに渡す。
+    主ファイルのトークンは今まで通りパーサが要求した時に字句解析し(並列の場合はチャンクごと)、includeしたファイルもファイルごとの位置から少しずつ字句解析する。
+    選ばれなかった#ifの枝は字句解析せず、テキストのまま行頭の#を探して読み飛ばす。
+    パーサに渡したトークンはnextを切ってから渡すので、パーサのリストとソースのリストは混ざらない。
+
+    マクロの再帰的な展開は、展開中のマクロに印を付けておき、展開結果の後ろに置いたTK_PP_ENDを読んだ時に印を外すことで防ぐ。
+    include guard(ファイル全体が#ifndef X ... #endifで囲まれている)と#pragma onceを覚えておき、
+    二回目以降のincludeではファイルを開かない。 */
+
+/* マクロの実引数 */
+typedef struct{
+    Token *raw; // 展開前
+    Token *expanded; // 展開後。使うときに作る
+    bool done;
+}MacroArg;
+
+struct Include{
+    Include *parent;
+    File *file;
+    FileInfo *info;
+    char *lex_pos; // 次に字句解析する位置。トークンは読む時に作る
+    bool lex_bol; // 次のトークンが行頭
+    Token *pending; // includeした側の読み戻したトークン。#includeの次の行の先頭など
+    Arena tokens;
+    CondIncl *cond; // このファイルに入った時の#ifのネスト
+    int ntok; // 読んだトークンの数
+    char *guard; // 最初の#ifndefのマクロの名前。include guardでないと分かったらNULL
+    CondIncl *guard_cond;
+    bool guard_closed; // guard_condの#endifを読んだ
+};
+
+struct CondIncl{
+    CondIncl *next;
+    enum{IN_THEN, IN_ELIF, IN_ELSE} ctx;
+    char *loc; // エラーの位置。トークンはwindowと一緒に解放されるので綴りの位置だけ持つ
+    bool included; // どれかの枝を既に選んだ
+};
+
+/* <>で探すディレクトリ。-Iで指定したものの後に探す */
+static char *std_include_paths[] = {
+    "/usr/local/include",
+    "/usr/include/x86_64-linux-gnu",
+    "/usr/include",
+};
+
+static char builtin_macros[] =
+    "#define __STDC__ 1\n"
+    "#define __STDC_VERSION__ 201112L\n"
+    "#define __STDC_HOSTED__ 1\n"
+    "#define __x86_64__ 1\n"
+    "#define __x86_64 1\n"
+    "#define __amd64__ 1\n"
+    "#define __amd64 1\n"
+    "#define __linux__ 1\n"
+    "#define __linux 1\n"
+    "#define __unix__ 1\n"
+    "#define __unix 1\n"
+    "#define __ELF__ 1\n"
+    "#define __LP64__ 1\n"
+    "#define _LP64 1\n"
+    "#define __SIZEOF_INT__ 4\n"
+    "#define __SIZEOF_LONG__ 8\n"
+    "#define __SIZEOF_POINTER__ 8\n"
+    "#define __9cc__ 1\n";
+
+/* locを含むincludeファイル。主ファイルやマクロの展開で作ったトークンならNULL */
+File *find_file(char *loc){
+    for(File *file = ctx -> files; file; file = file -> next)
+        if(file -> contents <= loc && loc <= file -> contents + file -> len)
+            return file;
+    return NULL;
+}
+
+static char *format(char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    char *buf = arena_alloc(&ctx -> token_arena, len + 1);
+    va_start(ap, fmt);
+    vsnprintf(buf, len + 1, fmt, ap);
+    va_end(ap);
+    return buf;
+}
+
+/* トークンの綴りがsか。ifやelseはキーワードなので名前ではなく綴りで比べる。 */
+static bool is_name(Token *tok, char *s){
+    return (tok -> kind == TK_IDENT || tok -> kind == TK_KEYWORD) && tok -> len == strlen(s) && !memcmp(tok -> str, s, tok -> len);
+}
+
+static bool is_hash(Token *tok){
+    return tok -> at_bol && tok -> kind == TK_PUNCT && tok -> id == '#';
+}
+
+/* ソースの次のトークン。読み戻したトークンがあればそれを先に返す。includeファイルの終わりではそのファイルのTK_EOFを返す。 */
+static Token *next_raw(void){
+    Token *tok;
+    if(ctx -> pending){
+        tok = ctx -> pending;
+        ctx -> pending = tok -> next;
+    }else if(ctx -> include){
+        Include *inc = ctx -> include;
+        tok = lex_from(&inc -> lex_pos, &inc -> lex_bol, &inc -> tokens);
+        inc -> ntok++;
+    }else{
+        tok = ctx -> raw_cursor ? ctx -> raw_cursor : lex_next();
+        ctx -> raw_cursor = tok -> next;
+    }
+    tok -> next = NULL;
+    return tok;
+}
+
+/* tokを読み戻す */
+static void unread(Token *tok){
+    tok -> next = ctx -> pending;
+    ctx -> pending = tok;
+}
+
+/* listの後ろにpendingをつなげて、listから読むようにする */
+static void unread_list(Token *list){
+    if(!list)
+        return;
+    Token *last = list;
+    while(last -> next)
+        last = last -> next;
+    last -> next = ctx -> pending;
+    ctx -> pending = list;
+}
+
+/* 行末までのトークン。行末の次のトークンは読み戻す */
+static Token *read_line(void){
+    Token head = {};
+    Token *cur = &head;
+    for(;;){
+        Token *tok = next_raw();
+        if(tok -> at_bol || tok -> kind == TK_EOF){
+            unread(tok);
+            return head.next;
+        }
+        cur = cur -> next = tok;
+    }
+}
+
+static void skip_line(void){
+    read_line();
+}
+
+static Token *new_num_token(int64_t val, Token *tmpl){
+    Token *tok = copy_token(tmpl);
+    tok -> kind = TK_NUM;
+    tok -> id = 0;
+    tok -> val = val;
+    tok -> ty = ty_long;
+    return tok;
+}
+
+static Token *new_eof(Token *tmpl){
+    Token *tok = copy_token(tmpl);
+    tok -> kind = TK_EOF;
+    tok -> id = 0;
+    tok -> len = 0;
+    return tok;
+}
+
+/* sを字句解析したリスト。#や##で作ったトークンの綴りはここで作った文字列を指す */
+static Token *lex_text(char *s, int len){
+    char *buf = arena_alloc(&ctx -> token_arena, len + 2 + SCAN_PADDING);
+    memcpy(buf, s, len);
+    buf[len] = '\n';
+    Token *tok = lex_buffer(buf, &ctx -> token_window[ctx -> cur_window]);
+    return tok;
+}
+
+/* マクロの名前として使える場合はinternした名前。キーワードも名前にできる */
+static char *macro_name(Token *tok){
+    if(tok -> kind == TK_IDENT)
+        return tok -> name;
+    if(tok -> kind == TK_KEYWORD)
+        return intern(tok -> str, tok -> len);
+    return NULL;
+}
+
+/* #defineなどの後のマクロの名前を読む */
+static char *read_macro_name(void){
+    Token *tok = next_raw();
+    char *name = macro_name(tok);
+    if(!name || tok -> at_bol)
+        error_at(tok -> str, "macro name must be an identifier");
+    if(tok -> kind == TK_KEYWORD)
+        ctx -> keyword_macros = true;
+    return name;
+}
+
+/* internした名前のアドレスから決まるmacro_bitsのビット */
+static int macro_bit(char *name){
+    return ((uintptr_t)name >> 3) % (sizeof(ctx -> macro_bits) * 8);
+}
+
+static Macro *find_macro(Token *tok){
+    if(tok -> kind == TK_IDENT){
+        int bit = macro_bit(tok -> name);
+        if(!(ctx -> macro_bits[bit / 64] >> (bit % 64) & 1))
+            return NULL;
+        return hashmap_get_ptr(&ctx -> macros, tok -> name);
+    }
+    // キーワードのマクロは普通定義されないので、その時だけ探す
+    if(tok -> kind == TK_KEYWORD && ctx -> keyword_macros)
+        return hashmap_get_ptr(&ctx -> macros, intern(tok -> str, tok -> len));
+    return NULL;
+}
+
+/* 作ったマクロを表に入れる。プリコンパイルしたヘッダのマクロもこれで登録する */
+void register_macro(Macro *m){
+    hashmap_put_ptr(&ctx -> macros, m -> name, m);
+    int bit = macro_bit(m -> name);
+    ctx -> macro_bits[bit / 64] |= (uint64_t)1 << (bit % 64); // #undefしても消さない
+}
+
+static Macro *add_macro(char *name, bool is_objlike, Token *body){
+    Macro *m = arena_alloc(&ctx -> token_arena, sizeof(Macro));
+    m -> name = name;
+    m -> is_objlike = is_objlike;
+    m -> body = body;
+    register_macro(m);
+    return m;
+}
+
+/* 展開結果bodyの後ろに終わりの印を付けて読み戻す。印を読むまでmは展開しない */
+static void push_expansion(Macro *m, Token *tok, Token *body){
+    Token *end = copy_token(tok);
+    end -> kind = TK_PP_END;
+    end -> name = m -> name;
+    unread(end);
+    unread_list(body);
+    m -> busy = true;
+    if(ctx -> expand_depth++ == 0)
+        ctx -> expand_loc = tok -> str;
+}
+
+/* listを展開した結果 */
+static Token *expand_list(Token *list);
+
+/* # */
+static Token *stringize(Token *hash, Token *arg){
+    Buffer buf = {};
+    buf_append(&buf, "\"", 1);
+    for(Token *tok = arg; tok; tok = tok -> next){
+        if(tok != arg && tok -> has_space)
+            buf_append(&buf, " ", 1);
+        bool quote = tok -> kind == TK_STR || (tok -> kind == TK_NUM && tok -> str[0] == '\'');
+        for(int i = 0; i < tok -> len; i++){
+            char c = tok -> str[i];
+            if(quote && (c == '"' || c == '\\'))
+                buf_append(&buf, "\\", 1);
+            buf_append(&buf, &c, 1);
+        }
+    }
+    buf_append(&buf, "\"", 1);
+
+    Token *tok = lex_text(buf.data, buf.len);
+    free(buf.data);
+    tok -> has_space = hash -> has_space;
+    tok -> next = NULL; // 後ろのTK_EOF
+    return tok;
+}
+
+/* ## */
+static Token *paste(Token *lhs, Token *rhs){
+    Buffer buf = {};
+    buf_append(&buf, lhs -> str, lhs -> len);
+    buf_append(&buf, rhs -> str, rhs -> len);
+    Token *tok = lex_text(buf.data, buf.len);
+    if(tok -> next -> kind != TK_EOF)
+        error_at(lhs -> str, "pasting forms '%.*s', an invalid token", (int)buf.len, buf.data);
+    free(buf.data);
+    tok -> has_space = lhs -> has_space;
+    tok -> next = NULL;
+    return tok;
+}
+
+static MacroArg *find_arg(Macro *m, MacroArg *args, Token *tok){
+    if(tok -> kind != TK_IDENT)
+        return NULL;
+    for(int i = 0; i < m -> nparams; i++)
+        if(m -> params[i] == tok -> name)
+            return &args[i];
+    return NULL;
+}
+
+/* listのコピーをcurの後ろにつなげ、最後のトークンを返す */
+static Token *append(Token *cur, Token *list, bool has_space){
+    for(Token *tok = list; tok; tok = tok -> next){
+        cur = cur -> next = copy_token(tok);
+        if(tok == list)
+            cur -> has_space = has_space;
+    }
+    return cur;
+}
+
+/* マクロの本体のコピー。関数形式マクロなら引数を実引数に置き換える */
+static Token *subst(Macro *m, MacroArg *args){
+    Token head = {};
+    Token *cur = &head;
+    for(Token *tok = m -> body; tok; tok = tok -> next){
+        /* #x */
+        if(is_equal(tok, '#') && !m -> is_objlike){
+            MacroArg *arg = tok -> next ? find_arg(m, args, tok -> next) : NULL;
+            if(!arg)
+                error_at(tok -> str, "'#' is not followed by a macro parameter");
+            cur = cur -> next = stringize(tok, arg -> raw);
+            tok = tok -> next;
+            continue;
+        }
+
+        /* GNU拡張。__VA_ARGS__が空なら, ## __VA_ARGS__の,を消す */
+        if(is_equal(tok, ',') && tok -> next && is_equal(tok -> next, PUNCT_HASHHASH) && tok -> next -> next){
+            MacroArg *arg = find_arg(m, args, tok -> next -> next);
+            if(arg && m -> is_variadic && arg == &args[m -> nparams - 1]){
+                if(arg -> raw){
+                    cur = cur -> next = copy_token(tok);
+                    tok = tok -> next; // ##を飛ばす
+                }else{
+                    tok = tok -> next -> next;
+                }
+                continue;
+            }
+        }
+
+        /* x ## y。左辺は既にcurにある */
+        if(is_equal(tok, PUNCT_HASHHASH)){
+            if(cur == &head || !tok -> next)
+                error_at(tok -> str, "'##' cannot appear at either end of macro expansion");
+            Token *rhs = tok -> next;
+            MacroArg *arg = find_arg(m, args, rhs);
+            Token *list = arg ? arg -> raw : rhs;
+            if(list){
+                Token *t = paste(cur, list);
+                *cur = *t;
+                cur = append(cur, arg ? list -> next : NULL, false);
+            }
+            tok = rhs;
+            continue;
+        }
+
+        MacroArg *arg = find_arg(m, args, tok);
+
+        /* x ## yのxは展開しない。xが空ならyがそのまま残る */
+        if(arg && tok -> next && is_equal(tok -> next, PUNCT_HASHHASH)){
+            if(arg -> raw){
+                cur = append(cur, arg -> raw, tok -> has_space);
+                continue;
+            }
+            Token *rhs = tok -> next -> next;
+            MacroArg *arg2 = rhs ? find_arg(m, args, rhs) : NULL;
+            if(rhs)
+                cur = append(cur, arg2 ? arg2 -> raw : rhs, tok -> has_space);
+            tok = tok -> next ? tok -> next -> next : NULL;
+            if(!tok)
+                break;
+            continue;
+        }
+
+        if(arg){
+            if(!arg -> done){
+                arg -> expanded = expand_list(arg -> raw);
+                arg -> done = true;
+            }
+            cur = append(cur, arg -> expanded, tok -> has_space);
+            continue;
+        }
+
+        cur = cur -> next = copy_token(tok);
+    }
+    return head.next;
+}
+
+/* TK_PP_ENDを処理しながら次のトークンを読む */
+static Token *next_skip_end(void){
+    for(;;){
+        Token *tok = next_raw();
+        if(tok -> kind != TK_PP_END)
+            return tok;
+        Macro *m = hashmap_get_ptr(&ctx -> macros, tok -> name);
+        if(m)
+            m -> busy = false;
+        ctx -> expand_depth--;
+    }
+}
+
+/* 関数形式マクロの実引数を読む。'('は読んである */
+static MacroArg *read_args(Macro *m, Token *name){
+    MacroArg *args = arena_alloc(&ctx -> token_window[ctx -> cur_window], MAX(m -> nparams, 1) * sizeof(MacroArg));
+    int i = 0;
+    Token head = {};
+    Token *cur = &head;
+    int depth = 0;
+    for(;;){
+        Token *tok = next_skip_end();
+        if(tok -> kind == TK_EOF)
+            error_at(name -> str, "unterminated macro call");
+        tok = copy_token(tok);
+        tok -> at_bol = false;
+
+        bool last = m -> is_variadic && i == m -> nparams - 1;
+        if(depth == 0 && (is_equal(tok, ')') || (is_equal(tok, ',') && !last))){
+            if(i < m -> nparams)
+                args[i].raw = head.next;
+            else if(head.next || m -> nparams)
+                error_at(tok -> str, "too many arguments");
+            i++;
+            head.next = NULL;
+            cur = &head;
+            if(is_equal(tok, ')'))
+                break;
+            continue;
+        }
+        if(is_equal(tok, '('))
+            depth++;
+        else if(is_equal(tok, ')'))
+            depth--;
+        cur = cur -> next = tok;
+    }
+
+    // 引数のないマクロをf()で呼んだ場合はi == 1
+    if(i < m -> nparams && !(i == m -> nparams - 1 && m -> is_variadic))
+        error_at(name -> str, "too few arguments");
+    return args;
+}
+
+/* tokがマクロなら展開結果を読み戻してtrueを返す */
+static bool expand_macro(Token *tok){
+    Macro *m = find_macro(tok);
+    if(!m || m -> busy)
+        return false;
+
+    if(m -> handler){
+        Token *t = m -> handler(tok);
+        t -> has_space = tok -> has_space;
+        unread(t);
+        return true;
+    }
+
+    MacroArg *args = NULL;
+    if(!m -> is_objlike){
+        /* 後ろに(がなければ関数形式マクロとしては展開しない */
+        Token *paren = next_skip_end();
+        if(!is_equal(paren, '(')){
+            unread(paren);
+            return false;
+        }
+        args = read_args(m, tok);
+    }
+
+    Token *body = subst(m, args);
+    if(body)
+        body -> has_space = tok -> has_space;
+    push_expansion(m, tok, body);
+    return true;
+}
+
+/* マクロを展開しながら次のトークンを読む */
+static Token *expand_next(void){
+    for(;;){
+        Token *tok = next_skip_end();
+        if((tok -> kind == TK_IDENT || tok -> kind == TK_KEYWORD) && expand_macro(tok))
+            continue;
+        return tok;
+    }
+}
+
+static Token *expand_list(Token *list){
+    if(!list)
+        return NULL;
+    Token *end = new_eof(list);
+    Token head = {};
+    Token *cur = &head;
+    for(Token *tok = list; tok; tok = tok -> next)
+        cur = cur -> next = copy_token(tok);
+    cur -> next = end;
+    unread_list(head.next);
+
+    cur = &head;
+    for(;;){
+        Token *tok = expand_next();
+        if(tok == end)
+            return head.next;
+        cur = cur -> next = tok;
+    }
+}
+
+/* #defineの後 */
+static void read_macro_definition(void){
+    char *name = read_macro_name();
+
+    Token *tok = next_raw();
+    bool is_objlike = tok -> at_bol || !is_equal(tok, '(') || tok -> has_space;
+    char *params[256];
+    int nparams = 0;
+    bool is_variadic = false;
+    if(is_objlike){
+        unread(tok);
+    }else{
+        for(;;){
+            tok = next_raw();
+            if(nparams == 0 && is_equal(tok, ')'))
+                break;
+            if(tok -> at_bol)
+                error_at(tok -> str, "missing ')' in macro parameter list");
+            if(is_equal(tok, PUNCT_ELLIPSIS)){
+                is_variadic = true;
+                params[nparams++] = intern("__VA_ARGS__", 11);
+                tok = next_raw();
+                if(!is_equal(tok, ')'))
+                    error_at(tok -> str, "expected ')'");
+                break;
+            }
+            if(tok -> kind != TK_IDENT)
+                error_at(tok -> str, "expected parameter name");
+            if(nparams == sizeof(params) / sizeof(*params))
+                error_at(tok -> str, "too many parameters");
+            params[nparams++] = tok -> name;
+            tok = next_raw();
+            if(is_equal(tok, ')'))
+                break;
+            if(!is_equal(tok, ','))
+                error_at(tok -> str, "expected ',' or ')'");
+        }
+    }
+
+    /* 本体はマクロが消えるまで使うのでwindowの外にコピーしておく */
+    Token head = {};
+    Token *cur = &head;
+    for(Token *t = read_line(); t; t = t -> next){
+        cur = cur -> next = keep_token(t);
+        cur -> at_bol = false;
+    }
+
+    Macro *m = add_macro(name, is_objlike, head.next);
+    if(!is_objlike){
+        m -> params = arena_alloc(&ctx -> token_arena, MAX(nparams, 1) * sizeof(char *));
+        memcpy(m -> params, params, nparams * sizeof(char *));
+        m -> nparams = nparams;
+        m -> is_variadic = is_variadic;
+    }
+}
+
+static bool is_defined(char *name){
+    Macro *m = hashmap_get_ptr(&ctx -> macros, name);
+    return m != NULL;
+}
+
+/* #ifの行の値。defined以外の識別子はマクロを展開した後に0にする */
+static int64_t read_const_expr(Token *hash){
+    Token head = {};
+    Token *cur = &head;
+    for(Token *tok = read_line(); tok; tok = tok -> next){
+        if(is_name(tok, "defined")){
+            Token *start = tok;
+            bool paren = tok -> next && is_equal(tok -> next, '(');
+            if(paren)
+                tok = tok -> next;
+            tok = tok -> next;
+            if(!tok || !macro_name(tok))
+                error_at(start -> str, "macro name must be an identifier");
+            cur = cur -> next = new_num_token(is_defined(macro_name(tok)), tok);
+            if(paren){
+                tok = tok -> next;
+                if(!tok || !is_equal(tok, ')'))
+                    error_at(start -> str, "expected ')'");
+            }
+            continue;
+        }
+        cur = cur -> next = copy_token(tok);
+    }
+    if(!head.next)
+        error_at(hash -> str, "no expression");
+
+    Token *list = expand_list(head.next);
+    cur = &head;
+    for(Token *tok = list; tok; tok = tok -> next)
+        cur = cur -> next = (tok -> kind == TK_IDENT || tok -> kind == TK_KEYWORD) ? new_num_token(0, tok) : tok;
+    cur -> next = new_eof(hash);
+    return eval_pp_expr(head.next);
+}
+
+static CondIncl *push_cond(Token *tok, bool included){
+    CondIncl *ci = arena_alloc(&ctx -> token_arena, sizeof(CondIncl));
+    ci -> next = ctx -> cond;
+    ci -> ctx = IN_THEN;
+    ci -> loc = tok -> str;
+    ci -> included = included;
+    ctx -> cond = ci;
+    return ci;
+}
+
+/* 行頭の空白とコメント。改行を含むブロックコメントと行の継続も飛ばす */
+static char *skip_blank(char *p){
+    for(;;){
+        if(is_space_char(*p) && *p != '\n'){
+            p++;
+        }else if(p[0] == '\\' && p[1] == '\n'){
+            p += 2;
+        }else if(p[0] == '/' && p[1] == '*'){
+            char *q = find_comment_end(p + 2);
+            if(!q)
+                return p + strlen(p); // 閉じられていないコメント。エラーは#ifが閉じられていないことで出る
+            p = q + 2;
+        }else{
+            return p;
+        }
+    }
+}
+
+/* pを含む行の次の行の先頭。なければ終端の'\0'。リテラルとコメントは字句解析と同じく扱い、行の継続とブロックコメントの中の改行では終わらない */
+static char *skip_rest_of_line(char *p){
+    char *start = p;
+    for(;;){
+        char *nl = find_newline(p);
+        char *q = find_literal_start(p);
+        if(nl < q){
+            if(!*nl)
+                return nl;
+            if(nl > start && nl[-1] == '\\'){
+                p = nl + 1;
+                continue;
+            }
+            return nl + 1;
+        }
+
+        if(!*q){
+            return q;
+        }else if(*q == '"'){
+            p = skip_string(q);
+        }else if(*q == '\''){
+            p = skip_char(q);
+        }else if(q[1] == '/'){
+            p = find_line_comment_end(q + 2);
+            return *p ? p + 1 : p;
+        }else if(q[1] == '*'){
+            char *end = find_comment_end(q + 2);
+            if(!end)
+                return q + strlen(q);
+            p = end + 2;
+        }else{
+            p = q + 1;
+        }
+    }
+}
+
+/*  pから選ばれなかった枝のテキストを読み飛ばし、対応する#elif, #else, #endifの行の#を返す。なければ終端の'\0'。
+    bolでなければpは行の途中なので、その行の残りから飛ばす。depthは#ifなどのネストで、トークンで読み飛ばした分から続ける */
+static char *skip_cond_text(char *p, bool bol, int depth){
+    if(!bol)
+        p = skip_rest_of_line(p);
+    for(; *p; p = skip_rest_of_line(p)){
+        char *hash = skip_blank(p);
+        if(*hash != '#'){
+            p = hash;
+            continue;
+        }
+        char *name = skip_blank(hash + 1);
+        char *end = skip_ident(name);
+        int len = end - name;
+        p = end;
+        if((len == 2 && !memcmp(name, "if", 2)) || (len == 5 && !memcmp(name, "ifdef", 5)) || (len == 6 && !memcmp(name, "ifndef", 6))){
+            depth++;
+        }else if((len == 4 && (!memcmp(name, "elif", 4) || !memcmp(name, "else", 4))) || (len == 5 && !memcmp(name, "endif", 5))){
+            if(depth == 0)
+                return hash;
+            if(len == 5)
+                depth--;
+        }
+    }
+    return p;
+}
+
+/*  テキストのまま読み飛ばせるなら、次に字句解析する位置と行頭かどうか。
+    読み戻したトークンや、主ファイルを並列に字句解析したトークンが残っていればNULL */
+static char **lex_position(bool **bol){
+    if(ctx -> pending)
+        return NULL;
+    if(ctx -> include){
+        *bol = &ctx -> include -> lex_bol;
+        return &ctx -> include -> lex_pos;
+    }
+    if(ctx -> raw_cursor || ctx -> lex_next_chunk < ctx -> lex_nchunks)
+        return NULL;
+    *bol = &ctx -> lex_bol;
+    return &ctx -> lex_pos;
+}
+
+/*  選ばれなかった枝を対応する#elif, #else, #endifの直前まで読み飛ばす。
+    既にトークンになっているもの(#ifの行の次のトークンなど)はトークンで読み、残りはテキストのまま飛ばす */
+static void skip_cond_incl(void){
+    int depth = 0;
+    for(;;){
+        bool *bol;
+        char **pos = lex_position(&bol);
+        if(pos){
+            *pos = skip_cond_text(*pos, *bol, depth);
+            *bol = true;
+            return;
+        }
+
+        Token *tok = next_raw();
+        if(tok -> kind == TK_EOF){
+            unread(tok);
+            return;
+        }
+        if(!is_hash(tok))
+            continue;
+
+        Token *name = next_raw();
+        if(is_name(name, "if") || is_name(name, "ifdef") || is_name(name, "ifndef")){
+            depth++;
+        }else if(is_name(name, "elif") || is_name(name, "else") || is_name(name, "endif")){
+            if(depth == 0){
+                unread(name);
+                unread(tok);
+                return;
+            }
+            if(is_name(name, "endif"))
+                depth--;
+        }else{
+            unread(name); // 行頭の#かもしれない
+        }
+    }
+}
+
+/*  FileInfoの表のキー。statできればデバイスとinode番号にするので、"a.h"と"./a.h"のように別の綴りでincludeしても同じになる。
+    statできないもの(<built-in>など)はパスをキーにする。パスはNULを含まないので、先頭をNULにしたキーとは重ならない。
+    keyにはFILE_KEY_LENバイトの領域を渡す。返すのはkeyかpath */
+#define FILE_KEY_LEN (1 + 2 * sizeof(uint64_t))
+
+static char *file_key(char *path, char *key, int *len){
+    struct stat st;
+    if(fstatat(ctx -> opts -> dir_fd, path, &st, 0) == -1){
+        *len = strlen(path);
+        return path;
+    }
+    uint64_t id[2] = {st.st_dev, st.st_ino};
+    key[0] = '\0';
+    memcpy(key + 1, id, sizeof(id));
+    *len = FILE_KEY_LEN;
+    return key;
+}
+
+/* pathのFileInfoをinfoにする。--include-pchでイメージのものを入れるのにも使う */
+void register_file_info(char *path, FileInfo *info){
+    char buf[FILE_KEY_LEN];
+    int len;
+    char *key = file_key(path, buf, &len);
+    if(key == buf)
+        key = memcpy(arena_alloc(&ctx -> token_arena, len), buf, len);
+    hashmap_put2(&ctx -> file_info, key, len, info);
+}
+
+static FileInfo *file_info(char *path){
+    char buf[FILE_KEY_LEN];
+    int len;
+    char *key = file_key(path, buf, &len);
+    FileInfo *info = hashmap_get2(&ctx -> file_info, key, len);
+    if(!info){
+        info = arena_alloc(&ctx -> token_arena, sizeof(FileInfo));
+        info -> path = path;
+        register_file_info(path, info);
+    }
+    return info;
+}
+
+/* 相対パスはopts -> dir_fdから探す */
+/* 見つからなかったパスは、--cacheのエントリが後から置かれたファイルで古くならないように覚えておく */
+static bool readable(char *path){
+    if(!faccessat(ctx -> opts -> dir_fd, path, R_OK, 0))
+        return true;
+    if(cache_dir)
+        hashmap_put(&ctx -> missed_includes, path, path);
+    return false;
+}
+
+static char *search_include(char *name, bool quoted){
+    CompileOptions *opts = ctx -> opts;
+    if(name[0] == '/')
+        return readable(name) ? name : NULL;
+
+    if(quoted){
+        char *cur = ctx -> include ? ctx -> include -> file -> name : ctx -> path;
+        char *slash = strrchr(cur, '/');
+        char *path = slash ? format("%.*s/%s", (int)(slash - cur), cur, name) : format("%s", name);
+        if(readable(path))
+            return path;
+    }
+    for(int i = 0; i < opts -> ninclude_paths; i++){
+        char *path = format("%s/%s", opts -> include_paths[i], name);
+        if(readable(path))
+            return path;
+    }
+    for(int i = 0; i < sizeof(std_include_paths) / sizeof(*std_include_paths); i++){
+        char *path = format("%s/%s", std_include_paths[i], name);
+        if(readable(path))
+            return path;
+    }
+    return NULL;
+}
+
+/* contentsを読むincludeを始める */
+static void push_include(File *file, FileInfo *info){
+    Include *inc = calloc(1, sizeof(Include));
+    inc -> parent = ctx -> include;
+    inc -> file = file;
+    inc -> info = info;
+    inc -> cond = ctx -> cond;
+    inc -> pending = ctx -> pending;
+    ctx -> pending = NULL;
+    file -> next = ctx -> files;
+    ctx -> files = file;
+    inc -> lex_pos = file -> contents;
+    inc -> lex_bol = true;
+    ctx -> include = inc;
+}
+
+/* include guardか#pragma onceのあるファイルが既に読まれていれば、開かずに済ませる */
+static void include_file(char *path, Token *tok){
+    FileInfo *info = file_info(path);
+    if(info -> once || (info -> guard && is_defined(info -> guard)))
+        return;
+
+    File *file = calloc(1, sizeof(File));
+    file -> name = path;
+    file -> contents = read_file(path, &file -> map_len);
+    file -> len = strlen(file -> contents);
+    push_include(file, info);
+}
+
+/* #includeの後 */
+static void read_include(Token *directive){
+    Token *tok = next_raw();
+    if(tok -> at_bol)
+        error_at(directive -> str, "expected \"FILENAME\" or <FILENAME>");
+    unread(tok);
+
+    Token *line = read_line();
+    if(line -> kind == TK_IDENT)
+        line = expand_list(line); // #include MACRO
+
+    char *name;
+    bool quoted = line -> kind == TK_STR;
+    if(quoted){
+        name = format("%.*s", line -> len - 2, line -> str + 1);
+    }else if(is_equal(line, '<')){
+        Buffer buf = {};
+        Token *t = line -> next;
+        for(; t && !is_equal(t, '>'); t = t -> next){
+            if(t != line -> next && t -> has_space)
+                buf_append(&buf, " ", 1);
+            buf_append(&buf, t -> str, t -> len);
+        }
+        if(!t)
+            error_at(line -> str, "expected '>'");
+        name = format("%.*s", (int)buf.len, buf.data);
+        free(buf.data);
+    }else{
+        error_at(line -> str, "expected \"FILENAME\" or <FILENAME>");
+    }
+
+    char *path = search_include(name, quoted);
+    if(!path)
+        error_at(line -> str, "%s: No such file or directory", name);
+    include_file(path, line);
+}
+
+/* includeファイルを読み終えた */
+static void end_include(void){
+    Include *inc = ctx -> include;
+    if(ctx -> cond != inc -> cond)
+        error_at(ctx -> cond -> loc, "unterminated conditional directive");
+    if(inc -> guard && inc -> guard_closed)
+        inc -> info -> guard = inc -> guard;
+
+    ctx -> include = inc -> parent;
+    unread_list(inc -> pending);
+    inc -> parent = ctx -> retired;
+    ctx -> retired = inc;
+}
+
+/* 行頭の#の後 */
+static void directive(Token *hash){
+    Include *inc = ctx -> include;
+    bool first = inc && inc -> ntok == 1; // ファイルの最初のトークンが#
+    if(inc && inc -> guard_closed)
+        inc -> guard = NULL; // include guardの#endifの後に何かある
+
+    Token *tok = next_raw();
+    if(tok -> at_bol || tok -> kind == TK_EOF){
+        unread(tok); // #だけの行
+        return;
+    }
+
+    if(is_name(tok, "include")){
+        read_include(tok);
+        return;
+    }
+
+    if(is_name(tok, "define")){
+        read_macro_definition();
+        return;
+    }
+
+    if(is_name(tok, "undef")){
+        hashmap_put_ptr(&ctx -> macros, read_macro_name(), NULL);
+        skip_line();
+        return;
+    }
+
+    if(is_name(tok, "if")){
+        int64_t val = read_const_expr(tok);
+        push_cond(tok, val);
+        if(!val)
+            skip_cond_incl();
+        return;
+    }
+
+    if(is_name(tok, "ifdef") || is_name(tok, "ifndef")){
+        char *name = read_macro_name();
+        skip_line();
+        bool val = is_defined(name) ^ is_name(tok, "ifndef");
+        CondIncl *ci = push_cond(tok, val);
+        if(first && is_name(tok, "ifndef")){
+            inc -> guard = name;
+            inc -> guard_cond = ci;
+        }
+        if(!val)
+            skip_cond_incl();
+        return;
+    }
+
+    if(is_name(tok, "elif")){
+        CondIncl *ci = ctx -> cond;
+        if(!ci || ci -> ctx == IN_ELSE)
+            error_at(tok -> str, "stray #elif");
+        if(inc && ci == inc -> guard_cond)
+            inc -> guard = NULL;
+        ci -> ctx = IN_ELIF;
+        if(!ci -> included && read_const_expr(tok)){
+            ci -> included = true;
+        }else{
+            skip_line();
+            skip_cond_incl();
+        }
+        return;
+    }
+
+    if(is_name(tok, "else")){
+        CondIncl *ci = ctx -> cond;
+        if(!ci || ci -> ctx == IN_ELSE)
+            error_at(tok -> str, "stray #else");
+        if(inc && ci == inc -> guard_cond)
+            inc -> guard = NULL;
+        ci -> ctx = IN_ELSE;
+        skip_line();
+        if(ci -> included)
+            skip_cond_incl();
+        ci -> included = true;
+        return;
+    }
+
+    if(is_name(tok, "endif")){
+        CondIncl *ci = ctx -> cond;
+        if(!ci || (inc && ci == inc -> cond))
+            error_at(tok -> str, "stray #endif");
+        if(inc && ci == inc -> guard_cond)
+            inc -> guard_closed = true;
+        ctx -> cond = ci -> next;
+        skip_line();
+        return;
+    }
+
+    if(is_name(tok, "pragma")){
+        Token *t = read_line();
+        if(t && is_name(t, "once")){
+            if(inc)
+                inc -> info -> once = true;
+        }
+        return; // 他の#pragmaは無視する
+    }
+
+    if(is_name(tok, "error")){
+        char *end = tok -> str;
+        while(*end != '\n')
+            end++;
+        error_at(hash -> str, "#error%.*s", (int)(end - tok -> str - tok -> len), tok -> str + tok -> len);
+    }
+
+    if(is_name(tok, "line") || is_name(tok, "ident")){
+        skip_line();
+        return;
+    }
+
+    error_at(tok -> str, "invalid preprocessor directive");
+}
+
+/* パーサに渡す次のトークン */
+Token *preprocess_next(void){
+    /* 主ファイルのトークンのほとんどはディレクティブでもマクロでもないので、そのまま渡す */
+    if(!ctx -> pending && !ctx -> include){
+        Token *tok = ctx -> raw_cursor ? ctx -> raw_cursor : lex_next();
+        if(tok -> kind != TK_EOF && tok -> kind != TK_INVALID && !is_hash(tok) && !find_macro(tok)){
+            ctx -> raw_cursor = tok -> next;
+            tok -> next = NULL;
+            return tok;
+        }
+        ctx -> raw_cursor = tok; // next_rawで読み直す
+    }
+
+    for(;;){
+        Token *tok = expand_next();
+
+        if(is_hash(tok)){
+            directive(tok);
+            continue;
+        }
+
+        if(tok -> kind == TK_EOF){
+            if(ctx -> include){
+                end_include();
+                continue;
+            }
+            if(ctx -> cond)
+                error_at(ctx -> cond -> loc, "unterminated conditional directive");
+            return tok;
+        }
+
+        if(tok -> kind == TK_INVALID)
+            error_at(tok -> str, *tok -> str == '"' ? "文字列リテラルが閉じられていません" : "unclosed char literal");
+        if(ctx -> include && ctx -> include -> guard_closed)
+            ctx -> include -> guard = NULL;
+        return tok;
+    }
+}
+
+/* __LINE__と__FILE__の位置。マクロの展開結果の中なら、一番外側のマクロを使った位置 */
+static char *macro_loc(Token *tok){
+    return ctx -> expand_depth ? ctx -> expand_loc : tok -> str;
+}
+
+static Token *file_macro(Token *tok){
+    File *file = find_file(macro_loc(tok));
+    char *name = file ? file -> name : ctx -> path;
+    Token *t = lex_text(format("\"%s\"", name), strlen(name) + 2);
+    t -> next = NULL;
+    return t;
+}
+
+/*  locの行番号。前に求めた位置(*pos)と行番号(*line)から前後に数えるので、
+    ファイルを先頭から順に読んでいる間は__LINE__を何度使ってもファイルの大きさにはよらない */
+static int line_number(char *start, char **pos, int *line, char *loc){
+    char *p = *pos ? *pos : start;
+    int n = *pos ? *line : 1;
+    for(; p < loc && *p; p++)
+        n += *p == '\n';
+    for(; loc < p && start < p; p--)
+        n -= p[-1] == '\n';
+    *pos = p;
+    *line = n;
+    return n;
+}
+
+static Token *line_macro(Token *tok){
+    char *loc = macro_loc(tok);
+    File *file = find_file(loc);
+    int line = file ? line_number(file -> contents, &file -> line_pos, &file -> line_no, loc) :
+                      line_number(ctx -> input, &ctx -> line_pos, &ctx -> line_no, loc);
+    /* #で文字列にした時に"__LINE__"にならないように、数字を字句解析して綴りを持たせる */
+    char *buf = format("%d", line);
+    Token *t = lex_text(buf, strlen(buf));
+    t -> next = NULL;
+    return t;
+}
+
+/* 定義済みのマクロを登録する */
+void init_preprocessor(void){
+    ctx -> cond = NULL;
+    ctx -> pending = NULL;
+    ctx -> raw_cursor = NULL;
+    ctx -> expand_depth = 0;
+    add_macro(intern("__FILE__", 8), true, NULL) -> handler = file_macro;
+    add_macro(intern("__LINE__", 8), true, NULL) -> handler = line_macro;
+    if(ctx -> pch)
+        return; // 定義済みのマクロはイメージに入っている
+
+    File *file = calloc(1, sizeof(File));
+    file -> name = "<built-in>";
+    file -> len = sizeof(builtin_macros) - 1;
+    file -> contents = calloc(1, file -> len + 1 + SCAN_PADDING);
+    memcpy(file -> contents, builtin_macros, file -> len);
+    push_include(file, file_info(file -> name));
+}
+
+/*  discard_tokensから呼ぶ。読み戻したトークンを新しいwindowにコピーし、読み終えたincludeファイルのトークンを解放する。 */
+void discard_pp_tokens(void){
+    ctx -> pending = copy_list(ctx -> pending);
+    for(Include *inc = ctx -> include; inc; inc = inc -> parent)
+        inc -> pending = copy_list(inc -> pending);
+
+    while(ctx -> retired){
+        Include *inc = ctx -> retired;
+        ctx -> retired = inc -> parent;
+        arena_release(&inc -> tokens);
+        free(inc);
+    }
+}
+
+void free_preprocessor(void){
+    /* エラーで途中から戻ってきた場合はincludeの途中 */
+    while(ctx -> include){
+        Include *inc = ctx -> include;
+        ctx -> include = inc -> parent;
+        inc -> parent = ctx -> retired;
+        ctx -> retired = inc;
+    }
+    while(ctx -> retired){
+        Include *inc = ctx -> retired;
+        ctx -> retired = inc -> parent;
+        arena_release(&inc -> tokens);
+        free(inc);
+    }
+
+    while(ctx -> files){
+        File *file = ctx -> files;
+        ctx -> files = file -> next;
+        if(file -> map_len)
+            munmap(file -> contents, file -> map_len);
+        else
+            free(file -> contents);
+        free(file);
+    }
+    hashmap_free(&ctx -> macros);
+    memset(ctx -> macro_bits, 0, sizeof(ctx -> macro_bits));
+    ctx -> keyword_macros = false;
+    hashmap_free(&ctx -> file_info);
+    hashmap_free(&ctx -> missed_includes);
+}
@@ -0,0 +1,313 @@
+#include "9cc.h"
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+/*  字句解析の内側のループ(空白、識別子、コメント、文字列リテラルの走査)と、並列に字句解析する前の区切りの探索。
+    x86-64ではSSE2で16バイトずつ、AVX2が使えるCPUではAVX2で32バイトずつ調べる。それ以外は表を引いて1バイトずつ進む。
+    ベクトル命令は終端の'\0'を越えて読むので、入力の後ろにはSCAN_PADDINGバイトの読める領域が必要。 */
+
+/* isspaceなどはロケールを見に行く関数呼び出しになるので、ASCIIだけの表を使う */
+const unsigned char char_class[256] = {
+    ['\t'] = CC_SPACE, ['\n'] = CC_SPACE, ['\v'] = CC_SPACE, ['\f'] = CC_SPACE, ['\r'] = CC_SPACE, [' '] = CC_SPACE,
+    ['0' ... '9'] = CC_DIGIT | CC_IDENT,
+    ['A' ... 'Z'] = CC_IDENT,
+    ['a' ... 'z'] = CC_IDENT,
+    ['_'] = CC_IDENT,
+};
+
+typedef struct{
+    char *(*skip_space)(char *p);
+    char *(*skip_ident)(char *p);
+    char *(*find_newline)(char *p);
+    char *(*find_star)(char *p);
+    char *(*find_string_special)(char *p);
+    char *(*find_literal_start)(char *p);
+}Scanner;
+
+/* scalar */
+
+static char *skip_space_scalar(char *p){
+    while(is_space_char(*p))
+        p++;
+    return p;
+}
+
+static char *skip_ident_scalar(char *p){
+    while(is_ident_char(*p))
+        p++;
+    return p;
+}
+
+static char *find_newline_scalar(char *p){
+    while(*p && *p != '\n')
+        p++;
+    return p;
+}
+
+static char *find_star_scalar(char *p){
+    while(*p && *p != '*')
+        p++;
+    return p;
+}
+
+static char *find_string_special_scalar(char *p){
+    while(*p && *p != '"' && *p != '\\' && *p != '\n')
+        p++;
+    return p;
+}
+
+static char *find_literal_start_scalar(char *p){
+    while(*p && *p != '"' && *p != '\'' && *p != '/')
+        p++;
+    return p;
+}
+
+static const Scanner scalar_scanner = {
+    skip_space_scalar, skip_ident_scalar, find_newline_scalar, find_star_scalar, find_string_special_scalar,
+    find_literal_start_scalar,
+};
+
+#ifdef __x86_64__
+
+/* SSE2。x86-64では必ず使える。 */
+
+// lo <= x <= hiのバイトを0xffにする(符号なしで比較)
+static inline __m128i in_range16(__m128i x, char lo, char hi){
+    __m128i y = _mm_min_epu8(_mm_max_epu8(x, _mm_set1_epi8(lo)), _mm_set1_epi8(hi));
+    return _mm_cmpeq_epi8(x, y);
+}
+
+static inline __m128i is_space16(__m128i x){
+    return _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), in_range16(x, '\t', '\r'));
+}
+
+static inline __m128i is_ident16(__m128i x){
+    __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20)); // 英字を小文字にそろえる
+    __m128i m = _mm_or_si128(in_range16(lower, 'a', 'z'), in_range16(x, '0', '9'));
+    return _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('_')));
+}
+
+static inline __m128i is_byte16(__m128i x, char c){
+    return _mm_cmpeq_epi8(x, _mm_set1_epi8(c));
+}
+
+static inline __m128i load16(char *p){
+    return _mm_loadu_si128((__m128i*)p);
+}
+
+static char *skip_space_sse2(char *p){
+    for(;; p += 16){
+        unsigned m = ~_mm_movemask_epi8(is_space16(load16(p))) & 0xffff;
+        if(m)
+            return p + __builtin_ctz(m);
+    }
+}
+
+static char *skip_ident_sse2(char *p){
+    for(;; p += 16){
+        unsigned m = ~_mm_movemask_epi8(is_ident16(load16(p))) & 0xffff;
+        if(m)
+            return p + __builtin_ctz(m);
+    }
+}
+
+static char *find_newline_sse2(char *p){
+    for(;; p += 16){
+        __m128i x = load16(p);
+        unsigned m = _mm_movemask_epi8(_mm_or_si128(is_byte16(x, '\n'), is_byte16(x, '\0')));
+        if(m)
+            return p + __builtin_ctz(m);
+    }
+}
+
+static char *find_star_sse2(char *p){
+    for(;; p += 16){
+        __m128i x = load16(p);
+        unsigned m = _mm_movemask_epi8(_mm_or_si128(is_byte16(x, '*'), is_byte16(x, '\0')));
+        if(m)
+            return p + __builtin_ctz(m);
+    }
+}
+
+static char *find_string_special_sse2(char *p){
+    for(;; p += 16){
+        __m128i x = load16(p);
+        __m128i m = _mm_or_si128(is_byte16(x, '"'), is_byte16(x, '\\'));
+        m = _mm_or_si128(m, _mm_or_si128(is_byte16(x, '\n'), is_byte16(x, '\0')));
+        unsigned bits = _mm_movemask_epi8(m);
+        if(bits)
+            return p + __builtin_ctz(bits);
+    }
+}
+
+static char *find_literal_start_sse2(char *p){
+    for(;; p += 16){
+        __m128i x = load16(p);
+        __m128i m = _mm_or_si128(is_byte16(x, '"'), is_byte16(x, '\''));
+        m = _mm_or_si128(m, _mm_or_si128(is_byte16(x, '/'), is_byte16(x, '\0')));
+        unsigned bits = _mm_movemask_epi8(m);
+        if(bits)
+            return p + __builtin_ctz(bits);
+    }
+}
+
+static const Scanner sse2_scanner = {
+    skip_space_sse2, skip_ident_sse2, find_newline_sse2, find_star_sse2, find_string_special_sse2,
+    find_literal_start_sse2,
+};
+
+/* AVX2。使えるかどうかは実行時に調べる。 */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i in_range32(__m256i x, char lo, char hi){
+    __m256i y = _mm256_min_epu8(_mm256_max_epu8(x, _mm256_set1_epi8(lo)), _mm256_set1_epi8(hi));
+    return _mm256_cmpeq_epi8(x, y);
+}
+
+AVX2 static inline __m256i is_space32(__m256i x){
+    return _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), in_range32(x, '\t', '\r'));
+}
+
+AVX2 static inline __m256i is_ident32(__m256i x){
+    __m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+    __m256i m = _mm256_or_si256(in_range32(lower, 'a', 'z'), in_range32(x, '0', '9'));
+    return _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_')));
+}
+
+AVX2 static inline __m256i is_byte32(__m256i x, char c){
+    return _mm256_cmpeq_epi8(x, _mm256_set1_epi8(c));
+}
+
+AVX2 static inline __m256i load32(char *p){
+    return _mm256_loadu_si256((__m256i*)p);
+}
+
+AVX2 static char *skip_space_avx2(char *p){
+    for(;; p += 32){
+        unsigned m = ~_mm256_movemask_epi8(is_space32(load32(p)));
+        if(m)
+            return p + __builtin_ctz(m);
+    }
+}
+
+AVX2 static char *skip_ident_avx2(char *p){
+    for(;; p += 32){
+        unsigned m = ~_mm256_movemask_epi8(is_ident32(load32(p)));
+        if(m)
+            return p + __builtin_ctz(m);
+    }
+}
+
+AVX2 static char *find_newline_avx2(char *p){
+    for(;; p += 32){
+        __m256i x = load32(p);
+        unsigned m = _mm256_movemask_epi8(_mm256_or_si256(is_byte32(x, '\n'), is_byte32(x, '\0')));
+        if(m)
+            return p + __builtin_ctz(m);
+    }
+}
+
+AVX2 static char *find_star_avx2(char *p){
+    for(;; p += 32){
+        __m256i x = load32(p);
+        unsigned m = _mm256_movemask_epi8(_mm256_or_si256(is_byte32(x, '*'), is_byte32(x, '\0')));
+        if(m)
+            return p + __builtin_ctz(m);
+    }
+}
+
+AVX2 static char *find_string_special_avx2(char *p){
+    for(;; p += 32){
+        __m256i x = load32(p);
+        __m256i m = _mm256_or_si256(is_byte32(x, '"'), is_byte32(x, '\\'));
+        m = _mm256_or_si256(m, _mm256_or_si256(is_byte32(x, '\n'), is_byte32(x, '\0')));
+        unsigned bits = _mm256_movemask_epi8(m);
+        if(bits)
+            return p + __builtin_ctz(bits);
+    }
+}
+
+AVX2 static char *find_literal_start_avx2(char *p){
+    for(;; p += 32){
+        __m256i x = load32(p);
+        __m256i m = _mm256_or_si256(is_byte32(x, '"'), is_byte32(x, '\''));
+        m = _mm256_or_si256(m, _mm256_or_si256(is_byte32(x, '/'), is_byte32(x, '\0')));
+        unsigned bits = _mm256_movemask_epi8(m);
+        if(bits)
+            return p + __builtin_ctz(bits);
+    }
+}
+
+static const Scanner avx2_scanner = {
+    skip_space_avx2, skip_ident_avx2, find_newline_avx2, find_star_avx2, find_string_special_avx2,
+    find_literal_start_avx2,
+};
+
+#endif
+
+static const Scanner *scanner = &scalar_scanner;
+
+/* implまでの実装のうち、このCPUで使える最も速いものを選ぶ。選んだ実装を返す。 */
+ScanImpl scan_select(ScanImpl impl){
+#ifdef __x86_64__
+    if(impl >= SCAN_AVX2 && __builtin_cpu_supports("avx2")){
+        scanner = &avx2_scanner;
+        return SCAN_AVX2;
+    }
+    if(impl >= SCAN_SSE2){
+        scanner = &sse2_scanner;
+        return SCAN_SSE2;
+    }
+#endif
+    scanner = &scalar_scanner;
+    return SCAN_SCALAR;
+}
+
+/* 空白でない最初の文字 */
+char *skip_space(char *p){
+    return scanner -> skip_space(p);
+}
+
+/* 識別子に使える文字(英数字と_)が続く最後の次 */
+char *skip_ident(char *p){
+    return scanner -> skip_ident(p);
+}
+
+/* 最初の'\n'か、なければ終端の'\0' */
+char *find_newline(char *p){
+    return scanner -> find_newline(p);
+}
+
+// 最初の*/。なければNULL
+char *find_comment_end(char *p){
+    for(;;){
+        p = scanner -> find_star(p);
+        if(!*p)
+            return NULL;
+        if(p[1] == '/')
+            return p;
+        p++;
+    }
+}
+
+/* 行コメントの終わりの'\n'か、なければ終端の'\0'。\と改行で続いている行もコメントに含める */
+char *find_line_comment_end(char *p){
+    for(;;){
+        p = scanner -> find_newline(p);
+        if(!*p || p[-1] != '\\')
+            return p;
+        p++;
+    }
+}
+
+/* 最初の'"'か'\\'か'\n'。なければ終端の'\0'。文字列リテラルは行をまたがない */
+char *find_string_special(char *p){
+    return scanner -> find_string_special(p);
+}
+
+/* コメントか文字列リテラル、文字リテラルの始まりになりうる最初の文字('"', '\'', '/')。なければ終端の'\0' */
+char *find_literal_start(char *p){
+    return scanner -> find_literal_start(p);
+}
@@ -0,0 +1,175 @@
+#define _GNU_SOURCE // MSG_NOSIGNALのため
+#include "9cc.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*  9cc --server SOCKET。Unixドメインソケットで待ち受けて、クライアント(9cc-client)から送られたソースをコンパイルして返す。
+    プロセスを起動し直さないので、実行ファイルのページ、mallocのアリーナ、--cacheのキャッシュの状態が次のコンパイルまで残る。
+    nthreads個のスレッドがそれぞれacceptし、接続が閉じられるまでその接続の要求を順に処理する。
+    --include-pchのイメージは一度読んだら残しておき、同じイメージを使う要求の間で共有する。
+    9cc --server --include-pch IMAGEなら、最初の要求を待たずにIMAGEを読んでおく。
+    プロトコルはRequestとその後の文字列とソース、Responseとその後の出力とメッセージ。 */
+
+static int listen_fd;
+
+static bool read_full(int fd, void *buf, size_t len){
+    for(char *p = buf; len;){
+        ssize_t n = read(fd, p, len);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, void *buf, size_t len){
+    for(char *p = buf; len;){
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL); // クライアントが先に閉じてもSIGPIPEで落ちないように
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* 一つの要求を読んでコンパイルし、結果を返す。接続が閉じられたか壊れた要求ならfalse */
+static bool handle_request(int fd){
+    Request req;
+    if(!read_full(fd, &req, sizeof(req)) || req.magic != REQUEST_MAGIC)
+        return false;
+    /* 長さはクライアントが送ってきたものなので、確保する前に確かめる。-Iのディレクトリは一つ1バイト以上ある */
+    if(req.strings_len > REQUEST_MAX_STRINGS || req.src_len > REQUEST_MAX_SRC || req.ninclude_paths > req.strings_len)
+        return false;
+
+    /* cwd、--include-pchのイメージ、-Iのディレクトリ、pathをNUL区切りで並べたもの */
+    char *strings = malloc(req.strings_len + 1);
+    char *src = malloc(req.src_len + 1);
+    if(!strings || !src){
+        free(strings);
+        free(src);
+        return false;
+    }
+    bool ok = read_full(fd, strings, req.strings_len) && read_full(fd, src, req.src_len);
+    strings[req.strings_len] = '\0';
+
+    CompileOptions opts = {.emit_object = req.emit_object, .dir_fd = -1};
+    char *p = strings;
+    char *cwd = p;
+    p += strlen(p) + 1;
+    if(req.include_pch){
+        ok = ok && p < strings + req.strings_len;
+        opts.include_pch = p;
+        p += strlen(p) + 1;
+    }
+    for(int i = 0; ok && i < req.ninclude_paths; i++){
+        ok = ok && p < strings + req.strings_len;
+        add_include_path(&opts, p);
+        p += strlen(p) + 1;
+    }
+    char *path = p;
+    ok = ok && p < strings + req.strings_len;
+
+    if(ok){
+        opts.dir_fd = open(cwd, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        CompileResult res = {};
+        Response resp = {};
+        if(opts.dir_fd == -1){
+            resp.ok = false;
+            buf_append(&res.diag, cwd, strlen(cwd));
+            buf_append(&res.diag, ": ", 2);
+            buf_append(&res.diag, strerror(errno), strlen(strerror(errno)));
+            buf_append(&res.diag, "\n", 1);
+        }else{
+            resp.ok = compile_with(&opts, path, src, req.src_len, &res);
+            close(opts.dir_fd);
+        }
+        resp.out_len = res.out.len;
+        resp.diag_len = res.diag.len;
+        ok = write_full(fd, &resp, sizeof(resp)) && write_full(fd, res.out.data, res.out.len) &&
+             write_full(fd, res.diag.data, res.diag.len);
+        free_result(&res);
+    }
+
+    free(opts.include_paths);
+    free(strings);
+    free(src);
+    return ok;
+}
+
+static void *server_worker(void *arg){
+    for(;;){
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(fd == -1){
+            if(errno == EINTR || errno == ECONNABORTED || errno == EMFILE)
+                continue;
+            perror("accept");
+            exit(EXIT_FAILURE);
+        }
+        while(handle_request(fd))
+            ;
+        close(fd);
+    }
+}
+
+/* compile_options.include_pchのイメージを読んで残しておく。読めなければエラーを表示して終わる */
+static void preload_pch(void){
+    CompileResult res = {};
+    if(!compile_with(&compile_options, "-", "", 0, &res)){
+        fwrite(res.diag.data, 1, res.diag.len, ERROR);
+        exit(EXIT_FAILURE);
+    }
+    free_result(&res);
+}
+
+/*  cacheなら--cacheのキャッシュを使う。SIGINTかSIGTERMでソケットを消し、stats_printならキャッシュの統計を表示して終わる。戻らない */
+noreturn void serve(char *socket_path, int nthreads, char *cache, bool stats_print){
+    pch_share_images = true;
+    if(compile_options.include_pch)
+        preload_pch(); // キャッシュを使う前なので、空のソースの結果はキャッシュに入らない
+    if(cache)
+        cache_init(cache);
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if(strlen(socket_path) >= sizeof(addr.sun_path)){
+        fprintf(ERROR, "%s: socket path too long\n", socket_path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(socket_path); // 前に落ちたサーバのソケットが残っていれば消す
+    if(listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, 128) == -1){
+        fprintf(ERROR, "%s: %s\n", socket_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* 作ったスレッドにシグナルを届けず、このスレッドだけでsigwaitする */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for(int i = 0; i < nthreads; i++){
+        pthread_t thread;
+        pthread_create(&thread, NULL, server_worker, NULL);
+        pthread_detach(thread);
+    }
+
+    int sig;
+    sigwait(&set, &sig);
+    unlink(socket_path);
+    if(cache_dir)
+        cache_finish(stats_print);
+    exit(0);
+}
@@ -42,6 +42,9 @@ int main() {
     ASSERT(4, ({ char x[(unsigned long)-1/((long)1<<62)+1]; sizeof(x); }));
     ASSERT(1, ({ char x[(unsigned)1<-1]; sizeof(x); }));
     ASSERT(1, ({ char x[(unsigned)1<=-1]; sizeof(x); }));
+    ASSERT(1, ({ char x[-1<0]; sizeof(x); }));
+    ASSERT(1, ({ char x[0>-1]; sizeof(x); }));
+    ASSERT(1, ({ char x[(short)-1<0]; sizeof(x); }));
 
     printf("OK\n");
     return 0;
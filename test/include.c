@@ -0,0 +1,22 @@
+#include "test.h"
+
+#define HDR1 "include1.h"
+
+int main(){
+    int guard = 0;
+    int once = 0;
+
+#include "include1.h"
+#include "./include1.h"
+#include "../test/include1.h"
+#include HDR1
+    ASSERT(1, guard);
+
+#include "include2.h"
+#include "./include2.h"
+#include "../test/include2.h"
+    ASSERT(1, once);
+
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,5 @@
+// 通常のインクルードガード。綴りの違うパスから読んでも一度しか展開されない
+#ifndef INCLUDE1_H
+#define INCLUDE1_H
+guard++;
+#endif
@@ -0,0 +1,3 @@
+// #pragma onceも同じファイルなら綴りが違っても一度だけ読む
+#pragma once
+once++;
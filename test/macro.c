@@ -0,0 +1,115 @@
+#include "test.h"
+
+int add_all(int n, ...);
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+#define CAT(x, y) x ## y
+#define XCAT(x, y) CAT(x, y)
+#define TWICE(x) ((x) + (x))
+#define ALL(...) add_all(__VA_ARGS__)
+#define COUNT(n, ...) add_all(n, ## __VA_ARGS__)
+#define FIRST(x, ...) x
+#define LINE() __LINE__
+#define ONE 1
+#define EMPTY
+
+/* 選ばれない枝はトークンにしない。閉じられていないリテラルがあってもよい */
+#if 0
+don't
+"unterminated
+#if 1
+#error nested group must be skipped
+#endif
+/* a comment hiding
+#endif
+*/
+#elif ONE + 1 == 2
+int elif1 = 1;
+#else
+int elif1 = 0;
+#endif
+
+#if 1 + 2 * 3 == 7 && 10 / 3 == 3 && 10 % 3 == 1 && (1 << 4) == 16 && -1 < 0 && (ONE ? 2 : 3) == 2
+int arith1 = 1;
+#else
+int arith1 = 0;
+#endif
+
+#if UNDEFINED_NAME == 0 && defined(ONE) && defined ONE && !defined(UNDEFINED_NAME)
+int defined1 = 1;
+#else
+int defined1 = 0;
+#endif
+
+#define N 5
+#if N > 10
+int elif2 = 1;
+#elif N > 3
+int elif2 = 2;
+#elif N > 1
+int elif2 = 3;
+#else
+int elif2 = 4;
+#endif
+
+#ifdef ONE
+int ifdef1 = 1;
+#endif
+#ifndef ONE
+int ifdef1 = 0;
+#endif
+
+#undef N
+#ifdef N
+int undef1 = 0;
+#else
+int undef1 = 1;
+#endif
+
+int main() {
+    ASSERT(0, strcmp(STR(a + b), "a + b"));
+    ASSERT(0, strcmp(STR("q\n"), "\"q\\n\""));
+    ASSERT(0, strcmp(STR('a'), "'a'"));
+    ASSERT(0, strcmp(XSTR(ONE), "1"));
+    ASSERT(0, strcmp(STR(ONE), "ONE"));
+
+    int CAT(var, 1) = 5;
+    ASSERT(5, var1);
+    ASSERT(12, CAT(1, 2));
+    ASSERT(5, XCAT(var, ONE));
+    ASSERT(3, CAT(, 3));
+    ASSERT(6, TWICE(TWICE(1) + ONE));
+
+    ASSERT(6, ALL(3, 1, 2, 3));
+    ASSERT(0, COUNT(0));
+    ASSERT(7, COUNT(2, 3, 4));
+    ASSERT(4, FIRST(4, 5, 6));
+    ASSERT(4, FIRST(4));
+    ASSERT(1, EMPTY ONE EMPTY);
+
+    ASSERT(1, elif1);
+    ASSERT(1, arith1);
+    ASSERT(1, defined1);
+    ASSERT(2, elif2);
+    ASSERT(1, ifdef1);
+    ASSERT(1, undef1);
+
+    ASSERT(98, __LINE__);
+    ASSERT(99, TWICE(__LINE__) / 2);
+    ASSERT(100, LINE());
+    ASSERT(0, strcmp(XSTR(__LINE__), "101"));
+    ASSERT(0, strcmp(STR(__LINE__), "__LINE__"));
+    ASSERT(0, strcmp(__FILE__, "test/macro.c"));
+    ASSERT(0, strcmp(FIRST(__FILE__), "test/macro.c"));
+#if __LINE__ != 105
+    ASSERT(0, 1);
+#endif
+
+    int x = 1; // a line comment continues \
+    x = 2;
+    ASSERT(1, x);
+
+    printf("OK\n");
+    return 0;
+}
@@ -1,81 +1,131 @@
 #include "9cc.h"
+#include <sched.h>
+
+/* エラーメッセージはctx -> diagに溜める */
+static int diag_vprintf(char *fmt, va_list ap){
+    va_list ap2;
+    va_copy(ap2, ap);
+    char buf[1024];
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    if(len < (int)sizeof(buf)){
+        buf_append(&ctx -> diag, buf, len);
+    }else{
+        char *p = malloc(len + 1); // エラーの行が長い場合
+        vsnprintf(p, len + 1, fmt, ap2);
+        buf_append(&ctx -> diag, p, len);
+        free(p);
+    }
+    va_end(ap2);
+    return len;
+}
 
-static char *current_path;
-static char *current_input;
+static int diag_printf(char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    int len = diag_vprintf(fmt, ap);
+    va_end(ap);
+    return len;
+}
 
-/* エラー表示用の関数 */
-void error(char *fmt, ...){
-  va_list ap;
-  va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
-  exit(1);
+/*  エラー表示用の関数。メッセージを残してcompile()に戻る。プロセスは終了しない。 */
+noreturn void error(char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    diag_vprintf(fmt, ap);
+    va_end(ap);
+    diag_printf("\n");
+    longjmp(ctx -> jmp, 1);
 }
 
-/* エラー表示用の関数 */
-void error_at(char *loc, char* fmt, ...){
+/* エラー表示用の関数。locを含むファイルの名前と行を表示する。 */
+noreturn void error_at(char *loc, char* fmt, ...){
     va_list ap;
     va_start(ap, fmt);
+
+    char *input = ctx -> input;
+    char *path = ctx -> path;
+    File *file = find_file(loc);
+    if(file){
+        input = file -> contents;
+        path = file -> name;
+    }else if(loc < input || input + strlen(input) < loc){
+        /* #や##で作ったトークンなど、どのファイルにもない位置 */
+        diag_printf("%s: ", path);
+        diag_vprintf(fmt, ap);
+        va_end(ap);
+        diag_printf("\n");
+        longjmp(ctx -> jmp, 1);
+    }
+
     char *start = loc;
     /* locが含まれる行の開始地点と終了地点を取得 */
-    while(current_input < start && start[-1] != '\n'){
+    while(input < start && start[-1] != '\n'){
         start--;
     }
     char *end = loc;
-    while(*end != '\n'){
+    while(*end && *end != '\n'){ // EOFの位置は\0を指している
         end++;
     }
 
     int line_num = 1;
 
     /* pointerをstartまで移動。\nが出てくるたびにline_numを更新 */
-    for(char *p = current_input; p < start; p++){
+    for(char *p = input; p < start; p++){
         if(*p == '\n'){
             line_num++;
         }
     }
 
     /* エラーメッセージを表示 */
-    int indent = fprintf(stderr, "%s:%d: ", current_path, line_num);
-    fprintf(ERROR, "%.*s\n", (int)(end - start), start);
+    int indent = diag_printf("%s:%d: ", path, line_num);
+    diag_printf("%.*s\n", (int)(end - start), start);
 
     int pos = loc - start + indent; // ポインタの引き算は要素数を返す。
-    fprintf(ERROR, "%*s", pos, " "); // pos個の空白を表示
-    fprintf(ERROR, "^ ");
-    vfprintf(ERROR, fmt, ap); 
-    fprintf(ERROR, "\n");
-    exit(1);
+    diag_printf("%*s", pos, " "); // pos個の空白を表示
+    diag_printf("^ ");
+    diag_vprintf(fmt, ap); 
+    va_end(ap);
+    diag_printf("\n");
+    longjmp(ctx -> jmp, 1);
 }
 
 /* Token操作用の関数 */
 bool is_ident(void){
-    return token -> kind == TK_IDENT;
+    return ctx -> token -> kind == TK_IDENT;
 }
 
 bool is_str(void){
-    return token -> kind == TK_STR;
+    return ctx -> token -> kind == TK_STR;
 }
 
 /* TK_EOF用。トークンがEOFかどうかを返す。*/
 bool at_eof(void){
-    return token -> kind == TK_EOF;
+    return ctx -> token -> kind == TK_EOF;
 }
 
-/* 次のトークンを読む。(tokenを更新するのはこの関数のみ) */
+/* 次のトークンを読む。 */
 void next_token(void){
-    token = token -> next;
+    ctx -> token = next_of(ctx -> token);
 }
 
+/* 2文字以上の区切り文字とキーワードの綴り。TokenIdの順番と一致させること。 */
+static char *id_str[] = {
+    "==", "!=", "<=", ">=", "->", "<<=", ">>=", "+=", "-=", "*=", "/=", "%=", "|=", "^=", "&=",
+    "++", "--", "||", "&&", "<<", ">>", "...", "##",
+    "return", "if", "else", "while", "for", "int", "sizeof", "char", "struct", "union", "long",
+    "short", "void", "typedef", "_Bool", "enum", "static", "goto", "break", "continue", "switch",
+    "case", "default", "extern", "_Alignas", "_Alignof", "do", "signed", "unsigned", "const",
+    "volatile", "auto", "register", "restrict", "__restrict", "__restrict__", "_Noreturn"
+};
+
 /* トークンの記号が期待したもののときtrue。それ以外の時false */
-bool is_equal(Token *tok, char *op){
-    if(strlen(op) != tok -> len || strncmp(op, tok -> str, tok -> len))
-        return false;
-    return true;
+bool is_equal(Token *tok, int id){
+    return tok -> id == id;
 }
 
 /* トークンが期待した記号のときはトークンを読み進めて真を返す。それ以外のときは偽を返す。*/
-bool consume(char* op){
-    if(is_equal(token, op)){
+bool consume(int id){
+    if(ctx -> token -> id == id){
         next_token();
         return true;
     }
@@ -83,18 +133,23 @@ bool consume(char* op){
 }
 
 /* トークンが期待した記号の時はトークンを読み進めて真を返す。それ以外の時にエラー */
-void expect(char* op){
-    if(!is_equal(token, op))
-        error_at(token->str, "%sではありません\n", op);
+void expect(int id){
+    if(ctx -> token -> id != id){
+        if(id < PUNCT_EQ)
+            error_at(ctx -> token->str, "%cではありません\n", id);
+        error_at(ctx -> token->str, "%sではありません\n", id_str[id - PUNCT_EQ]);
+    }
     next_token();
 }
 
 /* 新しいtokenを作成する */
 static Token* new_token(TokenKind kind, char *start, char *end){
-    Token* tok = calloc(1, sizeof(Token));
+    Arena *arena = ctx -> lex_arena ? ctx -> lex_arena : &ctx -> token_window[ctx -> cur_window];
+    Token* tok = arena_alloc(arena, sizeof(Token));
     tok -> kind = kind;
     tok -> str = start;
     tok -> len = end - start;
+    tok -> round = ctx -> lex_round;
     return tok;
 }
 
@@ -103,35 +158,156 @@ static bool startswith(char* p1, char* p2){
     return strncmp(p1, p2, strlen(p2)) == 0;
 }
 
-static bool is_keyword(Token *tok){
-    static char* kw[] = {"return", "if", "else", "while", "for", "int", "sizeof", "char", "struct", "union", "long", "short", "void", "typedef", "_Bool", "enum", "static", "goto", "break", "continue", "switch", "case", "default", "extern", "_Alignas", "_Alignof", "do", "signed", "unsigned", "const", "volatile", "auto", "register", "restrict", "__restrict", "__restrict__", "_Noreturn"};
-    for(int i =0; i < sizeof(kw) / sizeof(*kw); i++){
-        if(is_equal(tok, kw[i])){
-            return true;
-        }
+/* 識別子がキーワードならそのIDを、そうでなければ0を返す。先頭の文字で候補を絞ってから長さと中身を比較する。 */
+static int keyword_id(char *p, int len){
+#define KW(s, id) if(len == sizeof(s) - 1 && !memcmp(p, s, len)) return id
+    switch(*p){
+        case 'a':
+            KW("auto", KW_AUTO);
+            break;
+        case 'b':
+            KW("break", KW_BREAK);
+            break;
+        case 'c':
+            KW("char", KW_CHAR);
+            KW("case", KW_CASE);
+            KW("continue", KW_CONTINUE);
+            KW("const", KW_CONST);
+            break;
+        case 'd':
+            KW("default", KW_DEFAULT);
+            KW("do", KW_DO);
+            break;
+        case 'e':
+            KW("else", KW_ELSE);
+            KW("enum", KW_ENUM);
+            KW("extern", KW_EXTERN);
+            break;
+        case 'f':
+            KW("for", KW_FOR);
+            break;
+        case 'g':
+            KW("goto", KW_GOTO);
+            break;
+        case 'i':
+            KW("if", KW_IF);
+            KW("int", KW_INT);
+            break;
+        case 'l':
+            KW("long", KW_LONG);
+            break;
+        case 'r':
+            KW("return", KW_RETURN);
+            KW("register", KW_REGISTER);
+            KW("restrict", KW_RESTRICT);
+            break;
+        case 's':
+            KW("sizeof", KW_SIZEOF);
+            KW("struct", KW_STRUCT);
+            KW("short", KW_SHORT);
+            KW("static", KW_STATIC);
+            KW("switch", KW_SWITCH);
+            KW("signed", KW_SIGNED);
+            break;
+        case 't':
+            KW("typedef", KW_TYPEDEF);
+            break;
+        case 'u':
+            KW("union", KW_UNION);
+            KW("unsigned", KW_UNSIGNED);
+            break;
+        case 'v':
+            KW("void", KW_VOID);
+            KW("volatile", KW_VOLATILE);
+            break;
+        case 'w':
+            KW("while", KW_WHILE);
+            break;
+        case '_':
+            KW("_Bool", KW_BOOL);
+            KW("_Alignas", KW_ALIGNAS);
+            KW("_Alignof", KW_ALIGNOF);
+            KW("_Noreturn", KW_NORETURN);
+            KW("__restrict", KW_RESTRICT2);
+            KW("__restrict__", KW_RESTRICT3);
+            break;
     }
-    return false;
+    return 0;
+#undef KW
 }
 
-/* 区切り文字だった場合長さを返す */
-static int read_puct(char *p){
-    static char* kw[] = {"==", "!=", "<=", ">=", "->", "<<=", ">>=", "+=", "-=", "*=", "/=", "++", "--", "%=", "|=", "^=", "&=", "||", "&&", "<<", ">>", "..."};
-    for(int i =0; i < sizeof(kw) / sizeof(*kw); i++){
-        if(startswith(p, kw[i])){
-            return strlen(kw[i]);
-        }
+/* 区切り文字だった場合IDを返し、*lenに長さをセットする。最長一致。 */
+static int read_puct(char *p, int *len){
+    *len = 2;
+    switch(*p){
+        case '=':
+            if(p[1] == '=') return PUNCT_EQ;
+            break;
+        case '!':
+            if(p[1] == '=') return PUNCT_NE;
+            break;
+        case '*':
+            if(p[1] == '=') return PUNCT_MUL_ASSIGN;
+            break;
+        case '/':
+            if(p[1] == '=') return PUNCT_DIV_ASSIGN;
+            break;
+        case '%':
+            if(p[1] == '=') return PUNCT_MOD_ASSIGN;
+            break;
+        case '^':
+            if(p[1] == '=') return PUNCT_XOR_ASSIGN;
+            break;
+        case '<':
+            if(p[1] == '<'){
+                if(p[2] == '='){
+                    *len = 3;
+                    return PUNCT_SHL_ASSIGN;
+                }
+                return PUNCT_SHL;
+            }
+            if(p[1] == '=') return PUNCT_LE;
+            break;
+        case '>':
+            if(p[1] == '>'){
+                if(p[2] == '='){
+                    *len = 3;
+                    return PUNCT_SHR_ASSIGN;
+                }
+                return PUNCT_SHR;
+            }
+            if(p[1] == '=') return PUNCT_GE;
+            break;
+        case '+':
+            if(p[1] == '=') return PUNCT_ADD_ASSIGN;
+            if(p[1] == '+') return PUNCT_INC;
+            break;
+        case '-':
+            if(p[1] == '=') return PUNCT_SUB_ASSIGN;
+            if(p[1] == '-') return PUNCT_DEC;
+            if(p[1] == '>') return PUNCT_ARROW;
+            break;
+        case '|':
+            if(p[1] == '=') return PUNCT_OR_ASSIGN;
+            if(p[1] == '|') return PUNCT_LOGOR;
+            break;
+        case '&':
+            if(p[1] == '=') return PUNCT_AND_ASSIGN;
+            if(p[1] == '&') return PUNCT_LOGAND;
+            break;
+        case '#':
+            if(p[1] == '#') return PUNCT_HASHHASH;
+            break;
+        case '.':
+            if(p[1] == '.' && p[2] == '.'){
+                *len = 3;
+                return PUNCT_ELLIPSIS;
+            }
+            break;
     }
     // +-*/()<>;={},&[].!~%^|:?
-    return ispunct(*p) ? 1 : 0;
-}
-
-/* int_to_charのような識別子を受け取れる様にするため、取り合えずTK_IDENTにしておいて後で種類を編集する */
-static void convert_keywords(Token *head){
-    for(Token *tok = head; tok -> kind != TK_EOF; tok = tok -> next){
-        if(is_keyword(tok)){
-            tok -> kind = TK_KEYWORD;
-        }
-    }
+    *len = ispunct(*p) ? 1 : 0;
+    return *p;
 }
 
 /* 1桁の16進数を10進数に変換 */
@@ -188,18 +364,30 @@ static int read_escaped_char(char **pos, char *p){
     }
 }
 
+/* 文字列リテラルの閉じる'"'。行の終わりまでに閉じられていなければNULL */
 static char *string_literal_end(char *p){
-    for(; *p != '"'; p++){
-        if(*p == '\\')
-            p++;
+    for(;;){
+        p = find_string_special(p);
+        if(*p == '"')
+            return p;
+        if(*p != '\\' || !p[1])
+            return NULL;
+        p += 2; // '\\'と次の文字を読み飛ばす
     }
-    return p;
+}
+
+/*  閉じられていない文字列リテラルか文字リテラル。引用符だけのTK_INVALIDにして続きを字句解析する。
+    読み飛ばす#ifの中などでは問題ないので、エラーはパーサに渡す時にする */
+static Token *unclosed_literal(char *start){
+    return new_token(TK_INVALID, start, start + 1);
 }
 
 /* buf[len++]は代入した後インクリメントされる。*p++は参照した後にインクリメントされる。 */
 static Token *read_string_literal(char *start){
     char *end = string_literal_end(start + 1);
-    char *buf = calloc(1, end - start); // ""の中の長さ+1
+    if(!end)
+        return unclosed_literal(start);
+    char *buf = arena_alloc(&ctx -> token_arena, end - start); // ""の中の長さ+1
     int len = 0;
     for(char *p = start + 1; p < end;){
         if(*p == '\\')
@@ -209,7 +397,7 @@ static Token *read_string_literal(char *start){
     }
     Token *tok = new_token(TK_STR, start, end + 1); // ""を含めた長さ(トークンの長さ)
     tok -> ty = array_of(ty_char, len + 1); // NULL文字分+1
-    tok -> str = buf; // bufに保存されるのは""の中のみ  
+    tok -> data = buf; // bufに保存されるのは""の中のみ  
     return tok;
 }
 
@@ -217,15 +405,19 @@ static Token *read_char_literal(char *start){
     char *p = start + 1;
 
     char c;
+    if(*p == '\n' || !*p || (*p == '\\' && !p[1]))
+        return unclosed_literal(start);
     if(*p == '\\')
         c = read_escaped_char(&p, p + 1);
     else
         c = *p++;
 
-    char *end = strchr(p, '\''); // 8進数として3桁以上指定されている可能性があるのでstrchrで無視する。
-    if(!end){
-        error_at(start, "unclosed char literal\n");
-    }
+    /* 8進数として3桁以上指定されている可能性があるので、その行の次の'\''までを無視する */
+    char *end = p;
+    while(*end && *end != '\'' && *end != '\n')
+        end++;
+    if(*end != '\'')
+        return unclosed_literal(start);
     Token *tok = new_token(TK_NUM, start, end + 1);
     tok -> val = c;
     tok -> ty = ty_int;
@@ -307,91 +499,448 @@ static Token* read_int_literal(char *p){
     return tok;
 }
 
-/* 入力文字列をトークナイズしてそれを返す */
-void tokenize(char *path, char* p){
-    Token head; /* これは無駄になるがスタック領域なのでオーバーヘッドは0に等しい */
-    Token* cur = &head;
-
-    current_path = path;
-    current_input = p;
+/*  入力を1トークン分読んで返す。トークンはパーサが要求した時点で作られる。
+    入力の最後ではTK_EOFを返す。 */
+static Token *lex(void){
+    char *p = ctx -> lex_pos;
+    Token *tok;
+    bool bol = ctx -> lex_bol;
+
+    for(;;){
+        /* spaceだった場合は無視。改行を含んでいれば次のトークンは行頭 */
+        if(is_space_char(*p)){
+            bol |= *p++ == '\n';
+            if(is_space_char(*p)){
+                char *q = skip_space(p); // 1文字だけの空白が多いので、続いているときだけ呼ぶ
+                if(!bol)
+                    bol = memchr(p, '\n', q - p) != NULL; // 改行の後の字下げなら探さなくてよい
+                p = q;
+            }
+            continue;
+        }
 
-    while(*p){
-        /* is~関数は偽のときに0を、真の時に0以外を返す。*/
-        /* spaceだった場合は無視。 */
-        if(isspace(*p)){
-            p++;
+        /* 行の継続(\と改行)は空白と同じ。次のトークンは行頭にならない */
+        if(p[0] == '\\' && p[1] == '\n'){
+            p += 2;
             continue;
         }
 
         /* 行コメントをスキップ */
-        if(strncmp(p, "//", 2) == 0){
-            p += 2;
-            while(*p != '\n'){
-                p++;
-            }
+        if(p[0] == '/' && p[1] == '/'){
+            p = find_line_comment_end(p + 2);
             continue;
         }
 
         /* ブロックコメントをスキップ */
-        if(strncmp(p, "/*", 2) == 0) {
-            char *q = strstr(p + 2, "*/");
+        if(p[0] == '/' && p[1] == '*') {
+            char *q = find_comment_end(p + 2);
             if (!q)
                 error_at(p, "コメントが閉じられていません");
             p = q + 2;
             continue;
         }
+        break;
+    }
 
-        /* 数値だった場合 */
-        if(isdigit(*p)){
-            cur = cur -> next = read_int_literal(p);
-            p += cur -> len;
-            continue;
+    /* 終了を表すトークンを作成。チャンクを字句解析するタスクではチャンクの終わりでも作る。 */
+    if(!*p || (ctx -> lex_end && p >= ctx -> lex_end)){
+        tok = new_token(TK_EOF, p, p);
+    }
+
+    /* 数値だった場合 */
+    else if(is_digit_char(*p)){
+        tok = read_int_literal(p);
+    }
+
+    else if(*p == '\''){
+        tok = read_char_literal(p);
+    }
+
+    /* 文字列リテラルの場合 */
+    else if(*p == '"'){
+        tok = read_string_literal(p);
+    }
+
+    /* 識別子かキーワード(数字が使用される可能性もあることに注意。) */
+    else if(is_ident_char(*p)){
+        char *q = skip_ident(p + 1);
+        int id = keyword_id(p, q - p);
+        tok = new_token(id ? TK_KEYWORD : TK_IDENT, p, q);
+        tok -> id = id;
+        if(!id)
+            tok -> name = intern(p, q - p);
+    }
+
+    /* puctuators */
+    else{
+        int punct_len;
+        int id = read_puct(p, &punct_len);
+        if(!punct_len)
+            error_at(p, "トークナイズできません\n");
+        tok = new_token(TK_PUNCT, p, p + punct_len);
+        tok -> id = id;
+    }
+
+    tok -> at_bol = bol;
+    tok -> has_space = p != ctx -> lex_pos;
+    ctx -> lex_pos = p + tok -> len;
+    ctx -> lex_bol = false;
+    return tok;
+}
+
+/*  以下は大きな入力を並列に字句解析するためのもの。
+    入力をLEX_CHUNKバイトほどのチャンクに区切り、パーサが最後のトークンまで読んだらlex_threads個のチャンクを
+    まとめて別々のスレッドで字句解析し、チャンクごとのトークンのリストをつなげる。
+    区切りは必ずコメント、文字列リテラル、文字リテラルの外の改行の直後なので、どのチャンクも逐次の字句解析と同じ状態から始まる。 */
+
+#ifndef LEX_CHUNK
+#define LEX_CHUNK (256 * 1024) // 小さくして区切りのテストをするため-Dで変えられる
+#endif
+
+int lex_threads = 1;
+
+struct LexRound{
+    LexRound *next;
+    int id;
+    Arena tokens;
+};
+
+typedef struct{
+    char *start;
+    char *end; // 次のチャンクの先頭。最後のチャンクならNULL
+    Token head;
+    Token *tail;
+    char *resume; // エラーが起きた場合、そのトークンの位置。成功すればNULL
+    bool resume_bol; // resumeから読むトークンが行頭か
+    Arena tokens;
+    Arena strings; // 文字列リテラルとinternした名前
+    Arena types; // 文字列リテラルの型
+}Chunk;
+
+typedef struct{
+    Compiler *parent;
+    Chunk *chunks;
+}LexJob;
+
+/* 文字列リテラルの次。字句解析と同じく、閉じられていなければ'"'だけを読み飛ばす */
+char *skip_string(char *p){
+    char *end = string_literal_end(p + 1);
+    return end ? end + 1 : p + 1;
+}
+
+/* 文字リテラルの次。read_char_literalと同じく、1文字(エスケープなら\と次の文字)の後のその行の最初の'\'' */
+char *skip_char(char *p){
+    char *q = p + 1;
+    if(*q == '\\')
+        q++;
+    if(!*q || (*q == '\n' && q == p + 1))
+        return p + 1;
+    for(q++; *q && *q != '\'' && *q != '\n'; q++)
+        ;
+    return *q == '\'' ? q + 1 : p + 1;
+}
+
+static void add_bound(char *p){
+    if(ctx -> lex_nchunks % 64 == 0)
+        ctx -> lex_bounds = realloc(ctx -> lex_bounds, (ctx -> lex_nchunks + 65) * sizeof(char *));
+    ctx -> lex_bounds[ctx -> lex_nchunks++] = p;
+}
+
+/*  入力をチャンクに区切る。コメントやリテラルの中かどうかは先頭から順に追うしかないが、
+    '"', '\'', '/'の間は読み飛ばせるので字句解析よりずっと速い。
+    閉じられていないコメントがあればそこで区切るのをやめる。エラーは逐次の字句解析で報告される。
+    リテラルは行をまたがないので、閉じられていなければ字句解析と同じく引用符だけを読み飛ばす。 */
+static void split_input(char *p){
+    add_bound(p);
+    char *target = p + LEX_CHUNK;
+    for(;;){
+        char *q = find_literal_start(p);
+
+        // [p, q)はコメントやリテラルの外
+        while(target < q){
+            char *nl = find_newline(MAX(p, target));
+            if(nl >= q || !*nl)
+                break;
+            if(nl[-1] == '\\'){
+                target = nl + 1; // 行が続いているので、次の行はディレクティブの途中かもしれない
+                continue;
+            }
+            add_bound(nl + 1);
+            target = nl + 1 + LEX_CHUNK;
         }
 
-        if(*p == '\''){
-            cur = cur -> next = read_char_literal(p);
-            p += cur -> len;
-            continue;
+        if(!*q)
+            break;
+        if(*q == '"'){
+            p = skip_string(q);
+        }else if(*q == '\''){
+            p = skip_char(q);
+        }else if(q[1] == '/'){
+            p = find_line_comment_end(q + 2); // 改行は区切りになりうるので飛ばさない
+        }else if(q[1] == '*'){
+            q = find_comment_end(q + 2);
+            p = q ? q + 2 : NULL;
+        }else{
+            p = q + 1; // 割り算
         }
+        if(!p)
+            break;
+    }
+    add_bound(NULL); // 最後のチャンクの終わり
+    ctx -> lex_nchunks--;
+}
 
-        /* 文字列リテラルの場合 */
-        if(*p == '"'){
-            cur = cur -> next = read_string_literal(p);
-            p += cur -> len;
-            continue;
+/* チャンクを一つ字句解析するタスク。ctxはタスク用のCompilerにして、トークンと文字列はタスクのアリーナに確保する。 */
+static void lex_chunk(int i, void *arg){
+    LexJob *job = arg;
+    Chunk *ch = &job -> chunks[i];
+    Compiler c = {
+        .path = job -> parent -> path,
+        .input = job -> parent -> input,
+        .atoms = job -> parent -> atoms,
+        .pch = job -> parent -> pch,
+        .lex_round = job -> parent -> lex_round,
+        .lex_pos = ch -> start,
+        .lex_end = ch -> end,
+        .lex_bol = true, // チャンクは改行の直後から始まる
+    };
+    Compiler *saved = ctx;
+    ctx = &c;
+
+    ch -> tail = &ch -> head;
+    if(!setjmp(c.jmp)){
+        for(;;){
+            Token *tok = lex();
+            if(tok -> kind == TK_EOF && ch -> end)
+                break;
+            ch -> tail = ch -> tail -> next = tok;
+            if(tok -> kind == TK_EOF)
+                break;
         }
+    }else{
+        ch -> resume = c.lex_pos; // このトークンから逐次に字句解析すれば同じエラーになる
+        ch -> resume_bol = c.lex_bol;
+        free(c.diag.data);
+    }
 
-        /* ローカル変数の場合(数字が使用される可能性もあることに注意。) */
-        if(isalnum(*p) || *p == '_'){
-            cur = cur -> next = new_token(TK_IDENT, p, p);
-            char *q = p;
-            while(isalnum(*p) || *p == '_'){
-                p++;
-            }
-            cur -> len = p - q; /* 長さを記録 */
-            
-            continue;
+    ch -> tokens = c.token_window[0];
+    ch -> strings = c.token_arena;
+    ch -> types = c.type_arena;
+    hashmap_free(&c.type_table);
+    ctx = saved;
+}
+
+/*  次のlex_threads個のチャンクを並列に字句解析し、つなげたリストの先頭を返す。
+    エラーが起きたチャンクがあれば、その直前までのトークンを返し、その先は逐次の字句解析に任せる。 */
+static Token *lex_round(void){
+    ctx -> lex_round++;
+    int first = ctx -> lex_next_chunk;
+    int n = MIN(lex_threads, ctx -> lex_nchunks - first);
+    LexJob job = {ctx, calloc(n, sizeof(Chunk))};
+    for(int i = 0; i < n; i++){
+        job.chunks[i].start = ctx -> lex_bounds[first + i];
+        job.chunks[i].end = ctx -> lex_bounds[first + i + 1];
+    }
+    parallel_for(n, lex_threads, lex_chunk, &job);
+
+    LexRound *round = calloc(1, sizeof(LexRound));
+    round -> id = ctx -> lex_round;
+    LexRound **last = &ctx -> lex_rounds;
+    while(*last)
+        last = &(*last) -> next;
+    *last = round;
+
+    Token head = {};
+    Token *cur = &head;
+    bool failed = false;
+    for(int i = 0; i < n; i++){
+        Chunk *ch = &job.chunks[i];
+        if(!failed && ch -> head.next){
+            cur -> next = ch -> head.next;
+            cur = ch -> tail;
         }
-        
-        /* puctuators */
-        int punct_len = read_puct(p);
-        if(punct_len){
-            cur = cur -> next = new_token(TK_PUNCT, p, p + punct_len);
-            p += punct_len;
-            continue;
+        if(!failed && ch -> resume){
+            failed = true;
+            ctx -> lex_pos = ch -> resume;
+            ctx -> lex_bol = ch -> resume_bol;
+            ctx -> lex_next_chunk = ctx -> lex_nchunks;
         }
+        arena_adopt(&round -> tokens, &ch -> tokens);
+        arena_adopt(&ctx -> token_arena, &ch -> strings);
+        arena_adopt(&ctx -> type_arena, &ch -> types);
+    }
+    free(job.chunks);
 
-        /* それ以外 */
-        error_at(p, "トークナイズできません\n");
+    if(!failed){
+        ctx -> lex_next_chunk += n;
+        ctx -> lex_pos = ctx -> lex_bounds[ctx -> lex_next_chunk];
     }
+    return head.next;
+}
 
-    /* 終了を表すトークンを作成 */
-    cur = cur -> next = new_token(TK_EOF, p, p);
+/* 主ファイルの次のトークン。並列に字句解析した場合はリストの先頭が返る。 */
+Token *lex_next(void){
+    while(ctx -> lex_next_chunk < ctx -> lex_nchunks){
+        Token *tok = lex_round();
+        if(tok)
+            return tok;
+        // コメントだけのチャンクなど、トークンがなければ次へ
+    }
+    return lex();
+}
 
-    convert_keywords(head.next);
+/* idより前の回に字句解析したトークンを解放する */
+static void release_rounds(int id){
+    while(ctx -> lex_rounds && ctx -> lex_rounds -> id < id){
+        LexRound *round = ctx -> lex_rounds;
+        ctx -> lex_rounds = round -> next;
+        arena_release(&round -> tokens);
+        free(round);
+    }
+}
+
+/* tokの次のトークンを返す。まだトークナイズしていなければここで読む。 */
+Token *next_of(Token *tok){
+    if(!tok -> next && tok -> kind != TK_EOF)
+        tok -> next = preprocess_next();
+    return tok -> next;
+}
+
+/* lexと同じくwindowに確保したコピー。nextは持たない。 */
+Token *copy_token(Token *tok){
+    Token *t = arena_alloc(&ctx -> token_window[ctx -> cur_window], sizeof(Token));
+    *t = *tok;
+    t -> next = NULL;
+    return t;
+}
+
+/* tokから始まるリストをwindowにコピーする */
+Token *copy_list(Token *tok){
+    Token head = {};
+    Token *cur = &head;
+    for(; tok; tok = tok -> next)
+        cur = cur -> next = copy_token(tok);
+    return head.next;
+}
 
-    /* トークンの先頭へのポインタをセット */
-    token = head.next;
+/*  現在のトークンより前のトークンを捨てる。
+    トップレベルの宣言の区切りではそれより前のトークンに戻ることはないので、そこで呼ぶ。
+    既に先読みしているトークンとプリプロセッサが持っているトークンは新しい方のwindowにコピーし、古いwindowを解放する。
+    読み終えたincludeファイルのトークンと、並列に字句解析した回のうち読み終えたものも解放する。 */
+void discard_tokens(void){
+    Arena *old = &ctx -> token_window[ctx -> cur_window];
+    ctx -> cur_window ^= 1;
+    ctx -> token = copy_list(ctx -> token);
+    discard_pp_tokens();
+    arena_release(old);
+    if(ctx -> lex_nchunks)
+        release_rounds(ctx -> raw_cursor ? ctx -> raw_cursor -> round : ctx -> lex_round + 1);
 }
 
+/*  *posから1トークンを字句解析してarenaに確保する。*posと*bolは次のトークンの位置と行頭かどうか。
+    includeしたファイルは主ファイルと別の位置を持っていて、プリプロセッサが必要になった時にこれで読む。 */
+Token *lex_from(char **pos, bool *bol, Arena *arena){
+    char *saved_pos = ctx -> lex_pos;
+    char *saved_end = ctx -> lex_end;
+    Arena *saved_arena = ctx -> lex_arena;
+    bool saved_bol = ctx -> lex_bol;
+    ctx -> lex_pos = *pos;
+    ctx -> lex_end = NULL;
+    ctx -> lex_arena = arena;
+    ctx -> lex_bol = *bol;
+
+    Token *tok = lex();
+    *pos = ctx -> lex_pos;
+    *bol = ctx -> lex_bol;
+
+    ctx -> lex_pos = saved_pos;
+    ctx -> lex_end = saved_end;
+    ctx -> lex_arena = saved_arena;
+    ctx -> lex_bol = saved_bol;
+    return tok;
+}
+
+/* pからの'\0'で終わる入力をすべて字句解析してリストを返す。トークンはarenaに確保する。 */
+Token *lex_buffer(char *p, Arena *arena){
+    bool bol = true;
+    Token head = {};
+    Token *cur = &head;
+    do{
+        cur = cur -> next = lex_from(&p, &bol, arena);
+    }while(cur -> kind != TK_EOF);
+    return head.next;
+}
 
+static void lock(atomic_int *l){
+    while(atomic_exchange_explicit(l, 1, memory_order_acquire))
+        sched_yield();
+}
+
+static void unlock(atomic_int *l){
+    atomic_store_explicit(l, 0, memory_order_release);
+}
+
+/*  識別子の名前を一意な文字列に変換する。同じ名前には常に同じポインタを返すので、
+    名前の比較はポインタの比較で済む。 */
+char *intern(char *s, int len){
+    // 表の中の位置はハッシュ値の下位ビットで決まるので、表を選ぶのには上位ビットを使う
+    uint64_t hash = fnv_hash(s, len);
+    AtomShard *shard = &ctx -> atoms[(hash >> 32) % ATOM_SHARDS];
+    lock(&shard -> lock);
+    char *atom = hashmap_get2(&shard -> map, s, len);
+    if(!atom){
+        atom = ctx -> pch ? pch_find_atom(s, len, hash) : NULL; // プリコンパイルしたヘッダにある名前はそれを使う
+        if(!atom){
+            atom = arena_alloc(&ctx -> token_arena, len + 1);
+            memcpy(atom, s, len);
+        }
+        hashmap_put2(&shard -> map, atom, len, atom);
+    }
+    unlock(&shard -> lock);
+    return atom;
+}
+
+/* 型の名前などトークンを捨てた後も使うものはコピーしておく */
+Token *keep_token(Token *tok){
+    Token *ret = arena_alloc(&ctx -> token_arena, sizeof(Token));
+    *ret = *tok;
+    ret -> next = NULL;
+    return ret;
+}
+
+/*  入力文字列のトークナイズを開始する。最初のトークンだけを読んでtokenにセットする。
+    トークンはプリプロセッサを通してからパーサに渡る。
+    lex_threadsが2以上で入力が大きければ、チャンクに区切って並列に字句解析する。 */
+void tokenize(char *path, char* p){
+    ctx -> path = path;
+    ctx -> input = p;
+    ctx -> lex_pos = p;
+    ctx -> lex_bol = true;
+    if(!ctx -> atoms)
+        ctx -> atoms = calloc(ATOM_SHARDS, sizeof(AtomShard));
+
+    free(ctx -> lex_bounds);
+    ctx -> lex_bounds = NULL;
+    ctx -> lex_nchunks = ctx -> lex_next_chunk = 0;
+    if(lex_threads > 1){
+        split_input(p);
+        if(ctx -> lex_nchunks < 2){
+            free(ctx -> lex_bounds);
+            ctx -> lex_bounds = NULL;
+            ctx -> lex_nchunks = 0;
+        }
+    }
+    init_preprocessor();
+    ctx -> token = preprocess_next();
+}
+
+void free_lexer(void){
+    release_rounds(INT32_MAX);
+    free(ctx -> lex_bounds);
+    if(ctx -> atoms)
+        for(int i = 0; i < ATOM_SHARDS; i++)
+            hashmap_free(&ctx -> atoms[i].map);
+    free(ctx -> atoms);
+    arena_release(&ctx -> token_window[0]);
+    arena_release(&ctx -> token_window[1]);
+}
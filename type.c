@@ -11,37 +11,81 @@ Type *ty_ushort = &(Type){TY_SHORT, 2, 2, true};
 Type *ty_uint = &(Type){TY_INT, 4, 4, true};
 Type *ty_ulong = &(Type){TY_LONG, 8, 8, true};
 
+/* ty_intなどの、全てのコンパイル(スレッド)で共有している型かどうか */
+bool is_builtin(Type *ty){
+    return ty == ty_long || ty == ty_int || ty == ty_short || ty == ty_char || ty == ty_void ||
+           ty == ty_bool || ty == ty_uchar || ty == ty_ushort || ty == ty_uint || ty == ty_ulong;
+}
+
 Type *new_type(TypeKind kind, int size, int align){
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_alloc(&ctx -> type_arena, sizeof(Type));
     ty -> kind = kind;
     ty -> size = size;
     ty -> align = align;
     return ty;
 }
 
+/*  pointerとarrayは(kind, base, 要素数)ごとに一つのTypeを共有する。型の比較はポインタの比較で済む。
+    declaratorは返した型のnameを書き換えるが、ty_intなどと同様にすぐに読み出されるので問題ない。 */
+typedef struct{
+    TypeKind kind;
+    int len;
+    Type *base;
+}TypeKey;
+
+static Type *find_type(TypeKey *key){
+    return hashmap_get2(&ctx -> type_table, (char*)key, sizeof(TypeKey));
+}
+
+static void register_type(TypeKey *key, Type *ty){
+    TypeKey *k = arena_alloc(&ctx -> type_arena, sizeof(TypeKey));
+    *k = *key;
+    hashmap_put2(&ctx -> type_table, (char*)k, sizeof(TypeKey), ty);
+}
+
 Type* pointer_to(Type *base){
-    Type *ty = new_type(TY_PTR, 8, 8);
+    TypeKey key = {TY_PTR, 0, base};
+    Type *ty = find_type(&key);
+    if(ty)
+        return ty;
+
+    ty = new_type(TY_PTR, 8, 8);
     ty -> is_unsigned = true;
     ty -> base = base;
+    register_type(&key, ty);
     return ty;
 }
 
 Type* array_of(Type *base, int array_len){
-    Type * ty = new_type(TY_ARRAY, base -> size * array_len, base -> align);
+    TypeKey key = {TY_ARRAY, array_len, base};
+    Type *ty = (base -> size < 0) ? NULL : find_type(&key);
+    if(ty)
+        return ty;
+
+    ty = new_type(TY_ARRAY, base -> size * array_len, base -> align);
     ty -> base = base;
     ty -> array_len = array_len;
+    /* 不完全型の構造体は後で大きさが決まるので共有しない */
+    if(base -> size >= 0)
+        register_type(&key, ty);
     return ty;
 }
 
+/* プリコンパイルしたヘッダのpointerとarrayを表に入れ、pointer_toとarray_ofが同じTypeを返すようにする */
+void share_type(Type *ty){
+    TypeKey key = {ty -> kind, ty -> kind == TY_ARRAY ? ty -> array_len : 0, ty -> base};
+    register_type(&key, ty);
+}
+
 Type* func_type(Type *ret_ty){
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_alloc(&ctx -> type_arena, sizeof(Type));
     ty -> kind = TY_FUNC;
     ty -> ret_ty = ret_ty;
     return ty;
 }
 
 Type* copy_type(Type *ty){
-    Type *ret = calloc(1, sizeof(Type));
+    Type *ret = arena_alloc(&ctx -> type_arena, sizeof(Type));
     *ret = *ty;
     return ret;
 }
@@ -116,20 +160,32 @@ void add_type(Node *node) {
     add_type(node -> rhs);
     add_type(node -> lhs);
 
-    add_type(node -> cond);
-    add_type(node -> then);
-    add_type(node -> els);
-    add_type(node -> init);
-    add_type(node -> inc);
-
-    /* ND_BLOCK or ND_STMT_EXPR */
-    for(Node *stmt = node -> body; stmt; stmt = stmt -> next){
-        add_type(stmt);
-    }   
-
-    /* ND_FUNCALL */
-    for(Node *arg = node -> args; arg; arg = arg -> next){
-        add_type(arg);
+    /* kindごとに使っている子だけをたどる */
+    switch(node -> kind){
+        case ND_IF:
+        case ND_COND:
+        case ND_FOR:
+        case ND_DO:
+        case ND_SWITCH:
+            add_type(node -> cond);
+            add_type(node -> then);
+            add_type(node -> els);
+            if(node -> kind == ND_FOR){
+                add_type(node -> init);
+                add_type(node -> inc);
+            }
+            break;
+        case ND_BLOCK:
+        case ND_STMT_EXPR:
+            for(Node *stmt = node -> body; stmt; stmt = stmt -> next){
+                add_type(stmt);
+            }
+            break;
+        case ND_FUNCCALL:
+            for(Node *arg = node -> args; arg; arg = arg -> next){
+                add_type(arg);
+            }
+            break;
     }
 
     switch (node -> kind) {